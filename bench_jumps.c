@@ -0,0 +1,231 @@
+/* userspace microbenchmark: what a call through a hooked function costs with
+    each way of jumping between site, detour and trampoline
+
+    gcc -O2 -o bench_jumps bench_jumps.c omni_x86_lde.c
+    ./bench_jumps [iterations] [depth]
+
+    x86-64 only; everything is built in one RWX mapping with the very code
+    the backends emit:
+
+    direct      - plain call, no hook
+    push/ret    - linux site (jmp rel32), trampoline back with pushq/retq
+    rel32       - linux site (jmp rel32), trampoline back with jmp rel32
+    rip         - linux site (jmp rel32), trampoline back with jmp *0(%rip)
+    bsd push    - freebsd site and trampoline both pushq/retq
+    bsd rip     - freebsd site and trampoline both jmp *0(%rip) (far malloc)
+
+    each call is made at the bottom of a chain of depth nested calls, which
+    all return through the return stack buffer afterwards: an unmatched ret
+    shifts the buffer by one and every return above it mispredicts */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "omni_x86_lde.h"
+
+#define BENCH_SLOT 128
+
+typedef long (*bench_fn)(long);
+
+/* the hooked function: rdi + 1 with enough whole instructions to steal up
+    to 15 bytes, then ret */
+static const uint8_t bench_src[] = {
+    0x48, 0x89, 0xf8, /* mov %rdi,%rax */
+    0x48, 0x83, 0xc0, 0x01, /* add $0x1,%rax */
+    0x48, 0x83, 0xc0, 0x00, /* add $0x0,%rax */
+    0x48, 0x83, 0xc0, 0x00, /* add $0x0,%rax */
+    0xc3 /* ret */
+};
+
+enum {
+    TAIL_PUSHRET,
+    TAIL_REL32,
+    TAIL_RIP
+};
+
+struct bench_case {
+    const char *name;
+    int site; // how src jumps to the detour
+    int tail; // how the trampoline jumps back to src
+    bench_fn fn;
+};
+
+static uint8_t *bench_mem;
+static unsigned int bench_used;
+
+static uint8_t *
+bench_slot(void)
+{
+    uint8_t *slot = bench_mem + bench_used;
+
+    bench_used += BENCH_SLOT;
+    memset(slot, 0xcc, BENCH_SLOT);
+
+    return slot;
+}
+
+/* writes the requested kind of jump, returns its length */
+static int
+bench_jmp(uint8_t *out, uintptr_t target, int kind)
+{
+    uint64_t abs = target;
+
+    switch(kind) {
+        case TAIL_PUSHRET:
+            /* pushq 0x1(%rip); retq; <8-byte absolute address> */
+            memcpy(out, "\xff\x35\x01\x00\x00\x00\xc3", 7);
+            memcpy(out + 7, &abs, 8);
+            return 15;
+        case TAIL_RIP:
+            /* jmp *0(%rip); <8-byte absolute address> */
+            memcpy(out, "\xff\x25\x00\x00\x00\x00", 6);
+            memcpy(out + 6, &abs, 8);
+            return X86_JMP_ABS;
+        default:
+            return omni_x86_jmp(out, (uintptr_t)out, target, 1);
+    }
+}
+
+/* src copy, detour (call trampoline; ret) and trampoline, wired together */
+static bench_fn
+bench_hook(int site, int tail)
+{
+    int n, jmp_len;
+    unsigned int stolen;
+    uint8_t *src = bench_slot(), *dst = bench_slot(), *tramp = bench_slot();
+    uint8_t tmp[16];
+
+    memcpy(src, bench_src, sizeof(bench_src));
+
+    jmp_len = bench_jmp(tmp, (uintptr_t)dst, site);
+
+    n = omni_x86_steal(src, (uintptr_t)src, jmp_len, tramp, (uintptr_t)tramp,
+        BENCH_SLOT - 15, &stolen, 1);
+    if(n < 0) {
+        return NULL;
+    }
+
+    bench_jmp(tramp + n, (uintptr_t)src + stolen, tail);
+
+    /* detour: call trampoline; ret */
+    dst[0] = 0xe8;
+    *(int32_t *)(dst + 1) = (int32_t)(tramp - (dst + 5));
+    dst[5] = 0xc3;
+
+    bench_jmp(src, (uintptr_t)dst, site);
+    memset(src + jmp_len, 0xcc, stolen - jmp_len);
+
+    return (bench_fn)src;
+}
+
+//-----------------------------------------------------------------------------
+// CALL CHAIN
+//-----------------------------------------------------------------------------
+
+static long (*volatile bench_chain_ptr)(int, bench_fn, long);
+
+/* recursion through a volatile pointer, so every level is a real call
+    with a real ret */
+static long
+bench_chain(int depth, bench_fn fn, long x)
+{
+    if(!depth) {
+        return fn(x);
+    }
+
+    return bench_chain_ptr(depth - 1, fn, x) + 1;
+}
+
+static double
+bench_run(bench_fn fn, long iterations, int depth)
+{
+    long i, sum = 0;
+    struct timespec t0, t1;
+
+    /* warm up */
+    for(i = 0; i < 10000; ++i) {
+        sum += bench_chain_ptr(depth, fn, i);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < iterations; ++i) {
+        sum += bench_chain_ptr(depth, fn, i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if(sum == 42) {
+        printf("\n");
+    }
+
+    return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+        iterations;
+}
+
+//-----------------------------------------------------------------------------
+// MAIN
+//-----------------------------------------------------------------------------
+
+int
+main(int ac, char **av)
+{
+    unsigned int i;
+    int round, depth = 16;
+    long iterations = 10000000;
+    double best, ns, base = 0;
+    struct bench_case cases[] = {
+        { "direct", 0, 0, NULL },
+        { "push/ret", TAIL_REL32, TAIL_PUSHRET, NULL },
+        { "rel32", TAIL_REL32, TAIL_REL32, NULL },
+        { "rip", TAIL_REL32, TAIL_RIP, NULL },
+        { "bsd push", TAIL_PUSHRET, TAIL_PUSHRET, NULL },
+        { "bsd rip", TAIL_RIP, TAIL_RIP, NULL }
+    };
+
+    if(ac > 1) iterations = atol(av[1]);
+    if(ac > 2) depth = atoi(av[2]);
+
+    bench_mem = mmap(NULL, 0x10000, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(bench_mem == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    bench_chain_ptr = bench_chain;
+
+    cases[0].fn = (bench_fn)bench_slot();
+    memcpy((void *)cases[0].fn, bench_src, sizeof(bench_src));
+
+    for(i = 1; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        cases[i].fn = bench_hook(cases[i].site, cases[i].tail);
+        if(!cases[i].fn || cases[i].fn(41) != 42) {
+            printf("ERROR: building case \"%s\"\n", cases[i].name);
+            return -1;
+        }
+    }
+
+    printf("%ld calls, call chain depth %d, best of 5\n", iterations, depth);
+
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        best = 0;
+        for(round = 0; round < 5; ++round) {
+            ns = bench_run(cases[i].fn, iterations, depth);
+            if(!round || ns < best) {
+                best = ns;
+            }
+        }
+
+        if(!i) {
+            base = best;
+        }
+
+        printf("%-10s %7.2f ns/call (+%.2f over direct)\n", cases[i].name,
+            best, best - base);
+    }
+
+    return 0;
+}
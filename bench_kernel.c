@@ -0,0 +1,557 @@
+/* in-kernel benchmark: the cost of a call through a hooked function, built
+    as a module alongside example.c (same backend, same omni_*.c files)
+
+    every variant is its own copy of one small function, hooked one way
+    (or not at all); a kthread pinned on each online CPU times batches of
+    calls to each variant in turn, all CPUs calling the same variant at
+    the same time, so shared state (stubs, links, in flight counters) is
+    measured under contention rather than on one quiet core
+
+    insmod bench_kernel.ko [samples=1000] [batch=100]
+    cat /sys/kernel/debug/omnihook-bench_kernel/bench
+
+    one line per variant and CPU, cycles per call (ns on arm, where
+    get_cycles() is often unimplemented, timer ticks on arm64, where it
+    reads the generic timer), percentiles over the samples:
+
+    variant cpu p50 p90 p99 max
+
+    direct    the function unhooked
+    detour    a typed detour calling the original through its trampoline
+    chain2    two detours on one function
+    pre       a pre handler thunk (amd64, arm, arm64)
+    ret       a return hook with entry and exit handlers (amd64)
+    kprobe    a kprobe with an empty pre handler (CONFIG_KPROBES)
+    ftrace    an ftrace_ops with an empty callback (CONFIG_DYNAMIC_FTRACE)
+
+    a variant that couldn't be set up is skipped (see dmesg); the hooks
+    are removed once measured, rmmod and insmod again to rerun */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h> /* local_clock() */
+#include <linux/version.h>
+#include <linux/kprobes.h>
+#include <linux/ftrace.h>
+
+#include <asm/timex.h> /* get_cycles() */
+
+#include "omni_typed.h"
+
+static unsigned int samples = 1000;
+module_param(samples, uint, 0444);
+MODULE_PARM_DESC(samples, "timed batches per variant and CPU");
+
+static unsigned int batch = 100;
+module_param(batch, uint, 0444);
+MODULE_PARM_DESC(batch, "calls per timed batch");
+
+#if defined(__arm__)
+#define bench_now() local_clock()
+#define BENCH_UNIT "ns"
+#elif defined(__aarch64__)
+#define bench_now() ((u64)get_cycles())
+#define BENCH_UNIT "ticks"
+#else
+#define bench_now() ((u64)get_cycles())
+#define BENCH_UNIT "cycles"
+#endif
+
+/* the benchmarked function, one copy per variant so hooks don't stack; the
+    body is whole instructions enough to steal a jump from, and __LINE__
+    makes every copy different so identical code folding can't merge them
+    (hooking one would hook them all) */
+#define BENCH_FN(name) \
+    static noinline long \
+    bench_fn_##name(long x) \
+    { \
+        x = x * 3 + __LINE__; \
+        barrier(); \
+        return x ^ (x >> 7); \
+    }
+
+BENCH_FN(direct)
+BENCH_FN(detour)
+BENCH_FN(chain2)
+BENCH_FN(pre)
+BENCH_FN(ret)
+BENCH_FN(kprobe)
+BENCH_FN(ftrace)
+
+//-----------------------------------------------------------------------------
+// VARIANTS
+//-----------------------------------------------------------------------------
+
+OMNIHOOK_DEFINE(bench_fn_detour, long, (long));
+
+static long
+OMNIHOOK_DETOUR(bench_fn_detour)(long x)
+{
+    return OMNIHOOK_ORIG(bench_fn_detour)(x);
+}
+
+static int
+bench_setup_detour(void)
+{
+    return OMNIHOOK_ADD_SYM(bench_fn_detour, bench_fn_detour);
+}
+
+/* two detours on bench_fn_chain2, the first calls the second */
+OMNIHOOK_DEFINE(bench_chain_a, long, (long));
+OMNIHOOK_DEFINE(bench_chain_b, long, (long));
+
+static long
+OMNIHOOK_DETOUR(bench_chain_a)(long x)
+{
+    return OMNIHOOK_ORIG(bench_chain_a)(x);
+}
+
+static long
+OMNIHOOK_DETOUR(bench_chain_b)(long x)
+{
+    return OMNIHOOK_ORIG(bench_chain_b)(x);
+}
+
+static int
+bench_setup_chain2(void)
+{
+    if(0 != OMNIHOOK_ADD(bench_chain_a, bench_fn_chain2)) {
+        return -1;
+    }
+
+    return OMNIHOOK_ADD(bench_chain_b, bench_fn_chain2);
+}
+
+#if defined(__amd64__) || defined(__arm__) || defined(__aarch64__)
+OMNIHOOK_DEFINE_PRE(bench_fn_pre, long, (long));
+
+static void
+OMNIHOOK_PRE(bench_fn_pre)(long x)
+{
+}
+
+static int
+bench_setup_pre(void)
+{
+    return OMNIHOOK_ADD_SYM(bench_fn_pre, bench_fn_pre);
+}
+#else
+#define bench_setup_pre NULL
+#endif
+
+#if defined(__amd64__)
+static int
+bench_ret_entry(struct omnihook_ret *r, unsigned long *args,
+    /* out */ unsigned long *cookie)
+{
+    return 0;
+}
+
+static void
+bench_ret_exit(struct omnihook_ret *r, unsigned long retval, u64 cycles,
+    unsigned long cookie)
+{
+}
+
+static struct omnihook_ret bench_ret = {
+    .entry = bench_ret_entry,
+    .exit = bench_ret_exit,
+};
+
+static int
+bench_setup_ret(void)
+{
+    return omnihook_add_ret(bench_fn_ret, &bench_ret);
+}
+
+static void
+bench_teardown_ret(void)
+{
+    omnihook_remove_ret(bench_fn_ret, &bench_ret);
+}
+#else
+#define bench_setup_ret NULL
+#define bench_teardown_ret NULL
+#endif
+
+#if IS_ENABLED(CONFIG_KPROBES)
+static int
+bench_kprobe_pre(struct kprobe *p, struct pt_regs *regs)
+{
+    return 0;
+}
+
+static struct kprobe bench_kp = {
+    .pre_handler = bench_kprobe_pre,
+};
+
+static int
+bench_setup_kprobe(void)
+{
+    bench_kp.addr = (kprobe_opcode_t *)bench_fn_kprobe;
+
+    return register_kprobe(&bench_kp) ? -1 : 0;
+}
+
+static void
+bench_teardown_kprobe(void)
+{
+    unregister_kprobe(&bench_kp);
+}
+#else
+#define bench_setup_kprobe NULL
+#define bench_teardown_kprobe NULL
+#endif
+
+#if IS_ENABLED(CONFIG_DYNAMIC_FTRACE)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+static void
+bench_ftrace_func(unsigned long ip, unsigned long parent_ip,
+    struct ftrace_ops *op, struct ftrace_regs *fregs)
+{
+}
+#else
+static void
+bench_ftrace_func(unsigned long ip, unsigned long parent_ip,
+    struct ftrace_ops *op, struct pt_regs *regs)
+{
+}
+#endif
+
+static struct ftrace_ops bench_ftrace_ops = {
+    .func = bench_ftrace_func,
+};
+
+static int
+bench_setup_ftrace(void)
+{
+    if(0 != ftrace_set_filter_ip(&bench_ftrace_ops,
+        (unsigned long)bench_fn_ftrace, 0, 0)) {
+        return -1;
+    }
+
+    return register_ftrace_function(&bench_ftrace_ops) ? -1 : 0;
+}
+
+static void
+bench_teardown_ftrace(void)
+{
+    unregister_ftrace_function(&bench_ftrace_ops);
+    ftrace_set_filter_ip(&bench_ftrace_ops, (unsigned long)bench_fn_ftrace,
+        1, 0);
+}
+#else
+#define bench_setup_ftrace NULL
+#define bench_teardown_ftrace NULL
+#endif
+
+struct bench_variant {
+    const char *name;
+    long (*fn)(long);
+    int (*setup)(void); // NULL: nothing to set up (direct) or unavailable
+    void (*teardown)(void); // NULL: omnihook_remove_all() does it
+    int ready; // set up, measured
+};
+
+static struct bench_variant variants[] = {
+    { "direct", bench_fn_direct, NULL, NULL },
+    { "detour", bench_fn_detour, bench_setup_detour, NULL },
+    { "chain2", bench_fn_chain2, bench_setup_chain2, NULL },
+    { "pre", bench_fn_pre, bench_setup_pre, NULL },
+    { "ret", bench_fn_ret, bench_setup_ret, bench_teardown_ret },
+    { "kprobe", bench_fn_kprobe, bench_setup_kprobe, bench_teardown_kprobe },
+    { "ftrace", bench_fn_ftrace, bench_setup_ftrace, bench_teardown_ftrace },
+};
+
+#define BENCH_VARIANTS ARRAY_SIZE(variants)
+
+//-----------------------------------------------------------------------------
+// TIMED LOOPS
+//-----------------------------------------------------------------------------
+
+#define BENCH_PCTS 4 /* p50, p90, p99, max */
+
+static const unsigned int bench_pcts[BENCH_PCTS] = { 500, 900, 990, 1000 };
+
+struct bench_cpu {
+    struct task_struct *task;
+    u32 *samples; // per call, one per timed batch
+    int ran; // has results
+    u32 result[ARRAY_SIZE(variants)][BENCH_PCTS];
+};
+
+static struct bench_cpu *bench_cpus; // by CPU id
+static atomic_t bench_arrived[ARRAY_SIZE(variants)]; // start barriers
+static atomic_t bench_left;
+static int bench_threads;
+static DECLARE_COMPLETION(bench_done);
+
+static int
+bench_u32_cmp(const void *a, const void *b)
+{
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* samples per call through v's function on this CPU, sorted */
+static void
+bench_variant_run(struct bench_variant *v, u32 *out)
+{
+    unsigned int i, j;
+    unsigned long flags;
+    long (*volatile fn)(long) = v->fn;
+    long x = 0;
+    u64 start;
+
+    for(i = 0; i < samples; ++i) {
+        local_irq_save(flags);
+        start = bench_now();
+        for(j = 0; j < batch; ++j) {
+            x = fn(x);
+        }
+        out[i] = (u32)((bench_now() - start) / batch);
+        local_irq_restore(flags);
+
+        if((i & 63) == 63) {
+            cond_resched();
+        }
+    }
+
+    /* keeps the calls */
+    OPTIMIZER_HIDE_VAR(x);
+
+    sort(out, samples, sizeof(u32), bench_u32_cmp, NULL);
+}
+
+static int
+bench_thread(void *data)
+{
+    unsigned int i, k;
+    struct bench_cpu *c = data;
+
+    for(i = 0; i < BENCH_VARIANTS; ++i) {
+        if(!variants[i].ready) {
+            continue;
+        }
+
+        /* every CPU starts the variant together */
+        atomic_inc(&bench_arrived[i]);
+        while(atomic_read(&bench_arrived[i]) < bench_threads) {
+            cpu_relax();
+        }
+
+        bench_variant_run(&variants[i], c->samples);
+
+        for(k = 0; k < BENCH_PCTS; ++k) {
+            c->result[i][k] =
+                c->samples[(samples - 1) * bench_pcts[k] / 1000];
+        }
+    }
+
+    if(atomic_dec_and_test(&bench_left)) {
+        complete(&bench_done);
+    }
+
+    return 0;
+}
+
+/* one pinned thread per online CPU, returns once all of them are done (0)
+    or -errno if they couldn't all be started */
+static int
+bench_run(void)
+{
+    int cpu, rc = -ENOMEM;
+
+    bench_threads = num_online_cpus();
+    atomic_set(&bench_left, bench_threads);
+
+    for_each_online_cpu(cpu) {
+        struct bench_cpu *c = &bench_cpus[cpu];
+
+        c->samples = kcalloc(samples, sizeof(u32), GFP_KERNEL);
+        if(!c->samples) {
+            goto fail;
+        }
+
+        c->task = kthread_create(bench_thread, c, "omnihook_bench/%d", cpu);
+        if(IS_ERR(c->task)) {
+            rc = PTR_ERR(c->task);
+            c->task = NULL;
+            goto fail;
+        }
+
+        kthread_bind(c->task, cpu);
+    }
+
+    for_each_online_cpu(cpu) {
+        bench_cpus[cpu].ran = 1;
+        wake_up_process(bench_cpus[cpu].task);
+    }
+
+    wait_for_completion(&bench_done);
+
+    return 0;
+
+    fail:
+    /* all or none, the others would wait on the missing one forever; the
+        threads created never ran, stopping them just frees them */
+    printk("ERROR: bench thread for cpu%d\n", cpu);
+    for_each_online_cpu(cpu) {
+        if(bench_cpus[cpu].task) {
+            kthread_stop(bench_cpus[cpu].task);
+        }
+    }
+
+    return rc;
+}
+
+//-----------------------------------------------------------------------------
+// DEBUGFS
+//-----------------------------------------------------------------------------
+
+static int
+bench_file_show(struct seq_file *m, void *unused)
+{
+    int cpu;
+    unsigned int i;
+
+    seq_printf(m, "# %s per call, %u batches of %u calls\n", BENCH_UNIT,
+        samples, batch);
+    seq_printf(m, "# variant cpu p50 p90 p99 max\n");
+
+    for(i = 0; i < BENCH_VARIANTS; ++i) {
+        if(!variants[i].ready) {
+            continue;
+        }
+
+        for_each_possible_cpu(cpu) {
+            u32 *r = bench_cpus[cpu].result[i];
+
+            if(!bench_cpus[cpu].ran) {
+                continue;
+            }
+
+            seq_printf(m, "%s %d %u %u %u %u\n", variants[i].name, cpu,
+                r[0], r[1], r[2], r[3]);
+        }
+    }
+
+    return 0;
+}
+
+static int
+bench_file_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, bench_file_show, NULL);
+}
+
+static const struct file_operations bench_fops = {
+    .owner = THIS_MODULE,
+    .open = bench_file_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+//-----------------------------------------------------------------------------
+// MODULE
+//-----------------------------------------------------------------------------
+
+static void
+bench_teardown(void)
+{
+    unsigned int i;
+
+    for(i = 0; i < BENCH_VARIANTS; ++i) {
+        if(variants[i].ready && variants[i].teardown) {
+            variants[i].teardown();
+        }
+    }
+
+    omnihook_remove_all();
+}
+
+static int __init
+bench_init(void)
+{
+    int rc = -ENODEV;
+    unsigned int i;
+
+    if(!samples || !batch) {
+        return -EINVAL;
+    }
+
+    bench_cpus = kcalloc(nr_cpu_ids, sizeof(*bench_cpus), GFP_KERNEL);
+    if(!bench_cpus) {
+        return -ENOMEM;
+    }
+
+    if(0 != omnihook_init()) {
+        goto cleanup;
+    }
+
+    for(i = 0; i < BENCH_VARIANTS; ++i) {
+        if(variants[i].fn == bench_fn_direct) {
+            variants[i].ready = 1;
+        }
+        else if(!variants[i].setup) {
+            printk("omnihook bench: %s unavailable here\n", variants[i].name);
+        }
+        else if(0 != variants[i].setup()) {
+            printk("omnihook bench: %s couldn't be set up\n",
+                variants[i].name);
+        }
+        else {
+            variants[i].ready = 1;
+        }
+    }
+
+    rc = bench_run();
+
+    bench_teardown();
+
+    if(0 != rc) {
+        omnihook_exit();
+        goto cleanup;
+    }
+
+    if(omni_debugfs_dir()) {
+        debugfs_create_file("bench", 0400, omni_debugfs_dir(), NULL,
+            &bench_fops);
+    }
+
+    cleanup:
+    /* the results are kept, the samples they came from aren't */
+    for(i = 0; i < nr_cpu_ids; ++i) {
+        kfree(bench_cpus[i].samples);
+    }
+
+    if(0 != rc) {
+        kfree(bench_cpus);
+    }
+
+    return rc;
+}
+
+static void __exit
+bench_exit(void)
+{
+    /* removes debugfs:omnihook-bench_kernel/bench with the rest */
+    omnihook_exit();
+
+    kfree(bench_cpus);
+}
+
+module_init(bench_init);
+module_exit(bench_exit);
+
+MODULE_LICENSE("GPL");
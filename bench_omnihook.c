@@ -0,0 +1,222 @@
+/* userspace benchmark of the patch engine (omni_linux_user_amd64.c): hook
+    install and remove throughput, call overhead, memory per hook
+
+    gcc -O2 -o bench_omnihook bench_omnihook.c omni_linux_user_amd64.c \
+        omni_x86_lde.c -lpthread
+    ./bench_omnihook [max hooks] [iterations]
+
+    x86-64 only; hooked functions are copies of one small function in an RWX
+    mapping, counts go 1, 10, 100, ... up to max hooks (default 100000)
+
+    output is one JSON object per line, the first describes the run:
+
+    {"bench":"omnihook","schema":1,...}
+    {"test":"install","hooks":N,"ns_per_hook":...,"hooks_per_sec":...}
+    {"test":"remove","hooks":N,"ns_per_hook":...,"hooks_per_sec":...}
+    {"test":"memory","hooks":N,"bytes_per_hook":...,...}
+    {"test":"call","variant":"direct"|"hooked","ns_per_call":...}
+
+    "hooked" is a call through the site, a detour that calls its trampoline,
+    and the trampoline back to the original */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "omni_linux_user_amd64.h"
+
+#define BENCH_STRIDE 32
+
+typedef long (*bench_fn)(long);
+
+/* the hooked function: rdi + 1 with enough whole instructions to steal up
+    to 15 bytes, then ret */
+static const uint8_t bench_src[] = {
+    0x48, 0x89, 0xf8, /* mov %rdi,%rax */
+    0x48, 0x83, 0xc0, 0x01, /* add $0x1,%rax */
+    0x48, 0x83, 0xc0, 0x00, /* add $0x0,%rax */
+    0x48, 0x83, 0xc0, 0x00, /* add $0x0,%rax */
+    0xc3 /* ret */
+};
+
+static uint8_t *bench_mem;
+static long bench_max = 100000;
+
+static bench_fn bench_trampoline;
+
+static double
+bench_now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void *
+bench_target(long i)
+{
+    return bench_mem + i * BENCH_STRIDE;
+}
+
+static long __attribute__((noinline))
+bench_detour(long x)
+{
+    return bench_trampoline(x);
+}
+
+//-----------------------------------------------------------------------------
+// INSTALL/REMOVE
+//-----------------------------------------------------------------------------
+
+static int
+bench_hooks(long count)
+{
+    long i;
+    void *tramp;
+    double t0, t1, t2;
+    struct omnihook_mem mem;
+
+    t0 = bench_now();
+    for(i = 0; i < count; ++i) {
+        if(0 != omnihook_add(bench_target(i), (void *)bench_detour, &tramp)) {
+            fprintf(stderr, "ERROR: hooking target %ld\n", i);
+            return -1;
+        }
+    }
+    t1 = bench_now();
+
+    omnihook_mem(&mem);
+
+    for(i = 0; i < count; ++i) {
+        if(0 != omnihook_remove(bench_target(i))) {
+            fprintf(stderr, "ERROR: unhooking target %ld\n", i);
+            return -1;
+        }
+    }
+    t2 = bench_now();
+
+    printf("{\"test\":\"install\",\"hooks\":%ld,\"ns_per_hook\":%.1f,"
+        "\"hooks_per_sec\":%.0f}\n", count, (t1 - t0) / count,
+        count * 1e9 / (t1 - t0));
+    printf("{\"test\":\"remove\",\"hooks\":%ld,\"ns_per_hook\":%.1f,"
+        "\"hooks_per_sec\":%.0f}\n", count, (t2 - t1) / count,
+        count * 1e9 / (t2 - t1));
+
+    /* slots and bookkeeping actually in use by count hooks; pool_bytes also
+        counts chunks left over from larger runs */
+    printf("{\"test\":\"memory\",\"hooks\":%ld,\"bytes_per_hook\":%.1f,"
+        "\"pool_bytes\":%lu,\"pool_used\":%lu,\"table_bytes\":%lu,"
+        "\"hook_bytes\":%lu}\n", count,
+        (double)(mem.pool_used + mem.table_bytes + mem.hook_bytes) / count,
+        mem.pool_bytes, mem.pool_used, mem.table_bytes, mem.hook_bytes);
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// CALL OVERHEAD
+//-----------------------------------------------------------------------------
+
+static double
+bench_call(bench_fn volatile *fn, long iterations)
+{
+    long i, sum = 0;
+    double t0, best = 0, ns;
+    int round;
+
+    for(round = 0; round < 5; ++round) {
+        t0 = bench_now();
+        for(i = 0; i < iterations; ++i) {
+            sum += (*fn)(i);
+        }
+        ns = (bench_now() - t0) / iterations;
+
+        if(!round || ns < best) {
+            best = ns;
+        }
+    }
+
+    if(sum == 42) {
+        printf("\n");
+    }
+
+    return best;
+}
+
+static int
+bench_calls(long iterations)
+{
+    void *tramp;
+    bench_fn volatile fn = (bench_fn)bench_target(0);
+
+    printf("{\"test\":\"call\",\"variant\":\"direct\",\"ns_per_call\":%.2f}\n",
+        bench_call(&fn, iterations));
+
+    if(0 != omnihook_add(bench_target(0), (void *)bench_detour, &tramp)) {
+        return -1;
+    }
+    bench_trampoline = (bench_fn)tramp;
+
+    if(fn(41) != 42) {
+        fprintf(stderr, "ERROR: hooked call returned %ld\n", fn(41));
+        return -1;
+    }
+
+    printf("{\"test\":\"call\",\"variant\":\"hooked\",\"ns_per_call\":%.2f}\n",
+        bench_call(&fn, iterations));
+
+    return omnihook_remove(bench_target(0));
+}
+
+//-----------------------------------------------------------------------------
+// MAIN
+//-----------------------------------------------------------------------------
+
+int
+main(int ac, char **av)
+{
+    long i, count, iterations = 10000000;
+
+    if(ac > 1) bench_max = atol(av[1]);
+    if(ac > 2) iterations = atol(av[2]);
+
+    if(bench_max < 1) {
+        bench_max = 1;
+    }
+
+    bench_mem = mmap(NULL, bench_max * BENCH_STRIDE,
+        PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(bench_mem == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    for(i = 0; i < bench_max; ++i) {
+        memset(bench_target(i), 0xcc, BENCH_STRIDE);
+        memcpy(bench_target(i), bench_src, sizeof(bench_src));
+    }
+
+    printf("{\"bench\":\"omnihook\",\"schema\":1,\"max_hooks\":%ld,"
+        "\"iterations\":%ld,\"sizeof_hook\":%zu}\n", bench_max, iterations,
+        sizeof(hook));
+
+    for(count = 1; count <= bench_max; count *= 10) {
+        if(0 != bench_hooks(count)) {
+            return -1;
+        }
+    }
+
+    if(0 != bench_calls(iterations)) {
+        return -1;
+    }
+
+    omnihook_remove_all();
+    omnihook_exit();
+
+    return 0;
+}
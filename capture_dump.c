@@ -0,0 +1,134 @@
+/* userspace reader of the capture rings (omni_linux_capture.c): maps
+    /dev/omnihook_capture and prints every record as it arrives, read in
+    place, nothing is copied out of the kernel
+
+    gcc -O2 -o capture_dump capture_dump.c
+    ./capture_dump [device]
+
+    one line per record:
+
+    <time ns> cpu<N> pid=<pid> tgid=<tgid> src=<address> <args in hex>
+
+    and a line per CPU whenever its lost count grows */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "omni_linux_capture.h"
+
+/* the kernel lays out one area per CPU id, up to the highest possible one */
+static long
+possible_cpus(void)
+{
+    long lo, hi = 0;
+    char buf[256], *p = buf;
+    FILE *f = fopen("/sys/devices/system/cpu/possible", "r");
+
+    if(!f) {
+        return -1;
+    }
+
+    if(!fgets(buf, sizeof(buf), f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    /* "0-3,8-11": the last number is the highest */
+    while(*p) {
+        lo = strtol(p, &p, 10);
+        hi = lo > hi ? lo : hi;
+        if(*p) p++;
+    }
+
+    return hi + 1;
+}
+
+int
+main(int ac, char **av)
+{
+    int fd;
+    long cpus, cpu;
+    unsigned int i;
+    uint64_t head, tail, area_size, *lost;
+    uint8_t *map;
+    struct omnihook_capture_ring *r;
+    struct omnihook_capture_rec *rec;
+
+    fd = open(ac > 1 ? av[1] : "/dev/omnihook_capture", O_RDWR);
+    if(fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    cpus = possible_cpus();
+    if(cpus < 1) {
+        fprintf(stderr, "ERROR: can't read the possible CPUs\n");
+        return -1;
+    }
+
+    /* the first header says how big every area is */
+    r = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+    if(r == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    area_size = r->area_size;
+    munmap(r, getpagesize());
+
+    map = mmap(NULL, cpus * area_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0);
+    if(map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    lost = calloc(cpus, sizeof(*lost));
+    if(!lost) {
+        return -1;
+    }
+
+    for(;;) {
+        int idle = 1;
+
+        for(cpu = 0; cpu < cpus; ++cpu) {
+            r = (struct omnihook_capture_ring *)(map + cpu * area_size);
+            rec = (struct omnihook_capture_rec *)((uint8_t *)r + getpagesize());
+
+            head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            tail = r->tail;
+
+            for(; tail != head; ++tail) {
+                struct omnihook_capture_rec *c = &rec[tail & (r->records - 1)];
+
+                printf("%llu cpu%u pid=%u tgid=%u src=0x%llx",
+                    (unsigned long long)c->time, c->cpu, c->pid, c->tgid,
+                    (unsigned long long)c->src);
+                for(i = 0; i < c->nargs && i < OMNI_CAPTURE_ARGS; ++i) {
+                    printf(" %llx", (unsigned long long)c->args[i]);
+                }
+                putchar('\n');
+                idle = 0;
+            }
+
+            /* hands the records back */
+            __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+            if(r->lost != lost[cpu]) {
+                lost[cpu] = r->lost;
+                printf("cpu%ld lost=%llu\n", cpu, (unsigned long long)lost[cpu]);
+            }
+        }
+
+        if(idle) {
+            fflush(stdout);
+            usleep(10000);
+        }
+    }
+
+    return 0;
+}
@@ -1,35 +1,41 @@
 /* linux hooking example */
 
-#include "omnihook_linux_i386_amd64.h"
+#include <linux/module.h>
+#include <linux/input.h> /* input_event() */
 
-void (*trampoline_input_event)(void *dev, unsigned int type, 
-    unsigned int code, int value);
+#include "omni_typed.h"
 
-void
-detour_input_event(void *dev, unsigned int type, unsigned int code, int value)
+/* declares the trampoline OMNIHOOK_ORIG(input_event) and the detour, both
+    typed after input_event() */
+OMNIHOOK_DEFINE(input_event, void,
+    (struct input_dev *, unsigned int, unsigned int, int));
+
+static void
+OMNIHOOK_DETOUR(input_event)(struct input_dev *dev, unsigned int type,
+    unsigned int code, int value)
 {
     /* prove we worked */
     printk("IT WORKS!\n");
 
     /* pass execution through */
-    return trampoline_input_event(dev, type, code, value);
+    OMNIHOOK_ORIG(input_event)(dev, type, code, value);
 }
 
-static int __init 
+static int __init
 example_init(void)
 {
     int rc = -1;
-    uintptr_t addr;   
 
-    /* resolve target function */
-    addr = kallsyms_lookup_name("input_event");
-    if(!addr) { 
-        printk("ERROR: resolving input_event()\n"); 
-        goto cleanup; 
+    if(0 != omnihook_init()) {
+        goto cleanup;
     }
 
-    /* hook it */
-    omnihook_add((void *)addr, detour_input_event, (void **)&trampoline_input_event);
+    /* hook it, refused at compile time if the detour doesn't match */
+    if(0 != OMNIHOOK_ADD_SYM(input_event, input_event)) {
+        printk("ERROR: hooking input_event()\n");
+        omnihook_exit();
+        goto cleanup;
+    }
 
     rc = 0;
 
@@ -37,11 +43,12 @@ example_init(void)
     return rc;
 }
 
-static void __exit 
+static void __exit
 example_exit(void)
 {
     /* unhook all */
     omnihook_remove_all();
+    omnihook_exit();
 }
 
 module_init(example_init);
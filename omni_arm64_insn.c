@@ -0,0 +1,344 @@
+#if defined(__linux__) && defined(__KERNEL__)
+#include <linux/types.h>
+#include <linux/string.h> /* memcpy() */
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#include "omni_arm64_insn.h"
+
+/* every relocated instruction takes at most one literal */
+#define A64_LITS_MAX A64_STEAL_MAX
+
+#define A64_BR_X16 0xd61f0200
+#define A64_X16 16
+
+/* out buffer, literals are placed (and their loads fixed up) at the end */
+struct a64_out {
+    uint8_t *code;
+    uintptr_t at; // address code executes at
+    unsigned int len;
+    unsigned int max;
+    int nospace;
+    unsigned int nlits;
+    unsigned int lit_load[A64_LITS_MAX]; // offset of the ldr of each literal
+    uint64_t lit[A64_LITS_MAX];
+};
+
+static int64_t
+a64_sext(uint64_t value, int bits)
+{
+    return (int64_t)(value << (64 - bits)) >> (64 - bits);
+}
+
+static void
+a64_emit(struct a64_out *o, uint32_t insn)
+{
+    if(o->len + A64_INSN > o->max) {
+        o->nospace = 1;
+        return;
+    }
+
+    memcpy(o->code + o->len, &insn, A64_INSN);
+    o->len += A64_INSN;
+}
+
+/* ldr xt, =value */
+static void
+a64_emit_ldr_lit(struct a64_out *o, unsigned int rt, uint64_t value)
+{
+    o->lit_load[o->nlits] = o->len;
+    o->lit[o->nlits++] = value;
+    a64_emit(o, 0x58000000 | rt);
+}
+
+/* the imm field (bits wide, in instructions) of a branch from at to
+    target; 0 if out of its reach */
+static int
+a64_reach(uintptr_t at, uintptr_t target, int bits, /* out */ uint32_t *imm)
+{
+    int64_t offset = (int64_t)(target - at);
+    int64_t reach = (int64_t)1 << (bits + 1);
+
+    if(offset < -reach || offset >= reach || (offset & 3)) {
+        return 0;
+    }
+
+    *imm = ((uint64_t)offset >> 2) & ((1U << bits) - 1);
+
+    return 1;
+}
+
+/* places the literal pool after the code and points every ldr at its
+    literal */
+static void
+a64_emit_lits(struct a64_out *o)
+{
+    unsigned int i, pool, offset;
+    uint32_t insn;
+
+    if(!o->nlits) {
+        return;
+    }
+
+    while((o->at + o->len) & 7) {
+        a64_emit(o, A64_NOP);
+    }
+
+    pool = o->len;
+    if(o->nospace || pool + 8 * o->nlits > o->max) {
+        o->nospace = 1;
+        return;
+    }
+
+    for(i = 0; i < o->nlits; ++i) {
+        memcpy(o->code + pool + 8 * i, &o->lit[i], 8);
+
+        offset = (pool + 8 * i - o->lit_load[i]) / 4;
+        memcpy(&insn, o->code + o->lit_load[i], A64_INSN);
+        insn |= (offset & 0x7ffff) << 5;
+        memcpy(o->code + o->lit_load[i], &insn, A64_INSN);
+    }
+
+    o->len = pool + 8 * o->nlits;
+}
+
+/* nonzero if insn never falls through to the next one: b, br, ret, eret
+    (bl and blr come back) */
+static int
+a64_insn_ends_flow(uint32_t insn)
+{
+    if((insn & 0xfc000000) == 0x14000000) {
+        return 1;
+    }
+
+    return (insn & 0xfe000000) == 0xd6000000 && ((insn >> 21) & 3) != 1;
+}
+
+/* rewrites one instruction that ran at pc; returns 0, or -1 if it branches
+    to [lo, hi), the bytes the site replaces, or beyond a direct branch's
+    reach from the trampoline. branches stay direct: under BTI a br x16
+    faults unless it lands on a landing pad, which a branch target in the
+    middle of a function isn't */
+static int
+a64_relocate_one(struct a64_out *o, uint32_t insn, uintptr_t pc,
+    uintptr_t lo, uintptr_t hi)
+{
+    unsigned int rt = insn & 0x1f;
+    uintptr_t target, at = o->at + o->len;
+    uint32_t b, field, disp;
+    int64_t imm;
+    int bits;
+
+    /* adr, adrp */
+    if((insn & 0x1f000000) == 0x10000000) {
+        imm = a64_sext(((insn >> 5) & 0x7ffff) << 2 | ((insn >> 29) & 3), 21);
+        if(insn & 0x80000000) {
+            target = (pc & ~(uintptr_t)0xfff) + imm * 4096;
+        }
+        else {
+            target = pc + imm;
+        }
+
+        a64_emit_ldr_lit(o, rt, target);
+        return 0;
+    }
+
+    /* ldr (literal): loads from the address instead */
+    if((insn & 0x3b000000) == 0x18000000) {
+        unsigned int opc = insn >> 30, vector = (insn >> 26) & 1;
+        unsigned int base = vector ? A64_X16 : rt;
+        static const uint32_t gpr[] = {
+            0xb9400000, /* ldr wt, [xn] */
+            0xf9400000, /* ldr xt, [xn] */
+            0xb9800000, /* ldrsw xt, [xn] */
+        };
+        static const uint32_t simd[] = {
+            0xbd400000, /* ldr st, [xn] */
+            0xfd400000, /* ldr dt, [xn] */
+            0x3dc00000, /* ldr qt, [xn] */
+        };
+
+        target = pc + a64_sext((insn >> 5) & 0x7ffff, 19) * 4;
+
+        /* prfm, only a hint */
+        if(opc == 3) {
+            if(vector) {
+                return -1;
+            }
+            a64_emit(o, A64_NOP);
+            return 0;
+        }
+
+        a64_emit_ldr_lit(o, base, target);
+        a64_emit(o, (vector ? simd : gpr)[opc] | (base << 5) | rt);
+        return 0;
+    }
+
+    /* b, bl */
+    if((insn & 0x7c000000) == 0x14000000) {
+        target = pc + a64_sext(insn & 0x3ffffff, 26) * 4;
+        b = omni_a64_b(at, target);
+        if((target >= lo && target < hi) || !b) {
+            return -1;
+        }
+
+        a64_emit(o, b | (insn & 0x80000000));
+        return 0;
+    }
+
+    /* b.cond (and bc.cond), cbz/cbnz, tbz/tbnz: retargeted if they still
+        reach, otherwise the inverted condition skips a b taken in their
+        place */
+    if((insn & 0xff000000) == 0x54000000 ||
+        (insn & 0x7e000000) == 0x34000000) {
+        bits = 19;
+        field = insn & 0xff00001f;
+    }
+    else if((insn & 0x7e000000) == 0x36000000) {
+        bits = 14;
+        field = insn & 0xfff8001f;
+    }
+    else {
+        /* not PC-relative, runs anywhere */
+        a64_emit(o, insn);
+        return 0;
+    }
+
+    target = pc + a64_sext((insn >> 5) & ((1U << bits) - 1), bits) * 4;
+    if(target >= lo && target < hi) {
+        return -1;
+    }
+
+    if(a64_reach(at, target, bits, &disp)) {
+        a64_emit(o, field | (disp << 5));
+        return 0;
+    }
+
+    /* al and nv both mean always, there's no inverse */
+    if((insn & 0xff00000e) == 0x5400000e) {
+        b = omni_a64_b(at, target);
+        if(!b) {
+            return -1;
+        }
+        a64_emit(o, b);
+        return 0;
+    }
+
+    b = omni_a64_b(at + A64_INSN, target);
+    if(!b) {
+        return -1;
+    }
+
+    /* b.cond flips its condition's low bit, cbz/tbz their op bit */
+    field ^= (insn & 0xff000000) == 0x54000000 ? 1 : 1 << 24;
+    a64_emit(o, field | (2 << 5));
+    a64_emit(o, b);
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// INSN API
+//-----------------------------------------------------------------------------
+
+uint32_t
+omni_a64_b(uintptr_t at, uintptr_t target)
+{
+    int64_t offset = (int64_t)(target - at);
+
+    if(offset < -A64_B_REACH || offset >= A64_B_REACH || (offset & 3)) {
+        return 0;
+    }
+
+    return 0x14000000 | (((uint64_t)offset >> 2) & 0x3ffffff);
+}
+
+int
+omni_a64_jmp(uint8_t *out, uintptr_t at, uintptr_t target, unsigned int max)
+{
+    uint32_t insn = omni_a64_b(at, target);
+    uint64_t address = target;
+
+    if(insn && max >= A64_JMP_NEAR) {
+        memcpy(out, &insn, A64_INSN);
+        return A64_JMP_NEAR;
+    }
+
+    if(max < A64_JMP_FAR) {
+        return 0;
+    }
+
+    insn = 0x58000000 | (2 << 5) | A64_X16; /* ldr x16, #8 */
+    memcpy(out, &insn, A64_INSN);
+    insn = A64_BR_X16;
+    memcpy(out + 4, &insn, A64_INSN);
+    memcpy(out + 8, &address, 8);
+
+    return A64_JMP_FAR;
+}
+
+unsigned int
+omni_a64_landing(const uint32_t *src, /* out */ uint32_t *auth)
+{
+    unsigned int n = 0;
+
+    *auth = 0;
+
+    /* hint #32 to #38, bti with or without c/j */
+    if((src[n] & 0xffffff3f) == 0xd503241f) {
+        ++n;
+    }
+
+    if(src[n] == A64_PACIASP) {
+        *auth = A64_AUTIASP;
+        ++n;
+    }
+    else if(src[n] == A64_PACIBSP) {
+        *auth = A64_AUTIBSP;
+        ++n;
+    }
+
+    return n;
+}
+
+int
+omni_a64_relocate(const uint32_t *src, uintptr_t src_addr, unsigned int count,
+    uint8_t *out, uintptr_t out_addr, unsigned int out_max)
+{
+    unsigned int i;
+    uintptr_t end = src_addr + count * A64_INSN;
+    struct a64_out o = { .code = out, .at = out_addr, .max = out_max };
+
+    if(count > A64_STEAL_MAX) {
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(i + 1 < count && a64_insn_ends_flow(src[i])) {
+            return -1;
+        }
+
+        /* out of room, where anything lands doesn't matter anymore */
+        if(o.nospace) {
+            return A64_STEAL_NOSPACE;
+        }
+
+        if(0 != a64_relocate_one(&o, src[i], src_addr + i * A64_INSN,
+            src_addr, end)) {
+            return -1;
+        }
+    }
+
+    /* back to the first instruction that wasn't stolen, which is no landing
+        pad either */
+    if(!o.nospace && !omni_a64_b(out_addr + o.len, end)) {
+        return -1;
+    }
+    a64_emit(&o, omni_a64_b(out_addr + o.len, end));
+
+    a64_emit_lits(&o);
+
+    return o.nospace ? A64_STEAL_NOSPACE : (int)o.len;
+}
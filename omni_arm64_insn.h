@@ -0,0 +1,64 @@
+#ifndef OMNI_ARM64_INSN_H
+#define OMNI_ARM64_INSN_H
+
+/* aarch64 jumps and instruction relocation for the linux arm64 backend; no
+    OS dependencies, so it can be exercised in userspace (qemu-aarch64) */
+
+#define A64_INSN 4
+#define A64_STEAL_MAX 4 /* instructions a site ever covers */
+#define A64_STEAL_NOSPACE -2 /* out_max too small, retry with more room */
+
+#define A64_JMP_NEAR 4 /* b */
+#define A64_JMP_FAR 16 /* ldr x16, #8; br x16; <8-byte absolute address> */
+#define A64_B_REACH (1L << 27) /* +/-128MB */
+
+#define A64_NOP 0xd503201f
+#define A64_BTI_JC 0xd50324df /* a nop without BTI */
+#define A64_PACIASP 0xd503233f /* sign lr with sp, key a */
+#define A64_PACIBSP 0xd503237f /* key b */
+#define A64_AUTIASP 0xd50323bf /* authenticate (unsign) lr with sp, key a */
+#define A64_AUTIBSP 0xd50323ff /* key b */
+
+/* b from at to target, 0 if out of reach */
+uint32_t
+omni_a64_b(uintptr_t at, uintptr_t target);
+
+/* writes a jump at out (which executes at at) to target: b when it reaches,
+    ldr x16, #8; br x16 with the target inline otherwise, if max allows it.
+    x16 (IP0) is the register linkers' veneers clobber, so no function
+    expects it to survive a call into it. returns the bytes written, 0 if
+    neither fits */
+int
+omni_a64_jmp(uint8_t *out, uintptr_t at, uintptr_t target, unsigned int max);
+
+/* how many of src's first instructions are its landing pad, to be left in
+    place when it's hooked (0 to 2): bti c/j/jc, which an indirect call must
+    land on under BTI, then paciasp/pacibsp, which signs the return address
+    (and is a landing pad itself). *auth gets the instruction that unsigns
+    it again (autiasp/autibsp), 0 if src doesn't sign */
+unsigned int
+omni_a64_landing(const uint32_t *src, /* out */ uint32_t *auth);
+
+/* copies count instructions from src (which lives at src_addr) to out
+    (which will execute at out_addr), followed by a b to
+    src_addr + count * 4; PC-relative ones are rewritten for the new
+    location:
+
+        adr/adrp xd        ldr xd, =target
+        ldr (literal)      ldr x, =address; ldr from [x]
+        b/bl               b/bl target
+        b.cond/cbz/tbz     retargeted, or inverted to skip over b target
+
+    the addresses go in a literal pool after the code. branches stay direct,
+    a br x16 to a target that is no landing pad would fault under BTI, so
+    out must be within b's reach of everything they go to (a trampoline
+    from the module area is). refuses (-1) a branch out of reach, a branch
+    into the covered range and, when count > 1, a stolen instruction that
+    leaves the function (b, br, ret) before the last one: what follows it
+    may not be this function's. returns bytes written to out, -1 or
+    A64_STEAL_NOSPACE */
+int
+omni_a64_relocate(const uint32_t *src, uintptr_t src_addr, unsigned int count,
+    uint8_t *out, uintptr_t out_addr, unsigned int out_max);
+
+#endif
@@ -67,37 +67,49 @@ enable_write_protect(void)
 int
 omnihook_add(void *src, void *dst, /* out */ void **trampoline)
 {
-    int rc = -1;
+    int rc = -1, n;
 
-    struct hook hook;
     struct hook_info *info = NULL;
-    struct trampoline *tramp = NULL;
+    unsigned char *tramp = NULL;
 
     /* list entry */
-    info = malloc(sizeof(struct hook_info), M_HOOKBUF, M_NOWAIT);
+    info = malloc(sizeof(struct hook_info), M_HOOKBUF, M_NOWAIT | M_ZERO);
     if(!info) goto cleanup; 
     
     /* 1) save info about destination, source */
     info->dst = dst;
     info->src = src;
+    memcpy(info->stolen, src, sizeof(info->stolen));
 
     /* 2) allocate, build the trampoline: */
-    tramp = malloc(sizeof(trampoline), M_HOOKBUF, M_NOWAIT);
+    tramp = malloc(TRAMPOLINE_SIZE, M_HOOKBUF, M_NOWAIT);
     if(!tramp) goto cleanup;
-    memcpy(tramp, TRAMPOLINE_INIT, sizeof(*tramp));
-    memcpy(tramp->stolen, src, sizeof(tramp->stolen));
-    tramp->addr = (uintptr_t)src + sizeof(hook); /* absolute address */
-
-    /* inform the hook info struct */
     info->tramp = tramp;
+
+    /* malloc(9) memory is usually beyond rel32 reach of kernel text, the
+        jumps fall back to jmp *0(%rip) then */
+    info->jmp_len = omni_x86_jmp_len((uintptr_t)src, (uintptr_t)dst, X86_IS64);
+
+    n = omni_x86_steal(info->stolen, (uintptr_t)src, info->jmp_len,
+        tramp, (uintptr_t)tramp, TRAMPOLINE_SIZE - HOOK_JMP_MAX,
+        &info->stolen_len, X86_IS64);
+    if(n < 0) {
+        printf("ERROR: can't relocate the instructions at 0x%p\n", src);
+        goto cleanup;
+    }
+
+    omni_x86_jmp(tramp + n, (uintptr_t)tramp + n,
+        (uintptr_t)src + info->stolen_len, X86_IS64);
+
     /* inform the caller */
     *trampoline = (void *)tramp;
 
-    /* 3) write the JMP over the source (actually hooking) */
-    memcpy(&hook, HOOK_INIT, sizeof(hook));
-    hook.addr = (uintptr_t)dst;
+    /* 3) write the JMP over the source (actually hooking), the tail of the
+        last stolen instruction is never executed again, make it trap */
     disable_write_protect();
-    memcpy(src, &hook, sizeof(hook)); 
+    omni_x86_jmp(src, (uintptr_t)src, (uintptr_t)dst, X86_IS64);
+    memset((unsigned char *)src + info->jmp_len, 0xCC,
+        info->stolen_len - info->jmp_len);
     enable_write_protect();
 
     /* debugging */
@@ -166,8 +178,7 @@ omnihook_remove_general(void *src)
             /* restore original bytes (unhook) */
             //printf("restoring STOLEN bytes:");
             disable_write_protect();
-            memcpy(cursor->src, cursor->tramp->stolen, 
-                sizeof(cursor->tramp->stolen));
+            memcpy(cursor->src, cursor->stolen, cursor->stolen_len);
             enable_write_protect();
 
             /* free the trampoline */
@@ -1,70 +1,40 @@
+#include "omni_x86_lde.h"
+
 MALLOC_DECLARE(M_HOOKBUF);
 
 #if defined(__i386__)
-struct trampoline {
-    /* 0x00: */
-    unsigned char stolen[5];
-    /* 0x05: 68 XX XX XX XX ; pushq <imm> */
-    unsigned char push[1];
-    uintptr_t addr_bounce_to;
-    /* 0x0A: C3             ; retq */
-    unsigned char ret[1];
-    /* 0x0B: (total size: 11 bytes) */
-} __attribute__((packed));
-
-#define TRAMPOLINE_INIT \
-    "\x00\x00\x00\x00\x00" \
-    "\x68\xAA\xAA\xAA\xAA" \
-    "\xC3"
-
+#define X86_IS64 0
 #elif defined(__amd64__)
-
-struct hook {
-    /* 0x00: */
-    unsigned char pushq[6];
-    /* 0x06: */
-    unsigned char retq[1];
-    /* 0x07: */
-    uintptr_t addr;
-    /* 0x0F: */
-    uint8_t pad[2];
-    /* 0x11: (total size: 17 bytes) */
-} __attribute__((packed));
-
-#define HOOK_INIT \
-    "\xFF\x35\x01\x00\x00\x00" \
-    "\xC3" \
-    "\xAA\xAA\xAA\xAA\xAA\xAA\xAA\xAA" \
-    "\x90\x90"
-
-struct trampoline {
-    /* 0x00: */
-    unsigned char stolen[sizeof(struct hook)];
-    /* 0x06: FF 35 01 00 00 00 ; pushq 0x1(%rip) */
-    unsigned char pushq[6];
-    /* 0x0C: C3             ; retq */
-    unsigned char retq[1];
-    /* 0x0D: */
-    uintptr_t addr;
-    /* 0x15: (total size: 15 bytes) */
-} __attribute__((packed));
-
-#define TRAMPOLINE_INIT \
-    "\x00\x00\x00\x00\x00\x00\x00\x00" \
-    "\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
-    "\xFF\x35\x01\x00\x00\x00" \
-    "\xC3" \
-    "\xAA\xAA\xAA\xAA\xAA\xAA\xAA\xAA"
-
+#define X86_IS64 1
 #else
 #error cannot determine whether i386 or amd64
 #endif
 
+/* jumps in both directions (src -> dst, trampoline -> src) are plain jumps,
+    push/ret would leave the return stack buffer out of step with the stack:
+    0x00: E9 XX XX XX XX          ; jmp <rel32>
+    or, when the target is out of rel32 reach (amd64 only):
+    0x00: FF 25 00 00 00 00       ; jmp *0(%rip)
+    0x06: <8-byte absolute address> */
+#define HOOK_JMP_MAX (X86_IS64 ? X86_JMP_ABS : X86_JMP_REL)
+
+/* whole instructions covering the JMP, at worst the last one starts at its
+    last byte */
+#define HOOK_MAX_STOLEN (X86_JMP_ABS + X86_MAX_INSN - 1)
+
+/* trampoline:
+    <stolen instructions, relocated (rel8 branches grow to rel32, ...)>
+    <jump back to src + stolen_len> */
+#define TRAMPOLINE_SIZE 128
+
 struct hook_info {
     SLIST_ENTRY(hook_info) next;
     void *src; // address where JMP is written
     void *dst; // address where JMP lands
-    struct trampoline *tramp; // address where clean trampoline allocated
+    unsigned char *tramp; // address where clean trampoline allocated
+    unsigned char stolen[HOOK_MAX_STOLEN]; // bytes stolen at JMP write location
+    unsigned int stolen_len; // whole instructions covering the JMP
+    unsigned int jmp_len; // bytes of JMP written over src
 };
 
 int omnihook_add(void *src, void *dst, /* out */ void **thunk);
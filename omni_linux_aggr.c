@@ -0,0 +1,327 @@
+#include <linux/types.h>
+#include <linux/kernel.h> /* max_t() */
+#include <linux/slab.h>
+#include <linux/string.h> /* strscpy() */
+#include <linux/vmalloc.h>
+#include <linux/percpu.h> /* alloc_percpu(), per_cpu_ptr() */
+#include <linux/cpumask.h> /* nr_cpu_ids, for_each_possible_cpu() */
+#include <linux/smp.h> /* smp_processor_id() */
+#include <linux/sched.h> /* current */
+#include <linux/hardirq.h> /* in_nmi() */
+#include <linux/irqflags.h>
+#include <linux/list.h>
+#include <linux/atomic.h> /* smp_load_acquire() */
+#include <linux/hash.h> /* hash_long() */
+#include <linux/log2.h> /* roundup_pow_of_two(), ilog2() */
+#include <linux/sort.h>
+#include <linux/math64.h> /* div64_u64() */
+#include <linux/overflow.h> /* array3_size() */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "omni_linux_events.h" /* omni_debugfs_dir() */
+#include "omni_linux_reclaim.h"
+#include "omni_linux_aggr.h"
+
+static struct dentry *aggr_dir;
+
+static struct omni_aggr_entry *
+aggr_table(struct omnihook_aggr *a, int cpu)
+{
+    return a->entries + ((size_t)cpu << a->bits);
+}
+
+//-----------------------------------------------------------------------------
+// WRITER
+//-----------------------------------------------------------------------------
+
+void notrace
+omni_aggr_add(struct omnihook_aggr *a, void *caller, u64 cycles)
+{
+    unsigned int i, h, mask = (1U << a->bits) - 1;
+    unsigned long flags, key = (unsigned long)caller;
+    pid_t pid = 0;
+    struct omni_aggr_entry *t, *e = NULL;
+
+    /* the only thing that can interrupt an update below */
+    if(in_nmi()) {
+        return;
+    }
+
+    if(a->flags & OMNI_AGGR_PID) {
+        pid = current->pid;
+    }
+
+    local_irq_save(flags);
+
+    t = aggr_table(a, smp_processor_id());
+    h = hash_long(key ^ pid, a->bits);
+
+    for(i = 0; i < OMNI_AGGR_PROBE; ++i) {
+        e = &t[(h + i) & mask];
+
+        if(!e->caller) {
+            /* the reader only trusts pid once it sees caller */
+            e->pid = pid;
+            smp_store_release(&e->caller, key);
+            break;
+        }
+
+        if(e->caller == key && e->pid == pid) {
+            break;
+        }
+    }
+
+    if(i == OMNI_AGGR_PROBE) {
+        this_cpu_inc(*a->dropped);
+        goto out;
+    }
+
+    WRITE_ONCE(e->calls, e->calls + 1);
+    WRITE_ONCE(e->cycles, e->cycles + cycles);
+
+    out:
+    local_irq_restore(flags);
+}
+
+//-----------------------------------------------------------------------------
+// MERGE
+//-----------------------------------------------------------------------------
+
+static int
+aggr_key_cmp(const void *a, const void *b)
+{
+    const struct omnihook_aggr_row *x = a, *y = b;
+
+    if(x->caller != y->caller) {
+        return x->caller < y->caller ? -1 : 1;
+    }
+
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+static int
+aggr_calls_cmp(const void *a, const void *b)
+{
+    const struct omnihook_aggr_row *x = a, *y = b;
+
+    return (x->calls < y->calls) - (x->calls > y->calls);
+}
+
+/* every CPU's keys, one row each, most calls first; rows is vmalloc'd, the
+    caller frees it */
+static int
+aggr_merge(struct omnihook_aggr *a, /* out */ struct omnihook_aggr_row **rows)
+{
+    int cpu;
+    unsigned int i, n = 0, m = 0;
+    struct omnihook_aggr_row *r;
+
+    r = vmalloc(array3_size(nr_cpu_ids, 1U << a->bits, sizeof(*r)));
+    if(!r) {
+        return -1;
+    }
+
+    /* racing with the writers: a row may be a call short */
+    for_each_possible_cpu(cpu) {
+        struct omni_aggr_entry *t = aggr_table(a, cpu);
+
+        for(i = 0; i < (1U << a->bits); ++i) {
+            unsigned long caller = smp_load_acquire(&t[i].caller);
+
+            if(!caller) {
+                continue;
+            }
+
+            r[n].caller = caller;
+            r[n].pid = t[i].pid;
+            r[n].calls = READ_ONCE(t[i].calls);
+            r[n].cycles = READ_ONCE(t[i].cycles);
+            ++n;
+        }
+    }
+
+    /* folds each key's rows into its first */
+    sort(r, n, sizeof(*r), aggr_key_cmp, NULL);
+    for(i = 0; i < n; ++i) {
+        if(m && 0 == aggr_key_cmp(&r[m - 1], &r[i])) {
+            r[m - 1].calls += r[i].calls;
+            r[m - 1].cycles += r[i].cycles;
+        }
+        else {
+            r[m++] = r[i];
+        }
+    }
+
+    sort(r, m, sizeof(*r), aggr_calls_cmp, NULL);
+
+    *rows = r;
+
+    return m;
+}
+
+int
+omnihook_aggr_read(struct omnihook_aggr *a, struct omnihook_aggr_row *rows,
+    unsigned int max)
+{
+    int n;
+    struct omnihook_aggr_row *r;
+
+    n = aggr_merge(a, &r);
+    if(n < 0) {
+        return -1;
+    }
+
+    memcpy(rows, r, min_t(unsigned int, n, max) * sizeof(*r));
+    vfree(r);
+
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// DEBUGFS
+//-----------------------------------------------------------------------------
+
+static int
+aggr_file_show(struct seq_file *m, void *unused)
+{
+    int cpu, i, n;
+    u64 dropped = 0;
+    struct omnihook_aggr *a = m->private;
+    struct omnihook_aggr_row *r;
+
+    n = aggr_merge(a, &r);
+    if(n < 0) {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        dropped += READ_ONCE(*per_cpu_ptr(a->dropped, cpu));
+    }
+
+    seq_printf(m, "# keys: %d dropped: %llu\n", n, dropped);
+    if(a->flags & OMNI_AGGR_PID) {
+        seq_printf(m, "# calls cycles avg_cycles pid caller\n");
+    }
+    else {
+        seq_printf(m, "# calls cycles avg_cycles caller\n");
+    }
+
+    for(i = 0; i < n; ++i) {
+        seq_printf(m, "%llu %llu %llu ", r[i].calls, r[i].cycles,
+            r[i].calls ? div64_u64(r[i].cycles, r[i].calls) : 0);
+        if(a->flags & OMNI_AGGR_PID) {
+            seq_printf(m, "%d ", r[i].pid);
+        }
+        seq_printf(m, "%pS\n", (void *)r[i].caller);
+    }
+
+    vfree(r);
+
+    return 0;
+}
+
+static int
+aggr_file_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, aggr_file_show, inode->i_private);
+}
+
+static const struct file_operations aggr_fops = {
+    .owner = THIS_MODULE,
+    .open = aggr_file_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+//-----------------------------------------------------------------------------
+// AGGREGATION API
+//-----------------------------------------------------------------------------
+
+int
+omnihook_aggr_init(void)
+{
+    if(!omni_debugfs_dir()) {
+        return -1;
+    }
+
+    aggr_dir = debugfs_create_dir("aggr", omni_debugfs_dir());
+    if(IS_ERR_OR_NULL(aggr_dir)) {
+        aggr_dir = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+omnihook_aggr_exit(void)
+{
+    /* every map is gone by now, so is every file */
+    debugfs_remove_recursive(aggr_dir);
+    aggr_dir = NULL;
+}
+
+struct omnihook_aggr *
+omnihook_aggr_create(const char *name, unsigned int entries,
+    unsigned int flags)
+{
+    struct omnihook_aggr *a = NULL, *ret = NULL;
+
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if(!a) {
+        goto cleanup;
+    }
+
+    strscpy(a->name, name, sizeof(a->name));
+    a->flags = flags;
+    a->bits = ilog2(roundup_pow_of_two(max_t(unsigned int, entries,
+        OMNI_AGGR_PROBE)));
+
+    /* zeroed: every slot free */
+    a->entries = vzalloc(array3_size(nr_cpu_ids, 1U << a->bits,
+        sizeof(struct omni_aggr_entry)));
+    a->dropped = alloc_percpu(u64);
+    if(!a->entries || !a->dropped) {
+        goto cleanup;
+    }
+
+    /* without debugfs the map still counts, omnihook_aggr_read() reads it */
+    if(aggr_dir) {
+        a->file = debugfs_create_file(a->name, 0400, aggr_dir, a, &aggr_fops);
+        if(IS_ERR(a->file)) {
+            a->file = NULL;
+        }
+    }
+
+    ret = a;
+    a = NULL;
+
+    cleanup:
+    if(a) {
+        vfree(a->entries);
+        free_percpu(a->dropped);
+        kfree(a);
+    }
+
+    return ret;
+}
+
+void
+omnihook_aggr_destroy(struct omnihook_aggr *a)
+{
+    if(!a) {
+        return;
+    }
+
+    /* waits out readers of the file */
+    debugfs_remove(a->file);
+
+    /* and calls still inside the removed detours */
+    omni_reclaim_flush();
+
+    vfree(a->entries);
+    free_percpu(a->dropped);
+    kfree(a);
+}
@@ -0,0 +1,103 @@
+#ifndef OMNI_LINUX_AGGR_H
+#define OMNI_LINUX_AGGR_H
+
+/* aggregation by caller: a detour adds its call (and the cycles it measured,
+    if any) to a map keyed by the address the hooked function returns to,
+    optionally with the pid; only the merged table leaves the kernel
+
+        static struct omnihook_aggr *by_caller;
+
+        static void
+        OMNIHOOK_DETOUR(input_event)(struct input_dev *dev, unsigned int type,
+            unsigned int code, int value)
+        {
+            u64 t = get_cycles();
+
+            OMNIHOOK_ORIG(input_event)(dev, type, code, value);
+            OMNIHOOK_AGGR(by_caller, get_cycles() - t);
+        }
+
+        omnihook_aggr_init(); // after omnihook_init()
+        by_caller = omnihook_aggr_create("input_event", 1024, 0);
+        OMNIHOOK_ADD_SYM(input_event, input_event);
+
+    every CPU has its own open addressing table, written with interrupts off
+    and never locked, read by nobody else but
+    debugfs:omnihook-<module>/aggr/<name>, which merges them: one line per
+    key, most calls first
+
+        calls cycles avg_cycles [pid] caller
+
+    a key that finds no room in its CPU's table is counted as dropped;
+    entries aren't evicted, a map holds the first keys seen until destroyed;
+    calls from NMI context aren't counted */
+
+#define OMNI_AGGR_PID 1 /* key on caller and pid */
+
+#define OMNI_AGGR_PROBE 8 /* slots tried from a key's hash */
+
+struct omni_aggr_entry {
+    unsigned long caller; // 0: free
+    pid_t pid;
+    u64 calls;
+    u64 cycles;
+};
+
+struct omnihook_aggr {
+    char name[32];
+    unsigned int flags;
+    unsigned int bits; // log2 of the entries per CPU
+    struct omni_aggr_entry *entries; // nr_cpu_ids tables back to back
+    u64 __percpu *dropped;
+    struct dentry *file;
+};
+
+/* one merged key */
+struct omnihook_aggr_row {
+    unsigned long caller;
+    pid_t pid; // 0 without OMNI_AGGR_PID
+    u64 calls;
+    u64 cycles;
+};
+
+/* creates/removes debugfs:omnihook-<module>/aggr; init after
+    omnihook_init(), exit (maps destroyed first) before omnihook_exit() */
+int
+omnihook_aggr_init(void);
+
+void
+omnihook_aggr_exit(void);
+
+/* entries per CPU are rounded up to a power of two; NULL on failure */
+struct omnihook_aggr *
+omnihook_aggr_create(const char *name, unsigned int entries,
+    unsigned int flags);
+
+/* after the hooks adding to a are removed: waits until no call is left
+    inside their detours */
+void
+omnihook_aggr_destroy(struct omnihook_aggr *a);
+
+/* merges every CPU's table into rows (up to max, most calls first), returns
+    how many keys there are in total (may be more than max), -1 on failure */
+int
+omnihook_aggr_read(struct omnihook_aggr *a, struct omnihook_aggr_row *rows,
+    unsigned int max);
+
+/* any context, never sleeps */
+void
+omni_aggr_add(struct omnihook_aggr *a, void *caller, u64 cycles);
+
+/* the caller of the hooked function, from the detour's own body (not a
+    function it calls, nor a pre handler); on amd64 the tracked entry has
+    replaced the detour's return address, elsewhere it is the caller's */
+#if defined(__amd64__)
+#define OMNIHOOK_CALLER() \
+    omnihook_caller((void **)__builtin_frame_address(0) + 1)
+#else
+#define OMNIHOOK_CALLER() __builtin_return_address(0)
+#endif
+
+#define OMNIHOOK_AGGR(a, cycles) omni_aggr_add((a), OMNIHOOK_CALLER(), (cycles))
+
+#endif
@@ -0,0 +1,362 @@
+#include <linux/types.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h> /* list_head, etc. */
+#include <linux/spinlock.h>
+#include <linux/kallsyms.h>
+
+#include <asm/pgtable.h> /* PAGE_KERNEL_EXEC */
+
+#include "omni_linux_arena.h"
+
+/* every arena page starts with this header, which occupies the page's first
+    slot, so a slot finds its page by masking off the low address bits */
+struct arena_page {
+    struct list_head list; // on its class's partial or full list
+    void *freelist; // free slots link through their first word
+    unsigned int class;
+    unsigned int used; // slots handed out
+    unsigned int total; // slots in this page (excluding the header)
+    unsigned int near; // came from the module area
+};
+
+struct arena_class {
+    struct list_head partial; // pages with at least one free slot
+    struct list_head full; // pages with none
+    unsigned long pages;
+    unsigned long used;
+};
+
+#define ARENA_CLASS_INIT(i) { \
+    LIST_HEAD_INIT(arena_classes[i].partial), \
+    LIST_HEAD_INIT(arena_classes[i].full), 0, 0 }
+
+static struct arena_class arena_classes[ARENA_CLASSES] = {
+    ARENA_CLASS_INIT(0), ARENA_CLASS_INIT(1),
+    ARENA_CLASS_INIT(2), ARENA_CLASS_INIT(3)
+};
+
+/* protects the class lists and every page header */
+static DEFINE_SPINLOCK(arena_lock);
+
+static unsigned long arena_pages;
+static unsigned long arena_pages_near;
+static unsigned long arena_near_misses;
+static unsigned long arena_allocs;
+static unsigned long arena_frees;
+
+//-----------------------------------------------------------------------------
+// PAGE MANAGEMENT
+//-----------------------------------------------------------------------------
+
+static int
+arena_class_of(unsigned int size)
+{
+    int class;
+
+    for(class = 0; class < ARENA_CLASSES; ++class) {
+        if(size <= (ARENA_SLOT_SIZE << class)) {
+            return class;
+        }
+    }
+
+    return -1;
+}
+
+#if defined(ARENA_REACH)
+/* module_alloc() hands out memory in the module area, which is placed within
+    direct jump reach of kernel text, module_memfree() takes it back; neither
+    is exported, nor are set_memory_x()/set_memory_nx() (needed where module
+    memory starts out NX). both module calls are gone since 6.10 (execmem),
+    every page is then allocated anywhere */
+static void *(*arena_module_alloc)(unsigned long size);
+static void (*arena_module_memfree)(void *region);
+static int (*arena_set_memory_x)(unsigned long addr, int numpages);
+static int (*arena_set_memory_nx)(unsigned long addr, int numpages);
+static int arena_syms_resolved;
+
+static int
+arena_near_available(void)
+{
+    if(!arena_syms_resolved) {
+        arena_module_alloc = (void *)kallsyms_lookup_name("module_alloc");
+        arena_module_memfree = (void *)kallsyms_lookup_name("module_memfree");
+        arena_set_memory_x = (void *)kallsyms_lookup_name("set_memory_x");
+        arena_set_memory_nx = (void *)kallsyms_lookup_name("set_memory_nx");
+        arena_syms_resolved = 1;
+
+        if(!arena_module_alloc || !arena_module_memfree) {
+            printk("WARNING: omnihook arena can't allocate near text (no module_alloc()), trampolines go anywhere\n");
+        }
+    }
+
+    return arena_module_alloc && arena_module_memfree;
+}
+
+static void *
+arena_page_alloc_near(void)
+{
+    void *base;
+
+    if(!arena_near_available()) {
+        return NULL;
+    }
+
+    base = arena_module_alloc(PAGE_SIZE);
+    if(base && arena_set_memory_x &&
+        0 != arena_set_memory_x((unsigned long)base, 1)) {
+        /* not executable, useless */
+        arena_module_memfree(base);
+        base = NULL;
+    }
+
+    return base;
+}
+
+/* the way the module loader frees it: no executable mapping may outlive
+    the memory */
+static void
+arena_page_free_near(void *base)
+{
+    if(arena_set_memory_nx) {
+        arena_set_memory_nx((unsigned long)base, 1);
+    }
+    arena_module_memfree(base);
+}
+
+static int
+arena_reaches(struct arena_page *page, void *near)
+{
+    uintptr_t a = (uintptr_t)page, b = (uintptr_t)near;
+    uintptr_t distance = (a > b) ? a - b : b - a;
+
+    return !near || distance + PAGE_SIZE < ARENA_REACH;
+}
+#else
+static int
+arena_reaches(struct arena_page *page, void *near)
+{
+    return 1;
+}
+#endif
+
+static struct arena_page *
+arena_page_new(int class, void *near)
+{
+    unsigned int i, slot_size = ARENA_SLOT_SIZE << class;
+    uint8_t *base = NULL;
+    struct arena_page *page;
+
+#if defined(ARENA_REACH)
+    if(near) {
+        base = (uint8_t *) arena_page_alloc_near();
+    }
+#endif
+
+    /* anywhere will do (or nothing nearer could be had), callers fall back to
+        long jumps, or refuse the site (arm64) */
+    if(!base) {
+        base = (uint8_t *) __vmalloc(PAGE_SIZE, GFP_KERNEL, PAGE_KERNEL_EXEC);
+        if(!base) {
+            return NULL;
+        }
+        near = NULL;
+    }
+
+    page = (struct arena_page *)base;
+    page->near = !!near;
+    page->class = class;
+    page->used = 0;
+    page->total = PAGE_SIZE / slot_size - 1;
+    page->freelist = NULL;
+
+    /* thread the freelist backwards so slots are handed out low to high */
+    for(i = page->total; i >= 1; --i) {
+        void **slot = (void **)(base + i * slot_size);
+        *slot = page->freelist;
+        page->freelist = slot;
+    }
+
+    return page;
+}
+
+static void
+arena_page_free(struct arena_page *page)
+{
+#if defined(ARENA_REACH)
+    if(page->near) {
+        arena_page_free_near(page);
+        return;
+    }
+#endif
+
+    vfree(page);
+}
+
+//-----------------------------------------------------------------------------
+// ARENA API
+//-----------------------------------------------------------------------------
+
+/* returns an executable, ARENA_SLOT_SIZE aligned region of at least size
+    bytes, or NULL; within ARENA_REACH of near if at all possible */
+void *
+omni_arena_alloc(unsigned int size, void *near)
+{
+    int class;
+    unsigned long flags;
+    void **slot = NULL;
+    struct arena_page *page, *fresh = NULL, *mine = NULL;
+    struct arena_class *ac;
+
+    class = arena_class_of(size);
+    if(class < 0) {
+        return NULL;
+    }
+    ac = &arena_classes[class];
+
+    retry:
+    spin_lock_irqsave(&arena_lock, flags);
+
+    /* our own fresh page is as near as it gets */
+    if(fresh) {
+        mine = fresh;
+        list_add(&fresh->list, &ac->partial);
+        ac->pages++;
+        arena_pages++;
+        arena_pages_near += fresh->near;
+        arena_near_misses += (near && !fresh->near);
+        fresh = NULL;
+    }
+
+    list_for_each_entry(page, &ac->partial, list) {
+        if(page != mine && !arena_reaches(page, near)) {
+            continue;
+        }
+
+        slot = page->freelist;
+        page->freelist = *slot;
+
+        if(++page->used == page->total) {
+            list_move(&page->list, &ac->full);
+        }
+
+        ac->used++;
+        arena_allocs++;
+        break;
+    }
+
+    spin_unlock_irqrestore(&arena_lock, flags);
+
+    /* page allocation may sleep, so the class grows outside the lock; a page
+        that turns out not to reach is still used */
+    if(!slot && !mine) {
+        fresh = arena_page_new(class, near);
+        if(fresh) {
+            goto retry;
+        }
+    }
+
+    return slot;
+}
+
+void
+omni_arena_free(void *slot)
+{
+    unsigned long flags;
+    struct arena_page *page, *release = NULL;
+    struct arena_class *ac;
+
+    if(!slot) {
+        return;
+    }
+
+    page = (struct arena_page *)((uintptr_t)slot & PAGE_MASK);
+    ac = &arena_classes[page->class];
+
+    spin_lock_irqsave(&arena_lock, flags);
+
+    if(page->used-- == page->total) {
+        list_move(&page->list, &ac->partial);
+    }
+
+    *(void **)slot = page->freelist;
+    page->freelist = slot;
+
+    ac->used--;
+    arena_frees++;
+
+    /* idle pages go back where they came from, except the last one of each class,
+        which absorbs add/remove churn */
+    if(!page->used && ac->pages > 1) {
+        list_del(&page->list);
+        ac->pages--;
+        arena_pages--;
+        arena_pages_near -= page->near;
+        release = page;
+    }
+
+    spin_unlock_irqrestore(&arena_lock, flags);
+
+    if(release) {
+        arena_page_free(release);
+    }
+}
+
+void
+omnihook_arena_stats(/* out */ struct omnihook_arena_stats *stats)
+{
+    int class;
+    unsigned long flags;
+
+    memset(stats, 0, sizeof(*stats));
+
+    spin_lock_irqsave(&arena_lock, flags);
+
+    stats->pages = arena_pages;
+    stats->pages_near = arena_pages_near;
+    stats->near_misses = arena_near_misses;
+    stats->allocs = arena_allocs;
+    stats->frees = arena_frees;
+
+    for(class = 0; class < ARENA_CLASSES; ++class) {
+        unsigned int slot_size = ARENA_SLOT_SIZE << class;
+        struct omnihook_arena_class *sc = &stats->classes[class];
+
+        sc->slot_size = slot_size;
+        sc->pages = arena_classes[class].pages;
+        sc->slots_total = sc->pages * (PAGE_SIZE / slot_size - 1);
+        sc->slots_used = arena_classes[class].used;
+
+        stats->bytes_used += sc->slots_used * slot_size;
+    }
+
+    spin_unlock_irqrestore(&arena_lock, flags);
+
+#if defined(ARENA_REACH)
+    stats->near_unavailable = arena_syms_resolved &&
+        !(arena_module_alloc && arena_module_memfree);
+#endif
+}
+
+void
+omnihook_arena_print_stats(void)
+{
+    int class;
+    struct omnihook_arena_stats stats;
+
+    omnihook_arena_stats(&stats);
+
+    printk("omnihook arena: %lu pages (%lu near text), %lu bytes in use, %lu allocs, %lu frees\n",
+        stats.pages, stats.pages_near, stats.bytes_used, stats.allocs, stats.frees);
+
+    if(stats.near_misses) {
+        printk("  %lu pages wanted near text went anywhere%s\n",
+            stats.near_misses, stats.near_unavailable ?
+            " (no module_alloc())" : "");
+    }
+
+    for(class = 0; class < ARENA_CLASSES; ++class) {
+        printk("  %4u byte slots: %lu/%lu used in %lu pages\n",
+            stats.classes[class].slot_size, stats.classes[class].slots_used,
+            stats.classes[class].slots_total, stats.classes[class].pages);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef OMNI_LINUX_ARENA_H
+#define OMNI_LINUX_ARENA_H
+
+/* executable arena: trampolines are carved out of shared PAGE_KERNEL_EXEC
+    pages instead of getting a __vmalloc() (and so a page) each
+
+    slots come in power of two classes, starting at one cache line, and are
+    aligned to their own size so no trampoline straddles a line it does not
+    have to */
+#define ARENA_SLOT_SIZE 64
+#define ARENA_CLASSES 4 /* 64, 128, 256, 512 */
+#define ARENA_SLOT_MAX (ARENA_SLOT_SIZE << (ARENA_CLASSES - 1))
+
+/* how far a slot may be from the text it serves for a direct jump to reach
+    in both directions (undefined: anywhere will do) */
+#if defined(__amd64__)
+#define ARENA_REACH (1UL << 31) /* jmp rel32 */
+#elif defined(__arm__)
+#define ARENA_REACH (1UL << 25) /* b */
+#elif defined(__aarch64__)
+#define ARENA_REACH (1UL << 27) /* b */
+#endif
+
+struct omnihook_arena_class {
+    unsigned int slot_size;
+    unsigned long pages; // pages dedicated to this class
+    unsigned long slots_total; // usable slots in those pages
+    unsigned long slots_used; // slots currently handed out
+};
+
+struct omnihook_arena_stats {
+    unsigned long pages; // executable pages currently held
+    unsigned long pages_near; // of which in the module area (near text)
+    unsigned long near_misses; // pages wanted near text but allocated anywhere
+    int near_unavailable; // no module_alloc() (gone since 6.10): no page is near text
+    unsigned long bytes_used; // sum of handed out slot sizes
+    unsigned long allocs; // lifetime slot allocations
+    unsigned long frees; // lifetime slot frees
+    struct omnihook_arena_class classes[ARENA_CLASSES];
+};
+
+/* near (optional) is the text the slot will jump to/from, pages within
+    ARENA_REACH of it are preferred */
+void *
+omni_arena_alloc(unsigned int size, void *near);
+
+void
+omni_arena_free(void *slot);
+
+void
+omnihook_arena_stats(/* out */ struct omnihook_arena_stats *stats);
+
+void
+omnihook_arena_print_stats(void);
+
+#endif
@@ -1,17 +1,26 @@
 #include <linux/types.h>
+#include <linux/kernel.h> /* swap() */
+#include <linux/string.h> /* kstrdup() */
 #include <linux/vmalloc.h>
 #include <linux/list.h> /* list_head, etc. */
+#include <linux/rcupdate.h> /* synchronize_rcu() */
+#include <linux/bitops.h> /* test_and_set_bit() */
 #include <linux/slab.h> /* kmalloc(), kfree(), etc. */
 #include <linux/delay.h> /* for msleep() */
 #include <linux/kallsyms.h>
+#include <linux/stop_machine.h> /* stop_machine() */
+#include <linux/mutex.h>
+#include <linux/sort.h>
 
 #include <asm/pgtable.h> /* PAGE_KERNEL_EXEC */
+#include <asm/cacheflush.h> /* flush_icache_range() */
 
 #include "omnihook.h"
 
-/* master list of all hooks created */
-struct list_head hook_list;
-LIST_HEAD(hook_list);
+/* every hook lives in the registry (omni_linux_registry.c), keyed by src */
+
+/* serializes everything that changes hooks or their detour chains */
+static DEFINE_MUTEX(hooks_lock);
 
 #if defined(MEM_TEXT_PROT_NEEDED)
 int mem_protection_syms = 0;
@@ -21,192 +30,724 @@ void (*mem_text_address_restore)(void);
 void (*mem_text_writeable_spinunlock)(unsigned long *flags);
 #endif
 
-int
-omnihook_add(void *src, void *dst, /* out */ void **trampoline)
+/* resolves the kernel's text protection helpers once */
+static int
+resolve_mem_protection(void)
 {
-    int rc = -1;
-    hook *h = NULL;
-    unsigned long flags;
-    uint8_t *tramp = NULL;
-    uint8_t jmpcode[8] = {
-        0x04, 0xf0, 0x1f, 0xe5, /* ldr pc, [pc, #-4] */
-        0xde, 0xad, 0xbe, 0xef /* (dummy address) */
+#if defined(MEM_TEXT_PROT_NEEDED)
+    struct omni_sym syms[] = {
+        { "mem_text_writeable_spinlock" },
+        { "mem_text_address_writeable" },
+        { "mem_text_address_restore" },
+        { "mem_text_writeable_spinunlock" },
     };
 
-#if defined(MEM_TEXT_PROT_NEEDED)
     if(!mem_protection_syms) {
-        mem_text_writeable_spinlock = 
-            (void *)kallsyms_lookup_name("mem_text_writeable_spinlock");
+        if(0 != omni_syms_resolve(syms, ARRAY_SIZE(syms))) {
+            printk("ERROR: could not resolve memory protection symbols, bailing!\n");
+            return -1;
+        }
 
-        mem_text_address_writeable = 
-            (void *)kallsyms_lookup_name("mem_text_address_writeable");
+        mem_text_writeable_spinlock = syms[0].addr;
+        mem_text_address_writeable = syms[1].addr;
+        mem_text_address_restore = syms[2].addr;
+        mem_text_writeable_spinunlock = syms[3].addr;
 
-        mem_text_address_restore = 
-            (void *)kallsyms_lookup_name("mem_text_address_restore");
+        mem_protection_syms = 1;
+    }
+#endif
 
-        mem_text_writeable_spinunlock = 
-            (void *)kallsyms_lookup_name("mem_text_writeable_spinunlock");
+    return 0;
+}
 
-        if(mem_text_writeable_spinlock && mem_text_address_writeable &&
-            mem_text_address_restore && mem_text_writeable_spinunlock) {
+/* b from src to dst, 0 if out of reach */
+static uint32_t
+arm_b(void *src, void *dst)
+{
+    long offset = (long)((uintptr_t)dst - ((uintptr_t)src + 8));
 
-            mem_protection_syms = 1;
-        }
-        else {
-            printk("ERROR: could not resolve memory protection symbols, bailing!\n");
-            goto cleanup;
-        }
+    if(offset < -(1L << 25) || offset >= (1L << 25) || (offset & 3)) {
+        return 0;
+    }
+
+    return 0xea000000 | (((uint32_t)offset >> 2) & 0x00ffffff);
+}
+
+/* writes a jump from src to dst at code (src is where it will run), returns
+    its length: b when in reach, ldr pc, [pc, #-4] and the address otherwise */
+static unsigned int
+arm_jmp(uint8_t *code, void *src, void *dst, unsigned int max)
+{
+    uint32_t b = arm_b(src, dst);
+
+    if(b || max < HOOK_JMP_MAX) {
+        *(uint32_t *)code = b;
+        return HOOK_JMP_SIZE;
     }
+
+    *(uint32_t *)code = 0xe51ff004; /* ldr pc, [pc, #-4] */
+    *(uint32_t *)(code + 4) = (uint32_t)dst;
+    return HOOK_JMP_MAX;
+}
+
+/* nonzero if insn (arm state) uses pc or branches, so it can't run from
+    the trampoline unchanged */
+static int
+arm_insn_pc_relative(uint32_t insn)
+{
+    uint32_t op = (insn >> 25) & 7;
+
+    /* unconditional space: blx <imm>, pld, ... */
+    if((insn >> 28) == 0xf) {
+        return 1;
+    }
+
+    /* b, bl */
+    if(op == 5) {
+        return 1;
+    }
+
+    /* pc as base or destination (ldm/stm: r12-r15 in the list) */
+    if(((insn >> 16) & 0xf) == 15 || ((insn >> 12) & 0xf) == 15) {
+        return 1;
+    }
+
+    /* pc as register operand: data processing and register offset
+        loads/stores */
+    if((op == 0 || op == 3) && (insn & 0xf) == 15) {
+        return 1;
+    }
+
+    /* ldm with pc in the list */
+    if(op == 4 && (insn & (1 << 15))) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* writes len bytes over kernel text */
+static void
+write_text(void *addr, void *bytes, int len)
+{
+#if defined(MEM_TEXT_PROT_NEEDED)
+    unsigned long flags;
+
+    mem_text_writeable_spinlock(&flags);
+    mem_text_address_writeable((unsigned long)addr);
+#endif
+    memcpy(addr, bytes, len); 
+#if defined(MEM_TEXT_PROT_NEEDED)
+    mem_text_address_restore();
+    mem_text_writeable_spinunlock(&flags);
 #endif
+}
+
+//-----------------------------------------------------------------------------
+// LINKS (see omni_linux_chain.h)
+//-----------------------------------------------------------------------------
 
-    /* list entry */
+/* arm LINK:
+    00: 04 f0 1f e5           ; ldr pc, [pc, #-4]
+    04: <target>              ; loaded as data, retargeted with a single store
+*/
+void
+omni_link_emit(void *link, void *target)
+{
+    memcpy(link, "\x04\xf0\x1f\xe5", 4);
+    *(void **)((uint8_t *)link + 4) = target;
+
+    /* new code, the target is data and retargets need no flush */
+    flush_icache_range((unsigned long)link, (unsigned long)link + 4);
+}
+
+void
+omni_link_set(void *link, void *target)
+{
+    WRITE_ONCE(*(void **)((uint8_t *)link + 4), target);
+}
+
+void *
+omni_link_target(void *link)
+{
+    return READ_ONCE(*(void **)((uint8_t *)link + 4));
+}
+
+//-----------------------------------------------------------------------------
+// HOOK CONSTRUCTION
+//-----------------------------------------------------------------------------
+
+static void
+hook_destroy(hook *h)
+{
+    /* return the trampoline slot to the arena */
+    if(h->trampoline) {
+        omni_arena_free(h->trampoline);
+        h->trampoline = NULL;
+    }
+
+    omni_chain_destroy(&h->chain);
+
+    kfree(h->group);
+    kfree(h);
+}
+
+/* allocates the bookkeeping structure and builds the trampoline, src is only
+    read (the stolen bytes), never written; detours are added by the caller */
+static hook *
+hook_build(void *src)
+{
+    int rc = -1;
+    unsigned int i, n;
+    hook *h = NULL;
+    uint8_t *tramp = NULL;
+
+    /* bookkeeping entry */
     h = kzalloc(sizeof(hook), GFP_KERNEL);
     if(!h) {
         goto cleanup;
     }
     
-    /* 1) save info about destination, source */
-    h->dst = dst;
+    /* 1) save info about the source, the site will jump to the dispatch
+        link, which leads to the trampoline once it's built; a link near
+        enough for a b costs one stolen instruction instead of two */
     h->src = src;
-    memcpy(h->stolen, src, 8);
+    if(0 != omni_chain_init(&h->chain, src, NULL)) {
+        goto cleanup;
+    }
+    h->stolen_len = arm_b(src, h->chain.dispatch) ? HOOK_JMP_SIZE : HOOK_JMP_MAX;
+
+    /* claim the range before stealing from it, a concurrent add on an
+        overlapping site fails here instead of stealing our JMP */
+    set_bit(HOOK_BUSY, &h->state);
+    INIT_HLIST_NODE(&h->reg.node);
+    h->reg.src = src;
+    h->reg.len = h->stolen_len;
+    if(0 != omni_reg_insert(&h->reg)) {
+        omni_log_fail(src, NULL, OMNI_FAIL_OVERLAP);
+        goto cleanup;
+    }
+
+    memcpy(h->stolen, src, h->stolen_len);
+
+    /* copied as is, nothing is relocated */
+    for(i = 0; i < h->stolen_len; i += 4) {
+        if(arm_insn_pc_relative(*(uint32_t *)(h->stolen + i))) {
+            omni_log_fail(src, NULL, OMNI_FAIL_RELOCATE);
+            goto cleanup;
+        }
+    }
 
     /* 2) allocate, build the trampoline:
-        <stolen instr 0>
-        <stolen instr 1>
-        <ldr pc, [pc, #0]>
-        <dst>
+        <stolen instructions>
+        <b src + stolen_len> or <ldr pc, [pc, #-4]> <src + stolen_len>
     */
-    tramp = (uint8_t *) __vmalloc(8 + 8, GFP_KERNEL, PAGE_KERNEL_EXEC);
+    tramp = (uint8_t *) omni_arena_alloc(HOOK_JMP_MAX + HOOK_JMP_MAX, src);
     if(!tramp) {
         goto cleanup;
     }
-
-    //printk("stolen bytes:\n");
-    //hexdump(h->stolen, 8);
-    memcpy(tramp, h->stolen, 8); /* stolen instructions */
-    *(uint32_t *)(jmpcode + 4) = (uint32_t)(src + 8); /* return over the JMP! */
-    memcpy(tramp + 8, jmpcode, 8);
     h->trampoline = tramp;
-    *trampoline = (void *)tramp;
 
-    /* 3) write the JMP over the source (actually hooking) */
-    *(uint32_t *)(jmpcode + 4) = (uint32_t)dst;
+    memcpy(tramp, h->stolen, h->stolen_len); /* stolen instructions */
+    n = h->stolen_len;
+    n += arm_jmp(tramp + n, tramp + n, (uint8_t *)src + h->stolen_len,
+        HOOK_JMP_MAX); /* return over the JMP! */
 
-#if defined(MEM_TEXT_PROT_NEEDED)
-    mem_text_writeable_spinlock(&flags);
-    mem_text_address_writeable((unsigned long)src);
-#endif
-    memcpy(src, jmpcode, 8); 
-#if defined(MEM_TEXT_PROT_NEEDED)
-    mem_text_address_restore();
-    mem_text_writeable_spinunlock(&flags);
-#endif
+    /* code is fetched through the I-cache, written through the D-cache */
+    flush_icache_range((unsigned long)tramp, (unsigned long)tramp + n);
 
-    /* debugging */
-    printk("omnihook!\n");
-    printk("src: 0x%p\n", h->src);
-    printk("dst: 0x%p\n", h->dst);
-    printk("trampoline: 0x%p\n", h->trampoline);
-  
-    /* add the omnihook bookkeeping structure */
-    list_add(/* address of list member within new element */ &(h->list),
-        /* the list_head to add it to */ &hook_list);
+    omni_chain_set_tail(&h->chain, tramp);
 
     rc = 0;
 
     cleanup:
     if(0 != rc) {
         if(h) {
-            if(h->trampoline) {
-                vfree(h->trampoline);
-                h->trampoline = NULL;
-            }
-
-            kfree(h);
+            /* never visible to omnihook_find() callers without a grace period
+                passing first */
+            omni_reg_remove(&h->reg);
+            synchronize_rcu();
+            hook_destroy(h);
             h = NULL;
         }
     }
 
-    return rc;
+    return h;
 }
 
-/* when address is given (non-NULL), it remove single hook from this address
-    when address is not given (ie value NULL), it removes all hooks in the list */
-int 
-omnihook_remove_general(void *src)
+static void
+hook_reclaim_free(struct omni_reclaim *r)
 {
-    int rc = -1;
+    hook_destroy(container_of(r, hook, reclaim));
+}
 
-    int remove, do_break;
-    hook *cursor, *temp;
+static void
+detour_reclaim_free(struct omni_reclaim *r)
+{
+    omni_detour_free(container_of(r, struct omni_detour, reclaim));
+}
 
-    /* scan thru list of omnihook_list, finding info to properly deallocate */
-    list_for_each_entry_safe(/* cursor (it uses this type) */ cursor, 
-        /* temporary storage (for the safety feature) */ temp, /* list head */ &hook_list, 
-        /* member within, hehe TWSS */ list) {
+/* takes hooks out of the registry and hands them to the reclaimer, which
+    frees the whole set after one grace period (no calls in flight are
+    tracked on arm, a detour that sleeps must not be removed meanwhile) */
+static void
+hooks_release(hook **hooks, int count)
+{
+    int i;
 
-        remove = 0;
-        do_break = 0;
+    for(i = 0; i < count; ++i) {
+        if(hooks[i]) {
+            omni_reg_remove(&(hooks[i]->reg));
 
-        if(src) {
-            printk("src specified, looking for one hook...\n");
-            /* if source specified, only remove this one */
-            if(cursor->src == src) {
-                printk("FOUND!\n");
-                remove = 1;
-                do_break = 1;
-            }
+            hooks[i]->reclaim.free = hook_reclaim_free;
+            omni_reclaim_queue(&(hooks[i]->reclaim));
         }
-        /* otherwise, remove them all */
-        else {
-            remove = 1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// PATCHING
+//-----------------------------------------------------------------------------
+
+/* a batch of sites is written (or restored) inside one stop_machine() pass */
+struct patch_batch {
+    hook **hooks; // by src
+    int count;
+    int restore; // nonzero: write stolen bytes back instead of the JMP
+    int patched; // sites written
+};
+
+/* cleans the D-cache and invalidates the I-cache over the pages the batch
+    wrote: once per page (runs of adjacent pages at once) however many sites
+    it holds, instead of once per site */
+static void
+flush_sites(hook **hooks, int count)
+{
+    int i;
+    unsigned long start = 0, end = 0, first, last;
+
+    for(i = 0; i < count; ++i) {
+        first = (unsigned long)hooks[i]->src & PAGE_MASK;
+        last = PAGE_ALIGN((unsigned long)hooks[i]->src + hooks[i]->stolen_len);
+
+        if(end && first <= end) {
+            end = max(end, last);
+            continue;
+        }
+
+        if(end) {
+            flush_icache_range(start, end);
         }
+        start = first;
+        end = last;
+    }
+
+    if(end) {
+        flush_icache_range(start, end);
+    }
+}
 
-        if(remove) {
-            unsigned long flags;
+static int
+patch_batch_stop(void *data)
+{
+    int i;
+    struct patch_batch *pb = data;
+    uint8_t jmpcode[HOOK_JMP_MAX];
 
-            printk("removing hook at address 0x%p\n", cursor->src);
+    for(i = 0; i < pb->count; ++i) {
+        hook *h = pb->hooks[i];
 
+        if(pb->restore) {
             /* restore original bytes (unhook) */
-            //printk("restoring STOLEN bytes:");
+            write_text(h->src, h->stolen, h->stolen_len);
+            continue;
+        }
 
-#if defined(MEM_TEXT_PROT_NEEDED)
-            mem_text_writeable_spinlock(&flags);
-            mem_text_address_writeable((unsigned long)cursor->src);
-#endif
-            memcpy(cursor->src, cursor->stolen, 8);
-#if defined(MEM_TEXT_PROT_NEEDED)
-            mem_text_address_restore();
-            mem_text_writeable_spinunlock(&flags);
-#endif
+        /* site changed since its bytes were stolen (possibly by an earlier
+            entry of this very batch), hooking it would lose that change */
+        if(memcmp(h->src, h->stolen, h->stolen_len)) {
+            omni_log_fail(h->src, NULL, OMNI_FAIL_CHANGED);
+            break;
+        }
+
+        /* write the JMP over the source (actually hooking) */
+        arm_jmp(jmpcode, h->src, h->chain.dispatch, h->stolen_len);
+        write_text(h->src, jmpcode, h->stolen_len);
+    }
+
+    pb->patched = i;
+
+    /* all or nothing: roll back whatever this pass already wrote */
+    if(i != pb->count) {
+        while(i--) {
+            write_text(pb->hooks[i]->src, pb->hooks[i]->stolen,
+                pb->hooks[i]->stolen_len);
+        }
+    }
+
+    /* before any other CPU leaves stop_machine() */
+    flush_sites(pb->hooks, pb->count);
+
+    return 0;
+}
+
+static int
+patch_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)(*(hook **)a)->src;
+    uintptr_t y = (uintptr_t)(*(hook **)b)->src;
+
+    return (x > y) - (x < y);
+}
+
+static int
+patch_batch(hook **hooks, int count, int restore)
+{
+    int i;
+    struct patch_batch pb = {
+        .hooks = hooks,
+        .count = count,
+        .restore = restore,
+        .patched = 0
+    };
+
+    /* sites sharing a page end up next to each other, for flush_sites() */
+    sort(hooks, count, sizeof(hook *), patch_cmp, NULL);
+
+    stop_machine(patch_batch_stop, &pb, NULL);
+
+    if(pb.patched != count) {
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(restore) {
+            omni_log_restore(hooks[i]->src, hooks[i]->stolen,
+                hooks[i]->stolen_len);
+        }
+        else {
+            omni_log_patch(hooks[i]->src, hooks[i]->src, hooks[i]->stolen_len);
+        }
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// HOOKLIB MAIN API
+//-----------------------------------------------------------------------------
+
+int
+omnihook_init(void)
+{
+    /* hooks work without their event log */
+    if(0 != omni_events_init()) {
+        printk("WARNING: omnihook events unavailable\n");
+    }
+
+    return 0;
+}
+
+void
+omnihook_exit(void)
+{
+    /* removed hooks (and detours) are freed in the background */
+    omni_reclaim_flush();
+
+    omni_events_exit();
+}
+
+/* builds every new site's trampoline first, then patches all of them in a
+    single stop-the-world pass, then links the detours in; if anything fails
+    nothing changes (no new site stays hooked, no chain is touched) */
+int
+omnihook_add_batch(omnihook_desc *descs, int count)
+{
+    int rc = -1, i, j, nsites = 0;
+    hook **sites = NULL; // built by this batch
+    hook **owners = NULL; // site of each desc
+    struct omni_detour **detours = NULL;
+
+    if(count <= 0) {
+        return -1;
+    }
+
+    sites = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    owners = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    detours = kcalloc(count, sizeof(struct omni_detour *), GFP_KERNEL);
+    if(!sites || !owners || !detours) {
+        goto cleanup;
+    }
+
+    if(0 != resolve_mem_protection()) {
+        goto cleanup;
+    }
+
+    mutex_lock(&hooks_lock);
+
+    for(i = 0; i < count; ++i) {
+        /* a site hooked earlier (or earlier in this batch) gets another
+            detour, hooks can't go away while hooks_lock is held */
+        rcu_read_lock();
+        owners[i] = omnihook_find(descs[i].src);
+        rcu_read_unlock();
+
+        if(!owners[i]) {
+            owners[i] = hook_build(descs[i].src);
+            if(!owners[i]) {
+                goto unlock;
+            }
+            sites[nsites++] = owners[i];
+        }
 
-            /* free the trampoline */
-            //printk("free'ing the trampoline...\n");
-            if(cursor->trampoline) {
-                vfree(cursor->trampoline);
-                cursor->trampoline = NULL;
+        for(j = 0; j < i; ++j) {
+            if(owners[j] == owners[i] && descs[j].dst == descs[i].dst) {
+                break;
             }
+        }
+        if(j != i || omni_chain_find(&owners[i]->chain, descs[i].dst)) {
+            omni_log_fail(descs[i].src, descs[i].dst, OMNI_FAIL_DUPLICATE);
+            goto unlock;
+        }
+
+        detours[i] = omni_detour_new(&owners[i]->chain, descs[i].dst,
+            descs[i].priority);
+        if(!detours[i]) {
+            omni_log_fail(descs[i].src, descs[i].dst, OMNI_FAIL_NOMEM);
+            goto unlock;
+        }
+
+        /* inform the caller now, the detour can run the moment it's
+            linked in */
+        *(descs[i].trampoline) = detours[i]->link;
+    }
+
+    if(nsites && 0 != patch_batch(sites, nsites, 0)) {
+        goto unlock;
+    }
+
+    for(i = 0; i < count; ++i) {
+        omni_chain_insert(&owners[i]->chain, detours[i]);
+        detours[i] = NULL;
 
-            /* delete from list */
-            //printk("deleting from list...\n");
-            list_del(&(cursor->list));
+        omni_log_install(descs[i].src, descs[i].dst, *(descs[i].trampoline));
+    }
 
-            /* delete from mem */
-            //printk("deleting entry itself...\n");
-            kfree(cursor);
-            cursor = NULL;
+    /* sites are live, removers may claim them now */
+    for(i = 0; i < nsites; ++i) {
+        clear_bit(HOOK_BUSY, &(sites[i]->state));
+    }
 
-            /* success? */
-            rc = 0;
+    rc = 0;
+
+    unlock:
+    if(0 != rc) {
+        for(i = 0; i < count; ++i) {
+            if(detours[i]) {
+                *(descs[i].trampoline) = NULL;
+                omni_detour_free(detours[i]);
+            }
         }
 
-        if(do_break) {
-            /* done */
+        hooks_release(sites, nsites);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    cleanup:
+    kfree(detours);
+    kfree(owners);
+    kfree(sites);
+
+    return rc;
+}
+
+int
+omnihook_add_prio(void *src, void *dst, int priority, /* out */ void **trampoline)
+{
+    omnihook_desc desc = { src, dst, trampoline, priority };
+
+    return omnihook_add_batch(&desc, 1);
+}
+
+int
+omnihook_add(void *src, void *dst, /* out */ void **trampoline)
+{
+    return omnihook_add_prio(src, dst, 0, trampoline);
+}
+
+hook *
+omnihook_find(void *src)
+{
+    struct omni_reg_node *n = omni_reg_find(src);
+
+    return n ? container_of(n, hook, reg) : NULL;
+}
+
+/* marks a live hook as being torn down, fails if it's already claimed (by a
+    concurrent remove) or isn't live yet (still being added) */
+static int
+hook_claim(hook *h)
+{
+    return test_and_set_bit(HOOK_BUSY, &h->state) ? -1 : 0;
+}
+
+/* unpatches the given (claimed) hooks in one pass, then frees them */
+static int
+remove_hooks(hook **hooks, int count)
+{
+    int i, n = 0;
+
+    /* disabled sites are restored already, they go last */
+    for(i = 0; i < count; ++i) {
+        if(!test_bit(HOOK_DISABLED, &(hooks[i]->state))) {
+            swap(hooks[n], hooks[i]);
+            n++;
+        }
+    }
+
+    /* nothing was restored, every hook stays live: hand the claims back or
+        none of them could ever be removed again */
+    if(n && 0 != patch_batch(hooks, n, 1)) {
+        for(i = 0; i < count; ++i) {
+            clear_bit(HOOK_BUSY, &(hooks[i]->state));
+        }
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        omni_log_remove(hooks[i]->src, NULL);
+    }
+
+    hooks_release(hooks, count);
+
+    return 0;
+}
+
+/* all or nothing: fails without unhooking anything if any src isn't hooked */
+int
+omnihook_remove_batch(omnihook_desc *descs, int count)
+{
+    int rc = -1, i;
+    hook **hooks = NULL;
+
+    if(count <= 0) {
+        goto cleanup;
+    }
+
+    hooks = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    if(!hooks) {
+        goto cleanup;
+    }
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    for(i = 0; i < count; ++i) {
+        hook *h = omnihook_find(descs[i].src);
+
+        if(!h || 0 != hook_claim(h)) {
+            omni_log_fail(descs[i].src, NULL,
+                h ? OMNI_FAIL_BUSY : OMNI_FAIL_NOT_HOOKED);
             break;
         }
+
+        hooks[i] = h;
+    }
+    rcu_read_unlock();
+
+    if(i != count) {
+
+        /* hand back what was claimed */
+        while(i--) {
+            clear_bit(HOOK_BUSY, &(hooks[i]->state));
+        }
+    }
+    else {
+        rc = remove_hooks(hooks, count);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    cleanup:
+    kfree(hooks);
+
+    return rc;
+}
+
+struct remove_ctx {
+    hook **hooks;
+    int count;
+    int max;
+};
+
+static int
+remove_collect(struct omni_reg_node *n, void *data)
+{
+    struct remove_ctx *ctx = data;
+    hook *h = container_of(n, hook, reg);
+
+    if(ctx->count == ctx->max) {
+        return 1;
+    }
+
+    if(0 == hook_claim(h)) {
+        ctx->hooks[ctx->count++] = h;
+    }
+
+    return 0;
+}
+
+/* when address is given (non-NULL), it remove single hook from this address
+    when address is not given (ie value NULL), it removes all hooks in the registry */
+int 
+omnihook_remove_general(void *src)
+{
+    int rc = -1;
+    hook *h;
+    struct remove_ctx ctx = { NULL, 0, 0 };
+
+    mutex_lock(&hooks_lock);
+
+    /* if source specified, only remove this one */
+    if(src) {
+        rcu_read_lock();
+        h = omnihook_find(src);
+        rcu_read_unlock();
+
+        if(!h) {
+            omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+        }
+        else if(0 != hook_claim(h)) {
+            omni_log_fail(src, NULL, OMNI_FAIL_BUSY);
+        }
+        else {
+            rc = remove_hooks(&h, 1);
+        }
+
+        goto cleanup;
+    }
+
+    /* otherwise, remove them all */
+    ctx.max = omni_reg_count();
+    if(!ctx.max) {
+        goto cleanup;
+    }
+
+    ctx.hooks = kcalloc(ctx.max, sizeof(hook *), GFP_KERNEL);
+    if(!ctx.hooks) {
+        goto cleanup;
     }
 
-    printk("done...\n");
+    omni_reg_for_each(remove_collect, &ctx);
+
+    if(ctx.count) {
+        rc = remove_hooks(ctx.hooks, ctx.count);
+    }
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+    kfree(ctx.hooks);
 
     return rc;
 }
@@ -217,9 +758,318 @@ omnihook_remove(void *src)
     return omnihook_remove_general(src);
 }
 
+int
+omnihook_remove_detour(void *src, void *dst)
+{
+    int rc = -1;
+    hook *h;
+    struct omni_detour *d = NULL;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h) {
+        d = omni_chain_find(&h->chain, dst);
+    }
+
+    if(!d) {
+        omni_log_fail(src, dst, OMNI_FAIL_NOT_HOOKED);
+        goto cleanup;
+    }
+
+    /* the last detour takes the site with it */
+    if(h->chain.count == 1) {
+        if(0 == hook_claim(h)) {
+            rc = remove_hooks(&h, 1);
+        }
+        else {
+            omni_log_fail(src, dst, OMNI_FAIL_BUSY);
+        }
+
+        goto cleanup;
+    }
+
+    /* the site keeps jumping to the dispatch link, which no longer leads
+        through d; whoever was already on the way is waited out before d is
+        freed */
+    omni_chain_unlink(&h->chain, d);
+
+    d->site = h;
+    d->reclaim.free = detour_reclaim_free;
+    omni_reclaim_queue(&d->reclaim);
+
+    omni_log_remove(src, dst);
+
+    rc = 0;
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+/* new_dst takes old_dst's place on src, NULL: the only detour there */
+static int
+replace_general(void *src, void *old_dst, void *new_dst,
+    /* out */ void **trampoline)
+{
+    int rc = -1;
+    hook *h;
+    struct omni_detour *old = NULL, *d;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h && old_dst) {
+        old = omni_chain_find(&h->chain, old_dst);
+    }
+    else if(h && h->chain.count == 1) {
+        old = list_first_entry(&h->chain.detours, struct omni_detour, list);
+    }
+    else if(h) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_AMBIGUOUS);
+        goto cleanup;
+    }
+
+    /* a return hook's stub is only replaced along with the return hook */
+    if(!old || old->stub) {
+        omni_log_fail(src, old_dst, OMNI_FAIL_NOT_HOOKED);
+        goto cleanup;
+    }
+
+    if(omni_chain_find(&h->chain, new_dst)) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_DUPLICATE);
+        goto cleanup;
+    }
+
+    d = omni_detour_new(&h->chain, new_dst, old->priority);
+    if(!d) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_NOMEM);
+        goto cleanup;
+    }
+
+    /* inform the caller now, new_dst can run the moment it's linked in */
+    *trampoline = d->link;
+
+    omni_log_remove(src, old->dst);
+
+    /* the site and the trampoline stay as they are, only the link leading
+        to old changes; calls already in old_dst finish through old's own
+        link, which is waited out before it's freed */
+    omni_chain_replace(&h->chain, old, d);
+
+    old->site = h;
+    old->reclaim.free = detour_reclaim_free;
+    omni_reclaim_queue(&old->reclaim);
+
+    omni_log_install(src, new_dst, d->link);
+
+    rc = 0;
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+int
+omnihook_replace(void *src, void *new_dst, /* out */ void **trampoline)
+{
+    return replace_general(src, NULL, new_dst, trampoline);
+}
+
+int
+omnihook_replace_detour(void *src, void *old_dst, void *new_dst,
+    /* out */ void **trampoline)
+{
+    return replace_general(src, old_dst, new_dst, trampoline);
+}
+
 int
 omnihook_remove_all(void)
 {
     return omnihook_remove_general(NULL);
 }
 
+//-----------------------------------------------------------------------------
+// ENABLE/DISABLE
+//-----------------------------------------------------------------------------
+
+/* writes the JMP back over (enable) or restores (disable) every hook given
+    that isn't in that state yet, in one pass; called under hooks_lock, so
+    every hook found is live and none is being claimed meanwhile */
+static int
+toggle_hooks(hook **hooks, int count, int enable)
+{
+    int i, n = 0;
+
+    for(i = 0; i < count; ++i) {
+        if(enable == test_bit(HOOK_DISABLED, &(hooks[i]->state))) {
+            hooks[n++] = hooks[i];
+        }
+    }
+
+    if(!n) {
+        return 0;
+    }
+
+    if(0 != patch_batch(hooks, n, !enable)) {
+        return -1;
+    }
+
+    for(i = 0; i < n; ++i) {
+        if(enable) {
+            clear_bit(HOOK_DISABLED, &(hooks[i]->state));
+            omni_log_enable(hooks[i]->src);
+        }
+        else {
+            set_bit(HOOK_DISABLED, &(hooks[i]->state));
+            omni_log_disable(hooks[i]->src);
+        }
+    }
+
+    return n;
+}
+
+static int
+toggle_one(void *src, int enable)
+{
+    int rc = -1;
+    hook *h;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(!h) {
+        omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+    }
+    else if(toggle_hooks(&h, 1, enable) >= 0) {
+        rc = 0;
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+int
+omnihook_disable(void *src)
+{
+    return toggle_one(src, 0);
+}
+
+int
+omnihook_enable(void *src)
+{
+    return toggle_one(src, 1);
+}
+
+int
+omnihook_set_group(void *src, const char *group)
+{
+    int rc = -1;
+    hook *h;
+    char *copy = NULL;
+
+    if(group) {
+        copy = kstrdup(group, GFP_KERNEL);
+        if(!copy) {
+            return -1;
+        }
+    }
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h) {
+        swap(h->group, copy);
+        rc = 0;
+    }
+    else {
+        omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    kfree(copy);
+
+    return rc;
+}
+
+struct group_ctx {
+    const char *group;
+    hook **hooks;
+    int count;
+    int max;
+};
+
+static int
+group_collect(struct omni_reg_node *n, void *data)
+{
+    struct group_ctx *ctx = data;
+    hook *h = container_of(n, hook, reg);
+
+    if(ctx->count == ctx->max) {
+        return 1;
+    }
+
+    if(h->group && 0 == strcmp(h->group, ctx->group)) {
+        ctx->hooks[ctx->count++] = h;
+    }
+
+    return 0;
+}
+
+static int
+toggle_group(const char *group, int enable)
+{
+    int rc = -1;
+    struct group_ctx ctx = { group, NULL, 0, 0 };
+
+    mutex_lock(&hooks_lock);
+
+    ctx.max = omni_reg_count();
+    if(!ctx.max) {
+        rc = 0;
+        goto cleanup;
+    }
+
+    ctx.hooks = kcalloc(ctx.max, sizeof(hook *), GFP_KERNEL);
+    if(!ctx.hooks) {
+        goto cleanup;
+    }
+
+    omni_reg_for_each(group_collect, &ctx);
+
+    rc = toggle_hooks(ctx.hooks, ctx.count, enable);
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+    kfree(ctx.hooks);
+
+    return rc;
+}
+
+int
+omnihook_disable_group(const char *group)
+{
+    return toggle_group(group, 0);
+}
+
+int
+omnihook_enable_group(const char *group)
+{
+    return toggle_group(group, 1);
+}
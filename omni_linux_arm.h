@@ -1,16 +1,114 @@
+#include "omni_linux_arena.h"
+#include "omni_linux_registry.h"
+#include "omni_linux_reclaim.h"
+#include "omni_linux_chain.h"
+#include "omni_linux_events.h"
+#include "omni_linux_syms.h"
+
+/* b <rel24> written over src when the dispatch link is within its reach
+    (+/-32MB, the arena takes trampolines and links from the module area for
+    that), ldr pc, [pc, #-4] and the address otherwise */
+#define HOOK_JMP_SIZE 4
+#define HOOK_JMP_MAX 8
+
+/* hook state bits */
+#define HOOK_BUSY 0 /* being built or torn down, can't be claimed */
+#define HOOK_DISABLED 1 /* site restored, the rest kept for omnihook_enable() */
+
 typedef struct hook_ {
-    struct list_head list;
+    struct omni_reg_node reg; // registry entry, covers the stolen bytes
+    unsigned long state;
     void *src; // address where JMP is written
-    void *dst; // address where JMP lands
+    char *group; // omnihook_set_group(), NULL: none
+    struct omni_chain chain; // the detours, the JMP lands in chain.dispatch
     void *trampoline; // address where clean trampoline allocated
-    unsigned char stolen[8]; // bytes stolen at JMP write location
+    unsigned char stolen[HOOK_JMP_MAX]; // bytes stolen at JMP write location
+    unsigned int stolen_len; // HOOK_JMP_SIZE, or HOOK_JMP_MAX for a far link
+    struct omni_reclaim reclaim; // deferred free, once removed
 } hook;
 
+/* one entry of a batch, trampoline is an out parameter */
+typedef struct omnihook_desc_ {
+    void *src;
+    void *dst;
+    void **trampoline;
+    int priority; // among detours on the same src, higher is called first
+} omnihook_desc;
+
+/* module init/exit: sets up/tears down the event log
+    (debugfs:omnihook-<module>); remove every hook before omnihook_exit(),
+    which waits until the removed hooks are freed */
+int
+omnihook_init(void);
+
+void
+omnihook_exit(void);
+
+/* adding to a src that is already hooked puts another detour on it (the
+    site isn't touched again), each detour's trampoline leads to the next
+    detour, the last one's to the original */
 int
 omnihook_add(void *src, void *dst, /* out */ void **thunk);
 
+int
+omnihook_add_prio(void *src, void *dst, int priority, /* out */ void **thunk);
+
+int
+omnihook_add_batch(omnihook_desc *descs, int count);
+
+int
+omnihook_remove_batch(omnihook_desc *descs, int count);
+
+/* removes every detour on src, unhooking it */
 int 
 omnihook_remove(void *src);
 
+/* removes one detour, the last one on src unhooks it */
+int
+omnihook_remove_detour(void *src, void *dst);
+
+/* swaps the only detour on src (replace) or old_dst (replace_detour) for
+    new_dst, at its priority, without unpatching src or rebuilding its
+    trampoline: one link store switches calls over, none runs unhooked.
+    trampoline gets new_dst's own; calls already inside the old detour
+    finish there and are waited out like a removed detour's
+
+    same module only: every module built with omnihook has its own
+    registry, a src hooked by another module isn't found here (fails as not
+    hooked), its detour can only be swapped by that module */
+int
+omnihook_replace(void *src, void *new_dst, /* out */ void **trampoline);
+
+int
+omnihook_replace_detour(void *src, void *old_dst, void *new_dst,
+    /* out */ void **trampoline);
+
+/* constant time lookup, call under rcu_read_lock() if hooks may be removed
+    concurrently */
+hook *
+omnihook_find(void *src);
+
 int
 omnihook_remove_all(void);
+
+/* disable puts src's original bytes back but keeps its trampoline, detours
+    and bookkeeping, enable writes its JMP again; nothing is allocated or
+    rebuilt either way (detours added meanwhile are kept, the site stays
+    disabled until enabled) */
+int
+omnihook_disable(void *src);
+
+int
+omnihook_enable(void *src);
+
+/* puts src in a named group (the name is copied), NULL takes it out */
+int
+omnihook_set_group(void *src, const char *group);
+
+/* every site of the group in one patching pass; return how many sites
+    changed state, -1 if none could (the group stays as it was) */
+int
+omnihook_disable_group(const char *group);
+
+int
+omnihook_enable_group(const char *group);
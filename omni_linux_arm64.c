@@ -0,0 +1,1030 @@
+#include <linux/types.h>
+#include <linux/kernel.h> /* swap() */
+#include <linux/string.h> /* kstrdup() */
+#include <linux/vmalloc.h>
+#include <linux/list.h> /* list_head, etc. */
+#include <linux/rcupdate.h> /* synchronize_rcu() */
+#include <linux/bitops.h> /* test_and_set_bit() */
+#include <linux/atomic.h>
+#include <linux/slab.h> /* kmalloc(), kfree(), etc. */
+#include <linux/kallsyms.h>
+#include <linux/stop_machine.h> /* stop_machine() */
+#include <linux/cpumask.h> /* cpu_online_mask */
+#include <linux/mutex.h>
+
+#include <asm/barrier.h> /* isb() */
+#include <asm/processor.h> /* cpu_relax() */
+#include <asm/cacheflush.h> /* flush_icache_range() */
+
+#include "omnihook.h"
+
+/* every hook lives in the registry (omni_linux_registry.c), keyed by src */
+
+/* serializes everything that changes hooks or their detour chains */
+static DEFINE_MUTEX(hooks_lock);
+
+/* kernel text is mapped read-only, instructions go in through the kernel's
+    own patching helper (a temporary writable alias, plus the cache
+    maintenance for the line written); not exported */
+static int (*insn_patch_text_nosync)(void *addr, u32 insn);
+
+static int
+resolve_text_patch(void)
+{
+    struct omni_sym syms[] = {
+        { "aarch64_insn_patch_text_nosync" },
+    };
+
+    if(!insn_patch_text_nosync) {
+        if(0 != omni_syms_resolve(syms, ARRAY_SIZE(syms))) {
+            printk("ERROR: could not resolve aarch64_insn_patch_text_nosync, bailing!\n");
+            return -1;
+        }
+
+        insn_patch_text_nosync = syms[0].addr;
+    }
+
+    return 0;
+}
+
+/* writes len bytes (whole instructions) over kernel text */
+static void
+write_text(void *addr, const uint32_t *insns, int len)
+{
+    int i;
+
+    for(i = 0; i < len / A64_INSN; ++i) {
+        insn_patch_text_nosync((uint32_t *)addr + i, insns[i]);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// LINKS (see omni_linux_chain.h)
+//-----------------------------------------------------------------------------
+
+/* arm64 LINK:
+    00: df 24 03 d5           ; bti jc (reached by br x16 and blr)
+    04: 70 00 00 58           ; ldr x16, #12
+    08: 00 02 1f d6           ; br x16
+    0c: 1f 20 03 d5           ; nop
+    10: <target>              ; loaded as data, retargeted with a single store
+*/
+void
+omni_link_emit(void *link, void *target)
+{
+    uint32_t *code = link;
+
+    code[0] = A64_BTI_JC;
+    code[1] = 0x58000070;
+    code[2] = 0xd61f0200;
+    code[3] = A64_NOP;
+    *(void **)((uint8_t *)link + 16) = target;
+
+    /* new code, the target is data and retargets need no flush */
+    flush_icache_range((unsigned long)link, (unsigned long)link + 16);
+}
+
+void
+omni_link_set(void *link, void *target)
+{
+    WRITE_ONCE(*(void **)((uint8_t *)link + 16), target);
+}
+
+void *
+omni_link_target(void *link)
+{
+    return READ_ONCE(*(void **)((uint8_t *)link + 16));
+}
+
+//-----------------------------------------------------------------------------
+// HOOK CONSTRUCTION
+//-----------------------------------------------------------------------------
+
+static void
+hook_destroy(hook *h)
+{
+    /* return the trampoline slot to the arena */
+    if(h->trampoline) {
+        omni_arena_free(h->trampoline);
+        h->trampoline = NULL;
+    }
+
+    if(h->unsign) {
+        omni_arena_free(h->unsign);
+        h->unsign = NULL;
+    }
+
+    omni_chain_destroy(&h->chain);
+
+    kfree(h->group);
+    kfree(h);
+}
+
+/* allocates the bookkeeping structure and builds the trampoline, src is only
+    read (the stolen instructions), never written; detours are added by the
+    caller */
+static hook *
+hook_build(void *src)
+{
+    int rc = -1, n = -1;
+    unsigned int size, landing, pad;
+    uint32_t auth;
+    hook *h = NULL;
+    uint8_t *tramp = NULL;
+
+    /* bookkeeping entry */
+    h = kzalloc(sizeof(hook), GFP_KERNEL);
+    if(!h) {
+        goto cleanup;
+    }
+    
+    /* 1) save info about the source, the site (past the landing pad) will
+        jump to the dispatch link, which leads to the trampoline once it's
+        built */
+    h->src = src;
+    landing = omni_a64_landing(src, &auth);
+    h->site = (uint32_t *)src + landing;
+    if(0 != omni_chain_init(&h->chain, src, NULL)) {
+        goto cleanup;
+    }
+    h->entry = h->chain.dispatch;
+
+    /* src signed its return address, the detours must not see it signed:
+        one of them returning (or calling the original, which signs again)
+        would fail to authenticate it
+
+        00: autiasp|autibsp
+        04: <b dispatch> or <ldr x16, #8; br x16; dispatch> */
+    if(auth) {
+        h->unsign = omni_arena_alloc(ARENA_SLOT_SIZE, src);
+        if(!h->unsign) {
+            goto cleanup;
+        }
+
+        *(uint32_t *)h->unsign = auth;
+        n = omni_a64_jmp((uint8_t *)h->unsign + A64_INSN,
+            (uintptr_t)h->unsign + A64_INSN, (uintptr_t)h->chain.dispatch,
+            ARENA_SLOT_SIZE - A64_INSN);
+        flush_icache_range((unsigned long)h->unsign,
+            (unsigned long)h->unsign + A64_INSN + n);
+        h->entry = h->unsign;
+    }
+
+    /* a single b or nothing, see HOOK_JMP_SIZE */
+    if(!omni_a64_b((uintptr_t)h->site, (uintptr_t)h->entry)) {
+        omni_log_fail(src, NULL, OMNI_FAIL_REACH);
+        goto cleanup;
+    }
+    h->stolen_len = HOOK_JMP_SIZE;
+
+    /* claim the range before stealing from it, a concurrent add on an
+        overlapping site fails here instead of stealing our JMP */
+    set_bit(HOOK_BUSY, &h->state);
+    INIT_HLIST_NODE(&h->reg.node);
+    h->reg.src = src;
+    h->reg.len = landing * A64_INSN + h->stolen_len;
+    if(0 != omni_reg_insert(&h->reg)) {
+        omni_log_fail(src, NULL, OMNI_FAIL_OVERLAP);
+        goto cleanup;
+    }
+
+    memcpy(h->stolen, h->site, h->stolen_len);
+
+    /* 2) allocate, build the trampoline:
+        00: bti jc                ; reached by br x16 from a link
+        [04: paciasp|pacibsp]     ; src's own, signs the detour's return
+        XX: <stolen instructions, relocated>
+        YY: <b site + stolen_len>
+        ZZ: <literal pool>
+
+       relocation grows the stolen code (a literal per address it loads,
+       a b per conditional branch out of reach), so start at the smallest slot and retry larger ones */
+    for(size = ARENA_SLOT_SIZE; ; size <<= 1) {
+        tramp = (uint8_t *) omni_arena_alloc(size, src);
+        if(!tramp) {
+            goto cleanup;
+        }
+
+        pad = 0;
+        ((uint32_t *)tramp)[pad++] = A64_BTI_JC;
+        if(auth) {
+            ((uint32_t *)tramp)[pad++] = h->site[-1];
+        }
+        pad *= A64_INSN;
+
+        n = omni_a64_relocate(h->stolen, (uintptr_t)h->site,
+            h->stolen_len / A64_INSN, tramp + pad, (uintptr_t)tramp + pad,
+            size - pad);
+
+        if(n != A64_STEAL_NOSPACE || size == ARENA_SLOT_MAX) {
+            break;
+        }
+
+        omni_arena_free(tramp);
+    }
+
+    /* inform the hook struct */
+    h->trampoline = tramp;
+
+    if(n < 0) {
+        omni_log_fail(src, NULL, OMNI_FAIL_RELOCATE);
+        goto cleanup;
+    }
+
+    /* code is fetched through the I-cache, written through the D-cache */
+    flush_icache_range((unsigned long)tramp,
+        (unsigned long)tramp + pad + n);
+
+    omni_chain_set_tail(&h->chain, tramp);
+
+    rc = 0;
+
+    cleanup:
+    if(0 != rc) {
+        if(h) {
+            /* never visible to omnihook_find() callers without a grace period
+                passing first */
+            omni_reg_remove(&h->reg);
+            synchronize_rcu();
+            hook_destroy(h);
+            h = NULL;
+        }
+    }
+
+    return h;
+}
+
+static void
+hook_reclaim_free(struct omni_reclaim *r)
+{
+    hook_destroy(container_of(r, hook, reclaim));
+}
+
+static void
+detour_reclaim_free(struct omni_reclaim *r)
+{
+    omni_detour_free(container_of(r, struct omni_detour, reclaim));
+}
+
+/* takes hooks out of the registry and hands them to the reclaimer, which
+    frees the whole set after one grace period (no calls in flight are
+    tracked on arm64, a detour that sleeps must not be removed meanwhile) */
+static void
+hooks_release(hook **hooks, int count)
+{
+    int i;
+
+    for(i = 0; i < count; ++i) {
+        if(hooks[i]) {
+            omni_reg_remove(&(hooks[i]->reg));
+
+            hooks[i]->reclaim.free = hook_reclaim_free;
+            omni_reclaim_queue(&(hooks[i]->reclaim));
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// PATCHING
+//-----------------------------------------------------------------------------
+
+/* a batch of sites is written (or restored) inside one stop_machine() pass:
+    one CPU patches, every other CPU spins with interrupts disabled until it
+    is done and then discards whatever it fetched before the write with an
+    isb, the way the kernel's own aarch64_insn_patch_text() does it */
+struct patch_batch {
+    hook **hooks;
+    int count;
+    int restore; // nonzero: write stolen instructions back instead of the JMP
+    int patched; // sites written by the patching CPU
+    atomic_t cpus; // elects the patching CPU
+    int done;
+};
+
+static int
+patch_batch_stop(void *data)
+{
+    int i;
+    struct patch_batch *pb = data;
+    uint32_t jmpcode;
+
+    if(atomic_inc_return(&pb->cpus) != 1) {
+        while(!smp_load_acquire(&pb->done)) {
+            cpu_relax();
+        }
+        isb();
+        return 0;
+    }
+
+    for(i = 0; i < pb->count; ++i) {
+        hook *h = pb->hooks[i];
+
+        if(pb->restore) {
+            /* restore original instructions (unhook) */
+            write_text(h->site, h->stolen, h->stolen_len);
+            continue;
+        }
+
+        /* site changed since its instructions were stolen (possibly by an
+            earlier entry of this very batch), hooking it would lose that
+            change */
+        if(memcmp(h->site, h->stolen, h->stolen_len)) {
+            omni_log_fail(h->src, NULL, OMNI_FAIL_CHANGED);
+            break;
+        }
+
+        /* write the JMP over the site (actually hooking), one instruction,
+            its write cleans and invalidates its own line */
+        jmpcode = omni_a64_b((uintptr_t)h->site, (uintptr_t)h->entry);
+        write_text(h->site, &jmpcode, h->stolen_len);
+    }
+
+    pb->patched = i;
+
+    /* all or nothing: roll back whatever this pass already wrote */
+    if(i != pb->count) {
+        while(i--) {
+            write_text(pb->hooks[i]->site, pb->hooks[i]->stolen,
+                pb->hooks[i]->stolen_len);
+        }
+    }
+
+    smp_store_release(&pb->done, 1);
+
+    return 0;
+}
+
+static int
+patch_batch(hook **hooks, int count, int restore)
+{
+    int i;
+    struct patch_batch pb = {
+        .hooks = hooks,
+        .count = count,
+        .restore = restore,
+        .patched = 0,
+        .done = 0
+    };
+
+    atomic_set(&pb.cpus, 0);
+
+    stop_machine(patch_batch_stop, &pb, cpu_online_mask);
+
+    if(pb.patched != count) {
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(restore) {
+            omni_log_restore(hooks[i]->src, hooks[i]->stolen,
+                hooks[i]->stolen_len);
+        }
+        else {
+            omni_log_patch(hooks[i]->src, hooks[i]->site,
+                hooks[i]->stolen_len);
+        }
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// HOOKLIB MAIN API
+//-----------------------------------------------------------------------------
+
+int
+omnihook_init(void)
+{
+    /* hooks work without their event log */
+    if(0 != omni_events_init()) {
+        printk("WARNING: omnihook events unavailable\n");
+    }
+
+    return 0;
+}
+
+void
+omnihook_exit(void)
+{
+    /* removed hooks (and detours) are freed in the background */
+    omni_reclaim_flush();
+
+    omni_events_exit();
+}
+
+/* builds every new site's trampoline first, then patches all of them in a
+    single stop-the-world pass, then links the detours in; if anything fails
+    nothing changes (no new site stays hooked, no chain is touched) */
+int
+omnihook_add_batch(omnihook_desc *descs, int count)
+{
+    int rc = -1, i, j, nsites = 0;
+    hook **sites = NULL; // built by this batch
+    hook **owners = NULL; // site of each desc
+    struct omni_detour **detours = NULL;
+
+    if(count <= 0) {
+        return -1;
+    }
+
+    sites = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    owners = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    detours = kcalloc(count, sizeof(struct omni_detour *), GFP_KERNEL);
+    if(!sites || !owners || !detours) {
+        goto cleanup;
+    }
+
+    if(0 != resolve_text_patch()) {
+        goto cleanup;
+    }
+
+    mutex_lock(&hooks_lock);
+
+    for(i = 0; i < count; ++i) {
+        /* a site hooked earlier (or earlier in this batch) gets another
+            detour, hooks can't go away while hooks_lock is held */
+        rcu_read_lock();
+        owners[i] = omnihook_find(descs[i].src);
+        rcu_read_unlock();
+
+        if(!owners[i]) {
+            owners[i] = hook_build(descs[i].src);
+            if(!owners[i]) {
+                goto unlock;
+            }
+            sites[nsites++] = owners[i];
+        }
+
+        for(j = 0; j < i; ++j) {
+            if(owners[j] == owners[i] && descs[j].dst == descs[i].dst) {
+                break;
+            }
+        }
+        if(j != i || omni_chain_find(&owners[i]->chain, descs[i].dst)) {
+            omni_log_fail(descs[i].src, descs[i].dst, OMNI_FAIL_DUPLICATE);
+            goto unlock;
+        }
+
+        detours[i] = omni_detour_new(&owners[i]->chain, descs[i].dst,
+            descs[i].priority);
+        if(!detours[i]) {
+            omni_log_fail(descs[i].src, descs[i].dst, OMNI_FAIL_NOMEM);
+            goto unlock;
+        }
+
+        /* inform the caller now, the detour can run the moment it's
+            linked in */
+        *(descs[i].trampoline) = detours[i]->link;
+    }
+
+    if(nsites && 0 != patch_batch(sites, nsites, 0)) {
+        goto unlock;
+    }
+
+    for(i = 0; i < count; ++i) {
+        omni_chain_insert(&owners[i]->chain, detours[i]);
+        detours[i] = NULL;
+
+        omni_log_install(descs[i].src, descs[i].dst, *(descs[i].trampoline));
+    }
+
+    /* sites are live, removers may claim them now */
+    for(i = 0; i < nsites; ++i) {
+        clear_bit(HOOK_BUSY, &(sites[i]->state));
+    }
+
+    rc = 0;
+
+    unlock:
+    if(0 != rc) {
+        for(i = 0; i < count; ++i) {
+            if(detours[i]) {
+                *(descs[i].trampoline) = NULL;
+                omni_detour_free(detours[i]);
+            }
+        }
+
+        hooks_release(sites, nsites);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    cleanup:
+    kfree(detours);
+    kfree(owners);
+    kfree(sites);
+
+    return rc;
+}
+
+int
+omnihook_add_prio(void *src, void *dst, int priority, /* out */ void **trampoline)
+{
+    omnihook_desc desc = { src, dst, trampoline, priority };
+
+    return omnihook_add_batch(&desc, 1);
+}
+
+int
+omnihook_add(void *src, void *dst, /* out */ void **trampoline)
+{
+    return omnihook_add_prio(src, dst, 0, trampoline);
+}
+
+hook *
+omnihook_find(void *src)
+{
+    struct omni_reg_node *n = omni_reg_find(src);
+
+    return n ? container_of(n, hook, reg) : NULL;
+}
+
+/* marks a live hook as being torn down, fails if it's already claimed (by a
+    concurrent remove) or isn't live yet (still being added) */
+static int
+hook_claim(hook *h)
+{
+    return test_and_set_bit(HOOK_BUSY, &h->state) ? -1 : 0;
+}
+
+/* unpatches the given (claimed) hooks in one pass, then frees them */
+static int
+remove_hooks(hook **hooks, int count)
+{
+    int i, n = 0;
+
+    /* disabled sites are restored already, they go last */
+    for(i = 0; i < count; ++i) {
+        if(!test_bit(HOOK_DISABLED, &(hooks[i]->state))) {
+            swap(hooks[n], hooks[i]);
+            n++;
+        }
+    }
+
+    /* nothing was restored, every hook stays live: hand the claims back or
+        none of them could ever be removed again */
+    if(n && 0 != patch_batch(hooks, n, 1)) {
+        for(i = 0; i < count; ++i) {
+            clear_bit(HOOK_BUSY, &(hooks[i]->state));
+        }
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        omni_log_remove(hooks[i]->src, NULL);
+    }
+
+    hooks_release(hooks, count);
+
+    return 0;
+}
+
+/* all or nothing: fails without unhooking anything if any src isn't hooked */
+int
+omnihook_remove_batch(omnihook_desc *descs, int count)
+{
+    int rc = -1, i;
+    hook **hooks = NULL;
+
+    if(count <= 0) {
+        goto cleanup;
+    }
+
+    hooks = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    if(!hooks) {
+        goto cleanup;
+    }
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    for(i = 0; i < count; ++i) {
+        hook *h = omnihook_find(descs[i].src);
+
+        if(!h || 0 != hook_claim(h)) {
+            omni_log_fail(descs[i].src, NULL,
+                h ? OMNI_FAIL_BUSY : OMNI_FAIL_NOT_HOOKED);
+            break;
+        }
+
+        hooks[i] = h;
+    }
+    rcu_read_unlock();
+
+    if(i != count) {
+
+        /* hand back what was claimed */
+        while(i--) {
+            clear_bit(HOOK_BUSY, &(hooks[i]->state));
+        }
+    }
+    else {
+        rc = remove_hooks(hooks, count);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    cleanup:
+    kfree(hooks);
+
+    return rc;
+}
+
+struct remove_ctx {
+    hook **hooks;
+    int count;
+    int max;
+};
+
+static int
+remove_collect(struct omni_reg_node *n, void *data)
+{
+    struct remove_ctx *ctx = data;
+    hook *h = container_of(n, hook, reg);
+
+    if(ctx->count == ctx->max) {
+        return 1;
+    }
+
+    if(0 == hook_claim(h)) {
+        ctx->hooks[ctx->count++] = h;
+    }
+
+    return 0;
+}
+
+/* when address is given (non-NULL), it remove single hook from this address
+    when address is not given (ie value NULL), it removes all hooks in the registry */
+int 
+omnihook_remove_general(void *src)
+{
+    int rc = -1;
+    hook *h;
+    struct remove_ctx ctx = { NULL, 0, 0 };
+
+    mutex_lock(&hooks_lock);
+
+    /* if source specified, only remove this one */
+    if(src) {
+        rcu_read_lock();
+        h = omnihook_find(src);
+        rcu_read_unlock();
+
+        if(!h) {
+            omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+        }
+        else if(0 != hook_claim(h)) {
+            omni_log_fail(src, NULL, OMNI_FAIL_BUSY);
+        }
+        else {
+            rc = remove_hooks(&h, 1);
+        }
+
+        goto cleanup;
+    }
+
+    /* otherwise, remove them all */
+    ctx.max = omni_reg_count();
+    if(!ctx.max) {
+        goto cleanup;
+    }
+
+    ctx.hooks = kcalloc(ctx.max, sizeof(hook *), GFP_KERNEL);
+    if(!ctx.hooks) {
+        goto cleanup;
+    }
+
+    omni_reg_for_each(remove_collect, &ctx);
+
+    if(ctx.count) {
+        rc = remove_hooks(ctx.hooks, ctx.count);
+    }
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+    kfree(ctx.hooks);
+
+    return rc;
+}
+
+int 
+omnihook_remove(void *src)
+{
+    return omnihook_remove_general(src);
+}
+
+int
+omnihook_remove_detour(void *src, void *dst)
+{
+    int rc = -1;
+    hook *h;
+    struct omni_detour *d = NULL;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h) {
+        d = omni_chain_find(&h->chain, dst);
+    }
+
+    if(!d) {
+        omni_log_fail(src, dst, OMNI_FAIL_NOT_HOOKED);
+        goto cleanup;
+    }
+
+    /* the last detour takes the site with it */
+    if(h->chain.count == 1) {
+        if(0 == hook_claim(h)) {
+            rc = remove_hooks(&h, 1);
+        }
+        else {
+            omni_log_fail(src, dst, OMNI_FAIL_BUSY);
+        }
+
+        goto cleanup;
+    }
+
+    /* the site keeps jumping to the dispatch link, which no longer leads
+        through d; whoever was already on the way is waited out before d is
+        freed */
+    omni_chain_unlink(&h->chain, d);
+
+    d->site = h;
+    d->reclaim.free = detour_reclaim_free;
+    omni_reclaim_queue(&d->reclaim);
+
+    omni_log_remove(src, dst);
+
+    rc = 0;
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+/* new_dst takes old_dst's place on src, NULL: the only detour there */
+static int
+replace_general(void *src, void *old_dst, void *new_dst,
+    /* out */ void **trampoline)
+{
+    int rc = -1;
+    hook *h;
+    struct omni_detour *old = NULL, *d;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h && old_dst) {
+        old = omni_chain_find(&h->chain, old_dst);
+    }
+    else if(h && h->chain.count == 1) {
+        old = list_first_entry(&h->chain.detours, struct omni_detour, list);
+    }
+    else if(h) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_AMBIGUOUS);
+        goto cleanup;
+    }
+
+    /* a return hook's stub is only replaced along with the return hook */
+    if(!old || old->stub) {
+        omni_log_fail(src, old_dst, OMNI_FAIL_NOT_HOOKED);
+        goto cleanup;
+    }
+
+    if(omni_chain_find(&h->chain, new_dst)) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_DUPLICATE);
+        goto cleanup;
+    }
+
+    d = omni_detour_new(&h->chain, new_dst, old->priority);
+    if(!d) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_NOMEM);
+        goto cleanup;
+    }
+
+    /* inform the caller now, new_dst can run the moment it's linked in */
+    *trampoline = d->link;
+
+    omni_log_remove(src, old->dst);
+
+    /* the site and the trampoline stay as they are, only the link leading
+        to old changes; calls already in old_dst finish through old's own
+        link, which is waited out before it's freed */
+    omni_chain_replace(&h->chain, old, d);
+
+    old->site = h;
+    old->reclaim.free = detour_reclaim_free;
+    omni_reclaim_queue(&old->reclaim);
+
+    omni_log_install(src, new_dst, d->link);
+
+    rc = 0;
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+int
+omnihook_replace(void *src, void *new_dst, /* out */ void **trampoline)
+{
+    return replace_general(src, NULL, new_dst, trampoline);
+}
+
+int
+omnihook_replace_detour(void *src, void *old_dst, void *new_dst,
+    /* out */ void **trampoline)
+{
+    return replace_general(src, old_dst, new_dst, trampoline);
+}
+
+int
+omnihook_remove_all(void)
+{
+    return omnihook_remove_general(NULL);
+}
+
+//-----------------------------------------------------------------------------
+// ENABLE/DISABLE
+//-----------------------------------------------------------------------------
+
+/* writes the JMP back over (enable) or restores (disable) every hook given
+    that isn't in that state yet, in one pass; called under hooks_lock, so
+    every hook found is live and none is being claimed meanwhile */
+static int
+toggle_hooks(hook **hooks, int count, int enable)
+{
+    int i, n = 0;
+
+    for(i = 0; i < count; ++i) {
+        if(enable == test_bit(HOOK_DISABLED, &(hooks[i]->state))) {
+            hooks[n++] = hooks[i];
+        }
+    }
+
+    if(!n) {
+        return 0;
+    }
+
+    if(0 != patch_batch(hooks, n, !enable)) {
+        return -1;
+    }
+
+    for(i = 0; i < n; ++i) {
+        if(enable) {
+            clear_bit(HOOK_DISABLED, &(hooks[i]->state));
+            omni_log_enable(hooks[i]->src);
+        }
+        else {
+            set_bit(HOOK_DISABLED, &(hooks[i]->state));
+            omni_log_disable(hooks[i]->src);
+        }
+    }
+
+    return n;
+}
+
+static int
+toggle_one(void *src, int enable)
+{
+    int rc = -1;
+    hook *h;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(!h) {
+        omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+    }
+    else if(toggle_hooks(&h, 1, enable) >= 0) {
+        rc = 0;
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+int
+omnihook_disable(void *src)
+{
+    return toggle_one(src, 0);
+}
+
+int
+omnihook_enable(void *src)
+{
+    return toggle_one(src, 1);
+}
+
+int
+omnihook_set_group(void *src, const char *group)
+{
+    int rc = -1;
+    hook *h;
+    char *copy = NULL;
+
+    if(group) {
+        copy = kstrdup(group, GFP_KERNEL);
+        if(!copy) {
+            return -1;
+        }
+    }
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h) {
+        swap(h->group, copy);
+        rc = 0;
+    }
+    else {
+        omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    kfree(copy);
+
+    return rc;
+}
+
+struct group_ctx {
+    const char *group;
+    hook **hooks;
+    int count;
+    int max;
+};
+
+static int
+group_collect(struct omni_reg_node *n, void *data)
+{
+    struct group_ctx *ctx = data;
+    hook *h = container_of(n, hook, reg);
+
+    if(ctx->count == ctx->max) {
+        return 1;
+    }
+
+    if(h->group && 0 == strcmp(h->group, ctx->group)) {
+        ctx->hooks[ctx->count++] = h;
+    }
+
+    return 0;
+}
+
+static int
+toggle_group(const char *group, int enable)
+{
+    int rc = -1;
+    struct group_ctx ctx = { group, NULL, 0, 0 };
+
+    mutex_lock(&hooks_lock);
+
+    ctx.max = omni_reg_count();
+    if(!ctx.max) {
+        rc = 0;
+        goto cleanup;
+    }
+
+    ctx.hooks = kcalloc(ctx.max, sizeof(hook *), GFP_KERNEL);
+    if(!ctx.hooks) {
+        goto cleanup;
+    }
+
+    omni_reg_for_each(group_collect, &ctx);
+
+    rc = toggle_hooks(ctx.hooks, ctx.count, enable);
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+    kfree(ctx.hooks);
+
+    return rc;
+}
+
+int
+omnihook_disable_group(const char *group)
+{
+    return toggle_group(group, 0);
+}
+
+int
+omnihook_enable_group(const char *group)
+{
+    return toggle_group(group, 1);
+}
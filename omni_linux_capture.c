@@ -0,0 +1,185 @@
+#include <linux/types.h>
+#include <linux/kernel.h> /* min_t() */
+#include <linux/module.h> /* THIS_MODULE */
+#include <linux/fs.h>
+#include <linux/mm.h> /* PAGE_ALIGN() */
+#include <linux/vmalloc.h> /* vmalloc_user(), remap_vmalloc_range() */
+#include <linux/miscdevice.h>
+#include <linux/cpumask.h> /* nr_cpu_ids */
+#include <linux/smp.h> /* smp_processor_id() */
+#include <linux/sched.h> /* current */
+#include <linux/sched/clock.h> /* local_clock() */
+#include <linux/hardirq.h> /* in_nmi() */
+#include <linux/atomic.h> /* smp_load_acquire() */
+#include <linux/irqflags.h>
+#include <linux/rcupdate.h> /* synchronize_rcu() */
+#include <linux/log2.h> /* roundup_pow_of_two() */
+
+#include "omni_linux_capture.h"
+
+/* every CPU's area, back to back; userspace maps the lot */
+static void *capture_area;
+static unsigned long capture_area_size;
+
+/* the kernel's own copy of the ring size, the mapping is writable and its
+    header can't be trusted for indexing */
+static u64 capture_mask;
+
+static struct omnihook_capture_ring *
+capture_ring(void *area, int cpu)
+{
+    return (struct omnihook_capture_ring *)((uint8_t *)area +
+        cpu * capture_area_size);
+}
+
+static struct omnihook_capture_rec *
+capture_recs(struct omnihook_capture_ring *r)
+{
+    return (struct omnihook_capture_rec *)((uint8_t *)r + PAGE_SIZE);
+}
+
+//-----------------------------------------------------------------------------
+// WRITER
+//-----------------------------------------------------------------------------
+
+void
+omni_capture_record(void *src, const unsigned long *args, unsigned int nargs)
+{
+    unsigned int i;
+    unsigned long flags;
+    u64 head;
+    void *area;
+    struct omnihook_capture_ring *r;
+    struct omnihook_capture_rec *rec;
+
+    /* the only thing that can interrupt a write below */
+    if(in_nmi()) {
+        return;
+    }
+
+    local_irq_save(flags);
+
+    area = READ_ONCE(capture_area);
+    if(!area) {
+        goto out;
+    }
+
+    r = capture_ring(area, smp_processor_id());
+    head = r->head;
+
+    /* lossy: the reader hasn't made room */
+    if(head - smp_load_acquire(&r->tail) > capture_mask) {
+        WRITE_ONCE(r->lost, r->lost + 1);
+        goto out;
+    }
+
+    rec = &capture_recs(r)[head & capture_mask];
+    rec->time = local_clock();
+    rec->src = (uintptr_t)src;
+    rec->cpu = smp_processor_id();
+    rec->pid = current->pid;
+    rec->tgid = current->tgid;
+    rec->nargs = min_t(unsigned int, nargs, OMNI_CAPTURE_ARGS);
+    for(i = 0; i < rec->nargs; ++i) {
+        rec->args[i] = args[i];
+    }
+
+    /* complete before the reader sees it */
+    smp_store_release(&r->head, head + 1);
+
+    out:
+    local_irq_restore(flags);
+}
+
+//-----------------------------------------------------------------------------
+// DEVICE
+//-----------------------------------------------------------------------------
+
+static int
+capture_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    return remap_vmalloc_range(vma, capture_area, vma->vm_pgoff);
+}
+
+static const struct file_operations capture_fops = {
+    .owner = THIS_MODULE,
+    .mmap = capture_mmap,
+};
+
+static struct miscdevice capture_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "omnihook_capture",
+    .fops = &capture_fops,
+    .mode = 0600,
+};
+
+//-----------------------------------------------------------------------------
+// CAPTURE API
+//-----------------------------------------------------------------------------
+
+int
+omnihook_capture_init(unsigned int records)
+{
+    int rc = -1;
+    unsigned int cpu;
+    void *area = NULL;
+
+    if(capture_area || !records) {
+        goto cleanup;
+    }
+
+    records = roundup_pow_of_two(records);
+    capture_area_size = PAGE_SIZE +
+        PAGE_ALIGN(records * sizeof(struct omnihook_capture_rec));
+
+    /* zeroed, and fit for remap_vmalloc_range() */
+    area = vmalloc_user(nr_cpu_ids * capture_area_size);
+    if(!area) {
+        goto cleanup;
+    }
+
+    for(cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+        struct omnihook_capture_ring *r = capture_ring(area, cpu);
+
+        r->records = records;
+        r->rec_size = sizeof(struct omnihook_capture_rec);
+        r->area_size = capture_area_size;
+    }
+
+    capture_mask = records - 1;
+
+    /* writers may start now, no capture hook exists yet anyway */
+    smp_store_release(&capture_area, area);
+
+    if(0 != misc_register(&capture_dev)) {
+        printk("ERROR: could not register /dev/omnihook_capture\n");
+        WRITE_ONCE(capture_area, NULL);
+        goto cleanup;
+    }
+
+    area = NULL;
+
+    rc = 0;
+
+    cleanup:
+    vfree(area);
+
+    return rc;
+}
+
+void
+omnihook_capture_exit(void)
+{
+    void *area = capture_area;
+
+    if(!area) {
+        return;
+    }
+
+    /* unmapped by now, the device held the module until then */
+    misc_deregister(&capture_dev);
+
+    WRITE_ONCE(capture_area, NULL);
+    synchronize_rcu();
+    vfree(area);
+}
@@ -0,0 +1,63 @@
+#ifndef OMNI_LINUX_CAPTURE_H
+#define OMNI_LINUX_CAPTURE_H
+
+/* argument capture: a hook declared with OMNIHOOK_DEFINE_CAPTURE()
+    (omni_typed.h) records time, CPU, pid and its first register arguments
+    into a ring per CPU, then the original runs; userspace maps every ring
+    from /dev/omnihook_capture and reads the records in place, nothing is
+    copied out
+
+    the mapping is one area per CPU id (nr_cpu_ids of them, in order), each
+    area_size bytes:
+
+        struct omnihook_capture_ring        (the first page)
+        struct omnihook_capture_rec[records]
+
+    the kernel writes head and lost, the reader only tail: records from tail
+    up to head are complete (load head with acquire, store tail with release
+    once done with them). a full ring drops new records and counts them in
+    lost, a record is never overwritten before the reader moved past it;
+    calls made from NMI context aren't captured
+
+    this header is also the reader's, it builds in userspace */
+
+#include <linux/types.h>
+
+#define OMNI_CAPTURE_ARGS 8
+
+struct omnihook_capture_rec {
+    __u64 time; // local_clock(), ns
+    __u64 src; // function hooked
+    __u32 cpu;
+    __u32 pid; // thread, or the interrupted one's
+    __u32 tgid;
+    __u32 nargs; // args captured, from the hook's declaration
+    __u64 args[OMNI_CAPTURE_ARGS]; // raw argument registers
+};
+
+struct omnihook_capture_ring {
+    __u64 head; // records written
+    __u64 tail; // records consumed, written by the reader
+    __u64 lost; // records dropped on a full ring
+    __u32 records; // capacity, a power of two
+    __u32 rec_size;
+    __u64 area_size; // from this header to the next CPU's
+};
+
+#if defined(__KERNEL__)
+/* allocates the rings (records per CPU, rounded up to a power of two) and
+    registers /dev/omnihook_capture; call before adding capture hooks, and
+    exit after they're all removed (the device keeps the module loaded while
+    it's open or mapped) */
+int
+omnihook_capture_init(unsigned int records);
+
+void
+omnihook_capture_exit(void);
+
+/* any context, never sleeps, does nothing before omnihook_capture_init() */
+void
+omni_capture_record(void *src, const unsigned long *args, unsigned int nargs);
+#endif
+
+#endif
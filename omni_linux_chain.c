@@ -0,0 +1,153 @@
+#include <linux/types.h>
+#include <linux/list.h> /* list_head, etc. */
+#include <linux/rculist.h> /* list_add_rcu(), etc. */
+#include <linux/slab.h> /* kmalloc(), kfree(), etc. */
+
+#include "omni_linux_arena.h"
+#include "omni_linux_reclaim.h"
+#include "omni_linux_chain.h"
+
+/* points every link at what follows it, back to front, so no link is ever
+    aimed at a detour whose own link isn't set yet */
+static void
+chain_relink(struct omni_chain *c)
+{
+    void *next = c->tail;
+    struct omni_detour *d;
+
+    list_for_each_entry_reverse(d, &c->detours, list) {
+        omni_link_set(d->link, next);
+        next = d->dst;
+    }
+
+    omni_link_set(c->dispatch, next);
+}
+
+//-----------------------------------------------------------------------------
+// CHAIN API
+//-----------------------------------------------------------------------------
+
+int
+omni_chain_init(struct omni_chain *c, void *near, void *tail)
+{
+    INIT_LIST_HEAD(&c->detours);
+    c->tail = tail;
+    c->count = 0;
+
+    c->dispatch = omni_arena_alloc(OMNI_LINK_SIZE, near);
+    if(!c->dispatch) {
+        return -1;
+    }
+
+    omni_link_emit(c->dispatch, tail);
+
+    return 0;
+}
+
+void
+omni_chain_set_tail(struct omni_chain *c, void *tail)
+{
+    c->tail = tail;
+    chain_relink(c);
+}
+
+void
+omni_chain_destroy(struct omni_chain *c)
+{
+    struct omni_detour *d, *tmp;
+
+    list_for_each_entry_safe(d, tmp, &c->detours, list) {
+        list_del(&d->list);
+        omni_detour_free(d);
+    }
+    c->count = 0;
+
+    omni_arena_free(c->dispatch);
+    c->dispatch = NULL;
+}
+
+struct omni_detour *
+omni_detour_new(struct omni_chain *c, void *dst, int priority)
+{
+    struct omni_detour *d;
+
+    d = kzalloc(sizeof(*d), GFP_KERNEL);
+    if(!d) {
+        return NULL;
+    }
+
+    /* links sit next to the dispatch link, in reach of the trampoline */
+    d->link = omni_arena_alloc(OMNI_LINK_SIZE, c->dispatch);
+    if(!d->link) {
+        kfree(d);
+        return NULL;
+    }
+
+    d->dst = dst;
+    d->priority = priority;
+    INIT_LIST_HEAD(&d->list);
+    omni_link_emit(d->link, c->tail);
+
+    return d;
+}
+
+void
+omni_detour_free(struct omni_detour *d)
+{
+    omni_arena_free(d->link);
+    omni_arena_free(d->stub);
+    kfree(d);
+}
+
+void
+omni_chain_insert(struct omni_chain *c, struct omni_detour *d)
+{
+    struct omni_detour *cursor;
+    struct list_head *before = &c->detours;
+
+    /* after every detour of the same or higher priority */
+    list_for_each_entry(cursor, &c->detours, list) {
+        if(cursor->priority < d->priority) {
+            before = &cursor->list;
+            break;
+        }
+    }
+
+    list_add_tail_rcu(&d->list, before);
+    c->count++;
+
+    chain_relink(c);
+}
+
+void
+omni_chain_unlink(struct omni_chain *c, struct omni_detour *d)
+{
+    list_del_rcu(&d->list);
+    c->count--;
+
+    chain_relink(c);
+}
+
+void
+omni_chain_replace(struct omni_chain *c, struct omni_detour *old,
+    struct omni_detour *d)
+{
+    d->priority = old->priority;
+    list_replace_rcu(&old->list, &d->list);
+
+    chain_relink(c);
+}
+
+struct omni_detour *
+omni_chain_find(struct omni_chain *c, void *dst)
+{
+    struct omni_detour *cursor;
+
+    list_for_each_entry(cursor, &c->detours, list) {
+        if(cursor->dst == dst) {
+            return cursor;
+        }
+    }
+
+    return NULL;
+}
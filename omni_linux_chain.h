@@ -0,0 +1,89 @@
+#ifndef OMNI_LINUX_CHAIN_H
+#define OMNI_LINUX_CHAIN_H
+
+/* detour chains: a site is patched once, to jump to its dispatch link, and
+    every detour on it gets a link of its own, handed out as its trampoline:
+
+    site -> dispatch -> detour A -> A's link -> detour B -> B's link -> trampoline
+
+    a link is a tiny arena stub jumping through a pointer it carries, so
+    adding or removing a detour only retargets links (one aligned pointer
+    store each), neither the site nor any code is rewritten */
+#if defined(__aarch64__)
+#define OMNI_LINK_SIZE 24 /* bti landing pad, ldr, br, pad, 8 byte target */
+#elif defined(__amd64__)
+#define OMNI_LINK_SIZE 24 /* endbr64, jmp *, pad, 8 byte target */
+#else
+#define OMNI_LINK_SIZE 16
+#endif
+
+struct omni_chain {
+    struct list_head detours; // struct omni_detour, call order (RCU)
+    void *dispatch; // link the site jumps to
+    void *tail; // the trampoline, original behavior
+    int count;
+};
+
+struct omni_detour {
+    struct list_head list;
+    void *dst;
+    int priority; // higher is called first, ties in order of addition
+    void *link; // continues to whatever follows this detour
+    struct omni_reclaim reclaim; // deferred free once unlinked
+    void *site; // the backend's hook, for reclaim
+    unsigned int epoch; // in flight epoch it was retired in (amd64)
+    void *stub; // arena slot freed along with the detour (a return hook's dst)
+};
+
+/* provided by the backend: writes a link jumping to target, retargets one,
+    reads one's target */
+void
+omni_link_emit(void *link, void *target);
+
+void
+omni_link_set(void *link, void *target);
+
+void *
+omni_link_target(void *link);
+
+/* the dispatch link passes straight through to tail until detours are
+    inserted; near is the site (for arena placement), tail may be NULL and
+    set later, before the site is patched */
+int
+omni_chain_init(struct omni_chain *c, void *near, void *tail);
+
+void
+omni_chain_set_tail(struct omni_chain *c, void *tail);
+
+/* frees the dispatch link and every detour left, unreachable by now */
+void
+omni_chain_destroy(struct omni_chain *c);
+
+/* a detour for c, not reachable until inserted; its link already leads to
+    the original */
+struct omni_detour *
+omni_detour_new(struct omni_chain *c, void *dst, int priority);
+
+void
+omni_detour_free(struct omni_detour *d);
+
+/* insert/unlink are serialized by the caller; an unlinked detour may still
+    be running, free it through its reclaim entry */
+void
+omni_chain_insert(struct omni_chain *c, struct omni_detour *d);
+
+void
+omni_chain_unlink(struct omni_chain *c, struct omni_detour *d);
+
+/* puts d in old's place (its priority, its position); the link leading to
+    old is the only one retargeted, so calls switch over with one store and
+    none skips the chain. old may still be running, free it through its
+    reclaim entry */
+void
+omni_chain_replace(struct omni_chain *c, struct omni_detour *old,
+    struct omni_detour *d);
+
+struct omni_detour *
+omni_chain_find(struct omni_chain *c, void *dst);
+
+#endif
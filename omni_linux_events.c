@@ -0,0 +1,312 @@
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h> /* DEFINE_PER_CPU(), per_cpu() */
+#include <linux/cpumask.h> /* for_each_possible_cpu() */
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include <linux/sched/clock.h> /* local_clock() */
+#include <linux/math64.h> /* div_u64_rem() */
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "omni_linux_events.h"
+
+static struct dentry *debugfs_dir;
+
+#if OMNIHOOK_LOG_LEVEL >= 1
+struct event_ring {
+    atomic_long_t head; // events ever logged on this CPU
+    struct omni_event ev[OMNI_EVENTS_PER_CPU];
+};
+
+static DEFINE_PER_CPU(struct event_ring *, event_rings);
+
+/* what the reader copies out of a ring */
+struct event_copy {
+    struct omni_event ev;
+    int cpu;
+};
+
+static const char *const event_names[] = {
+    [OMNI_EV_INSTALL] = "install",
+    [OMNI_EV_REMOVE] = "remove",
+    [OMNI_EV_FAIL] = "fail",
+    [OMNI_EV_PATCH] = "patch",
+    [OMNI_EV_RESTORE] = "restore",
+    [OMNI_EV_ENABLE] = "enable",
+    [OMNI_EV_DISABLE] = "disable",
+};
+
+static const char *const fail_names[] = {
+    [OMNI_FAIL_NOMEM] = "nomem",
+    [OMNI_FAIL_RELOCATE] = "relocate",
+    [OMNI_FAIL_OVERLAP] = "overlap",
+    [OMNI_FAIL_DUPLICATE] = "duplicate",
+    [OMNI_FAIL_CHANGED] = "changed",
+    [OMNI_FAIL_NOT_HOOKED] = "not_hooked",
+    [OMNI_FAIL_BUSY] = "busy",
+    [OMNI_FAIL_AMBIGUOUS] = "ambiguous",
+    [OMNI_FAIL_REACH] = "reach",
+};
+
+//-----------------------------------------------------------------------------
+// WRITER
+//-----------------------------------------------------------------------------
+
+void
+omni_event_log(int type, void *src, void *dst, void *aux, unsigned int reason,
+    const void *bytes, unsigned int len)
+{
+    unsigned long idx;
+    struct event_ring *r;
+    struct omni_event *e;
+
+    preempt_disable();
+
+    r = this_cpu_read(event_rings);
+    if(!r) {
+        goto out;
+    }
+
+    /* an interrupt logging on this CPU meanwhile just takes the next slot */
+    idx = atomic_long_inc_return(&r->head) - 1;
+    e = &r->ev[idx & (OMNI_EVENTS_PER_CPU - 1)];
+
+    /* readers skip the slot until it's complete again */
+    WRITE_ONCE(e->seq, 0);
+    smp_wmb();
+
+    e->time = local_clock();
+    e->type = type;
+    e->reason = reason;
+    e->src = src;
+    e->dst = dst;
+    e->aux = aux;
+    e->len = min_t(unsigned int, len, OMNI_EVENT_BYTES);
+    if(bytes) {
+        memcpy(e->bytes, bytes, e->len);
+    }
+
+    smp_store_release(&e->seq, idx + 1);
+
+    out:
+    preempt_enable();
+}
+
+//-----------------------------------------------------------------------------
+// DEBUGFS
+//-----------------------------------------------------------------------------
+
+static int
+event_copy_cmp(const void *a, const void *b)
+{
+    u64 x = ((const struct event_copy *)a)->ev.time;
+    u64 y = ((const struct event_copy *)b)->ev.time;
+
+    return (x > y) - (x < y);
+}
+
+/* every complete event still in a ring; one overwritten while being copied
+    is dropped */
+static int
+events_collect(struct event_copy *out)
+{
+    int cpu, n = 0;
+    unsigned long head, idx, seq;
+
+    for_each_possible_cpu(cpu) {
+        struct event_ring *r = per_cpu(event_rings, cpu);
+
+        if(!r) {
+            continue;
+        }
+
+        head = atomic_long_read(&r->head);
+        idx = head > OMNI_EVENTS_PER_CPU ? head - OMNI_EVENTS_PER_CPU : 0;
+
+        for(; idx < head; ++idx) {
+            struct omni_event *e = &r->ev[idx & (OMNI_EVENTS_PER_CPU - 1)];
+
+            seq = smp_load_acquire(&e->seq);
+            if(seq != idx + 1) {
+                continue;
+            }
+
+            out[n].ev = *e;
+            smp_rmb();
+            if(READ_ONCE(e->seq) != seq) {
+                continue;
+            }
+
+            out[n++].cpu = cpu;
+        }
+    }
+
+    return n;
+}
+
+static void
+event_show(struct seq_file *m, struct event_copy *c)
+{
+    u32 ns;
+    unsigned int i;
+    struct omni_event *e = &c->ev;
+    u64 s = div_u64_rem(e->time, NSEC_PER_SEC, &ns);
+
+    seq_printf(m, "%llu.%06u cpu%d %s src=%px", s, ns / 1000, c->cpu,
+        e->type < ARRAY_SIZE(event_names) && event_names[e->type] ?
+        event_names[e->type] : "?", e->src);
+
+    switch(e->type) {
+        case OMNI_EV_INSTALL:
+            seq_printf(m, " dst=%px trampoline=%px", e->dst, e->aux);
+            break;
+        case OMNI_EV_REMOVE:
+            if(e->dst) {
+                seq_printf(m, " dst=%px", e->dst);
+            }
+            break;
+        case OMNI_EV_FAIL:
+            if(e->dst) {
+                seq_printf(m, " dst=%px", e->dst);
+            }
+            seq_printf(m, " reason=%s",
+                e->reason < ARRAY_SIZE(fail_names) && fail_names[e->reason] ?
+                fail_names[e->reason] : "?");
+            break;
+        case OMNI_EV_PATCH:
+        case OMNI_EV_RESTORE:
+            seq_printf(m, " bytes=");
+            for(i = 0; i < e->len; ++i) {
+                seq_printf(m, "%02x", e->bytes[i]);
+            }
+            break;
+    }
+
+    seq_putc(m, '\n');
+}
+
+static int
+events_file_show(struct seq_file *m, void *unused)
+{
+    int i, n;
+    struct event_copy *copies;
+
+    copies = vmalloc(num_possible_cpus() * OMNI_EVENTS_PER_CPU *
+        sizeof(*copies));
+    if(!copies) {
+        return -ENOMEM;
+    }
+
+    n = events_collect(copies);
+    sort(copies, n, sizeof(*copies), event_copy_cmp, NULL);
+
+    for(i = 0; i < n; ++i) {
+        event_show(m, &copies[i]);
+    }
+
+    vfree(copies);
+
+    return 0;
+}
+
+static int
+events_file_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, events_file_show, NULL);
+}
+
+static const struct file_operations events_fops = {
+    .owner = THIS_MODULE,
+    .open = events_file_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int
+events_rings_alloc(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct event_ring *r = vzalloc_node(sizeof(*r), cpu_to_node(cpu));
+
+        if(!r) {
+            return -1;
+        }
+
+        per_cpu(event_rings, cpu) = r;
+    }
+
+    return 0;
+}
+
+static void
+events_rings_free(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        vfree(per_cpu(event_rings, cpu));
+        per_cpu(event_rings, cpu) = NULL;
+    }
+}
+#else
+void
+omni_event_log(int type, void *src, void *dst, void *aux, unsigned int reason,
+    const void *bytes, unsigned int len)
+{
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// EVENTS API
+//-----------------------------------------------------------------------------
+
+int
+omni_events_init(void)
+{
+    int rc = 0;
+
+    debugfs_dir = debugfs_create_dir(OMNI_DEBUGFS_NAME, NULL);
+    if(IS_ERR_OR_NULL(debugfs_dir)) {
+        printk("WARNING: omnihook can't create debugfs:%s (%ld)\n",
+            OMNI_DEBUGFS_NAME, PTR_ERR(debugfs_dir));
+        debugfs_dir = NULL;
+        rc = -1;
+    }
+
+    #if OMNIHOOK_LOG_LEVEL >= 1
+    /* the rings work without debugfs, they're just not readable */
+    if(0 != events_rings_alloc()) {
+        events_rings_free();
+        return -1;
+    }
+
+    if(debugfs_dir) {
+        debugfs_create_file("events", 0400, debugfs_dir, NULL, &events_fops);
+    }
+    #endif
+
+    return rc;
+}
+
+void
+omni_events_exit(void)
+{
+    debugfs_remove_recursive(debugfs_dir);
+    debugfs_dir = NULL;
+
+    #if OMNIHOOK_LOG_LEVEL >= 1
+    /* nobody logs anymore: every hook is gone */
+    events_rings_free();
+    #endif
+}
+
+struct dentry *
+omni_debugfs_dir(void)
+{
+    return debugfs_dir;
+}
@@ -0,0 +1,118 @@
+#ifndef OMNI_LINUX_EVENTS_H
+#define OMNI_LINUX_EVENTS_H
+
+/* event log: what the add/remove paths did (installs, removals, failures,
+    bytes written over sites), kept in a ring per CPU instead of printk'd, so
+    hooking thousands of sites neither floods the console nor waits on it
+
+    writers never lock, a full ring overwrites its oldest events; readable
+    (merged, oldest first) as debugfs:omnihook-<module>/events
+
+    OMNIHOOK_LOG_LEVEL picks what is logged at compile time:
+    0 - nothing, logging compiles out entirely
+    1 - failures
+    2 - failures, installs, removals, enables and disables (default)
+    3 - all of the above and the bytes written over every site */
+#ifndef OMNIHOOK_LOG_LEVEL
+#define OMNIHOOK_LOG_LEVEL 2
+#endif
+
+/* debugfs:omnihook-<module>: every module built with omnihook has its own
+    registry and event log, and so its own directory */
+#ifdef KBUILD_MODNAME
+#define OMNI_DEBUGFS_NAME "omnihook-" KBUILD_MODNAME
+#else
+#define OMNI_DEBUGFS_NAME "omnihook"
+#endif
+
+#define OMNI_EVENTS_PER_CPU 512 /* power of two */
+#define OMNI_EVENT_BYTES 32 /* bytes of a patch kept, enough for any site */
+
+enum omni_event_type {
+    OMNI_EV_INSTALL = 1, // src, dst, aux: the trampoline handed out
+    OMNI_EV_REMOVE, // src, dst (NULL: the whole site)
+    OMNI_EV_FAIL, // src, dst, reason
+    OMNI_EV_PATCH, // src, bytes written over it
+    OMNI_EV_RESTORE, // src, original bytes written back
+    OMNI_EV_ENABLE, // src, JMP written back by omnihook_enable()
+    OMNI_EV_DISABLE, // src, restored by omnihook_disable()
+};
+
+enum omni_fail {
+    OMNI_FAIL_NOMEM = 1,
+    OMNI_FAIL_RELOCATE, // stolen instructions can't run elsewhere
+    OMNI_FAIL_OVERLAP, // range overlaps another hook
+    OMNI_FAIL_DUPLICATE, // src already detours to dst
+    OMNI_FAIL_CHANGED, // site changed since its bytes were stolen
+    OMNI_FAIL_NOT_HOOKED, // nothing (or not dst) hooked at src
+    OMNI_FAIL_BUSY, // being added or removed concurrently
+    OMNI_FAIL_AMBIGUOUS, // several detours on src, name the one meant
+    OMNI_FAIL_REACH, // site's jump can't reach what it lands in (arm64)
+};
+
+struct omni_event {
+    unsigned long seq; // index in the ring + 1 once complete, 0 meanwhile
+    u64 time; // local_clock(), ns
+    u16 type;
+    u16 len; // of bytes
+    u32 reason;
+    void *src;
+    void *dst;
+    void *aux;
+    u8 bytes[OMNI_EVENT_BYTES];
+};
+
+/* creates/removes debugfs:omnihook-<module> (whatever the log level, other
+    files live there too) and, unless logging is compiled out, the rings and
+    debugfs:omnihook-<module>/events; fails (loudly) if the directory is
+    taken */
+int
+omni_events_init(void);
+
+void
+omni_events_exit(void);
+
+/* debugfs:omnihook-<module>, NULL without debugfs */
+struct dentry *
+omni_debugfs_dir(void);
+
+/* any context, never sleeps; does nothing before omni_events_init() */
+void
+omni_event_log(int type, void *src, void *dst, void *aux, unsigned int reason,
+    const void *bytes, unsigned int len);
+
+/* arguments aren't evaluated for levels compiled out */
+#if OMNIHOOK_LOG_LEVEL >= 1
+#define omni_log_fail(src, dst, reason) \
+    omni_event_log(OMNI_EV_FAIL, (src), (dst), NULL, (reason), NULL, 0)
+#else
+#define omni_log_fail(src, dst, reason) do { } while(0)
+#endif
+
+#if OMNIHOOK_LOG_LEVEL >= 2
+#define omni_log_install(src, dst, trampoline) \
+    omni_event_log(OMNI_EV_INSTALL, (src), (dst), (trampoline), 0, NULL, 0)
+#define omni_log_remove(src, dst) \
+    omni_event_log(OMNI_EV_REMOVE, (src), (dst), NULL, 0, NULL, 0)
+#define omni_log_enable(src) \
+    omni_event_log(OMNI_EV_ENABLE, (src), NULL, NULL, 0, NULL, 0)
+#define omni_log_disable(src) \
+    omni_event_log(OMNI_EV_DISABLE, (src), NULL, NULL, 0, NULL, 0)
+#else
+#define omni_log_install(src, dst, trampoline) do { } while(0)
+#define omni_log_remove(src, dst) do { } while(0)
+#define omni_log_enable(src) do { } while(0)
+#define omni_log_disable(src) do { } while(0)
+#endif
+
+#if OMNIHOOK_LOG_LEVEL >= 3
+#define omni_log_patch(src, bytes, len) \
+    omni_event_log(OMNI_EV_PATCH, (src), NULL, NULL, 0, (bytes), (len))
+#define omni_log_restore(src, bytes, len) \
+    omni_event_log(OMNI_EV_RESTORE, (src), NULL, NULL, 0, (bytes), (len))
+#else
+#define omni_log_patch(src, bytes, len) do { } while(0)
+#define omni_log_restore(src, bytes, len) do { } while(0)
+#endif
+
+#endif
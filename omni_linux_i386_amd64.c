@@ -1,17 +1,47 @@
 #include <linux/types.h>
+#include <linux/kernel.h> /* swap() */
+#include <linux/string.h> /* kstrdup() */
 #include <linux/vmalloc.h>
 #include <linux/list.h> /* list_head, etc. */
+#include <linux/rcupdate.h> /* synchronize_rcu() */
+#include <linux/bitops.h> /* test_and_set_bit() */
 #include <linux/slab.h> /* kmalloc(), kfree(), etc. */
 #include <linux/delay.h> /* for msleep() */
 #include <linux/kallsyms.h>
+#include <linux/stop_machine.h> /* stop_machine() */
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/bug.h> /* BUG_ON() */
+#include <linux/hash.h> /* hash_long() */
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/kdebug.h> /* register_die_notifier(), DIE_INT3 */
+#include <linux/smp.h> /* on_each_cpu() */
+#include <linux/irqflags.h> /* local_irq_save() */
+#include <linux/sort.h>
+#include <linux/bsearch.h>
+#include <linux/sched.h> /* current */
+#include <linux/cpumask.h>
 
 #include <asm/pgtable.h> /* PAGE_KERNEL_EXEC */
+#include <asm/processor.h> /* sync_core(), cpu_relax() */
+#include <asm/msr.h> /* rdtsc() */
+#include <asm/ptrace.h> /* user_mode() */
 
 #include "omnihook.h"
 
-/* master list of all hooks created */
-struct list_head hook_list;
-LIST_HEAD(hook_list);
+/* every hook lives in the registry (omni_linux_registry.c), keyed by src */
+
+/* serializes everything that changes hooks or their detour chains */
+static DEFINE_MUTEX(hooks_lock);
+
+#if defined(__i386__)
+#define X86_IS64 0
+#elif defined(__amd64__)
+#define X86_IS64 1
+#else
+#error cannot determine whether i386 or amd64
+#endif
 
 //-----------------------------------------------------------------------------
 // WRITE PROTECT ENABLE/DISABLE
@@ -54,186 +84,2061 @@ enable_write_protect(void)
 }
 
 //-----------------------------------------------------------------------------
-// HOOKLIB MAIN API
+// LINKS (see omni_linux_chain.h)
 //-----------------------------------------------------------------------------
-int
-omnihook_add(void *src, void *dst, /* out */ void **trampoline)
+
+/* x86 LINK:
+    00: f3 0f 1e fa           ; endbr64, reached by jmp *%r11 (amd64)
+    04: ff 25 06 00 00 00     ; jmp *0x6(%rip)
+    0a: cc cc cc cc cc cc
+    10: <target>              ; aligned, retargeted with a single store
+
+    00: ff 25 <link + 8>      ; jmp *<link + 8>  (i386)
+    06: cc cc
+    08: <target>
+*/
+#if defined(__amd64__)
+#define LINK_TARGET 16
+
+/* under IBT every indirect call or jmp must land on one, a nop otherwise */
+#define X86_ENDBR 4
+static const uint8_t endbr64[X86_ENDBR] = { 0xf3, 0x0f, 0x1e, 0xfa };
+#else
+#define LINK_TARGET 8
+#endif
+
+void
+omni_link_emit(void *link, void *target)
 {
-    int rc = -1;
-    hook *h = NULL;
-    uint8_t *tramp = NULL;
+    uint8_t *p = link;
 
-    uint8_t jmpcode[5] = {
-        0xe9, /* jmp XXX */
-        0xde, 0xad, 0xbe, 0xef /* (dummy address) */
-    };
+    #if defined(__amd64__)
+    memcpy(p, endbr64, X86_ENDBR);
+    p += X86_ENDBR;
+    #endif
 
-    /* list entry */
-    h = kzalloc(sizeof(hook), GFP_KERNEL);
-    if(!h) {
-        goto cleanup;
+    p[0] = 0xff;
+    p[1] = 0x25;
+    #if defined(__amd64__)
+    *(uint32_t *)(p + 2) = LINK_TARGET - 10;
+    #else
+    *(uint32_t *)(p + 2) = (uintptr_t)(p + LINK_TARGET);
+    #endif
+    memset(p + 6, 0xcc, (uint8_t *)link + LINK_TARGET - (p + 6));
+    *(void **)((uint8_t *)link + LINK_TARGET) = target;
+}
+
+void
+omni_link_set(void *link, void *target)
+{
+    WRITE_ONCE(*(void **)((uint8_t *)link + LINK_TARGET), target);
+}
+
+void *
+omni_link_target(void *link)
+{
+    return READ_ONCE(*(void **)((uint8_t *)link + LINK_TARGET));
+}
+
+#if defined(__amd64__)
+//-----------------------------------------------------------------------------
+// TRACKED ENTRY (amd64)
+//-----------------------------------------------------------------------------
+
+/* the site jumps to a per hook stub, which loads the hook and enters here:
+
+    stub:
+        49 bb <8-byte hook>   ; movabs $hook, %r11
+        e9 <rel32>            ; jmp omni_entry_common (or jmp *0(%rip))
+
+   omni_entry_common saves the argument registers and calls
+   omni_hook_enter(), which counts the call in flight (and the hit, with
+   OMNIHOOK_STATS) and swaps the return address for omni_exit_common, then
+   resumes at the first detour (through the dispatch link) with the stack
+   exactly as the caller left it (stack passed arguments included); the
+   detour's ret lands in omni_exit_common, which ends the call (recording
+   the cycles spent) and continues at the real return address
+
+   counting calls in flight is what tells a removal when nobody is inside a
+   detour (or sleeping below one) anymore, see hook_busy() */
+#define STUB_SIZE (10 + X86_JMP_ABS)
+
+/* the entries jmp *%r11 to a link or trampoline, both start with endbr64;
+    the exits continue at a return address, which doesn't: under IBT they
+    push it and ret instead (ret isn't tracked, costs a return stack buffer
+    miss) */
+#if IS_ENABLED(CONFIG_X86_KERNEL_IBT)
+#define OMNI_EXIT_JMP "    push %r11\n    ret\n"
+#else
+#define OMNI_EXIT_JMP "    jmp *%r11\n"
+#endif
+
+void *
+omni_hook_enter(hook *h, void **ret_slot);
+
+void *
+omni_hook_exit(void **ret_slot);
+
+extern char omni_entry_common[];
+extern char omni_exit_common[];
+extern char omni_ret_exit_common[];
+
+asm(
+    ".pushsection .text\n"
+    "omni_entry_common:\n"
+    "    push %rdi\n"
+    "    push %rsi\n"
+    "    push %rdx\n"
+    "    push %rcx\n"
+    "    push %r8\n"
+    "    push %r9\n"
+    "    push %rax\n" /* vector register count of varargs calls */
+    "    mov %r11, %rdi\n"
+    "    lea 56(%rsp), %rsi\n"
+    "    call omni_hook_enter\n"
+    "    mov %rax, %r11\n"
+    "    pop %rax\n"
+    "    pop %r9\n"
+    "    pop %r8\n"
+    "    pop %rcx\n"
+    "    pop %rdx\n"
+    "    pop %rsi\n"
+    "    pop %rdi\n"
+    "    jmp *%r11\n"
+    "omni_exit_common:\n"
+    "    push %rax\n" /* return value */
+    "    push %rdx\n"
+    "    lea 8(%rsp), %rdi\n" /* where the return address was */
+    "    call omni_hook_exit\n"
+    "    mov %rax, %r11\n"
+    "    pop %rdx\n"
+    "    pop %rax\n"
+    OMNI_EXIT_JMP
+    ".popsection\n"
+);
+
+/* a call in flight, keyed by the stack slot of its return address (unique
+    while the call lasts, whichever task or CPU it ends on) */
+struct omni_frame {
+    unsigned long slot; // 0: free
+    void *ret; // the real return address (NULL: ends with another frame)
+    hook *h;
+    unsigned int epoch; // which of h's in flight counters it's in
+    int guard_cpu; // whose recursion guard it holds, -1: none
+    u64 tsc; // at entry (OMNIHOOK_STATS)
+};
+
+/* open addressing, a slot's frames are somewhere in the FRAME_PROBE entries
+    starting at its hash; when they're all taken the call can't be tracked
+    and bypasses the detours */
+#define FRAME_BITS 12
+#define FRAME_PROBE 16
+
+static struct omni_frame frames[(1 << FRAME_BITS) + FRAME_PROBE];
+
+static inline unsigned int
+frame_hash(unsigned long slot)
+{
+    return hash_long(slot >> 3, FRAME_BITS);
+}
+
+/* nonzero if the call may reach the detours; args are the ones
+    omni_entry_common saved, the first right below the return address */
+static int notrace
+filter_pass(struct omni_filter *flt, hook *h, void **ret_slot)
+{
+    struct omnihook_filter *f = &flt->f;
+
+    if(f->pid && current->pid != f->pid) {
+        return 0;
     }
-    
-    /* 1) save info about destination, source */
-    h->dst = dst;
-    h->src = src;
-    memcpy(h->stolen, src, sizeof(h->stolen));
 
-    /* 2) allocate, build the trampoline: */
+    if(f->tgid && current->tgid != f->tgid) {
+        return 0;
+    }
 
-    #if defined(__i386__)
-    /* x86 TRAMPOLINE:
-        00: <stolen 5 bytes>
-        05: 68                ; push <imm>
-        06: <4-byte absolute address>
-        10: c3                ; ret
-        11:
-    */
-    tramp = (uint8_t *) __vmalloc(11, GFP_KERNEL, PAGE_KERNEL_EXEC);
-    if(!tramp) goto cleanup;
-
-    memcpy(tramp, h->stolen, sizeof(h->stolen)); /* stolen instructions */
-    *(unsigned char *)(tramp + 5) = 0x68; /* the push */
-    *(uintptr_t *)(tramp + 6) = src + 5; /* absolute address */
-    *(unsigned char *)(tramp + 10) = 0xc3; /* ret */
-	#elif defined(__amd64__)
-    /* x64 TRAMPOLINE:
-        00: <stolen 5 bytes>
-        05: FF 35 01 00 00 00 ; pushq 0x1(%rip)
-        11: c3                ; retq
-        12: <8-byte absolute address>
-        20:
-    */
-    tramp = (uint8_t *) __vmalloc(20, GFP_KERNEL, PAGE_KERNEL_EXEC);
-    if(!tramp) goto cleanup;
+    if(f->cpus && !cpumask_test_cpu(smp_processor_id(), &flt->cpus)) {
+        return 0;
+    }
 
-    memcpy(tramp, h->stolen, sizeof(h->stolen)); /* stolen instructions */
-    memcpy(tramp + 5, "\xff\x35\x01\x00\x00\x00\xc3", 7); /* the pushq, retq */
-    *(uintptr_t *)(tramp + 12) = src + 5; /* the absolute address */
-    #else
-    #error cannot determine whether i386 or amd64
+    if(f->match_arg0 && (unsigned long)ret_slot[-1] != f->arg0) {
+        return 0;
+    }
+
+    if(f->no_recursion &&
+        atomic_read(this_cpu_ptr(&h->inflight->guard)) != 0) {
+        return 0;
+    }
+
+    if(f->sample > 1) {
+        if(this_cpu_dec_return(*flt->countdown) > 0) {
+            return 0;
+        }
+        this_cpu_write(*flt->countdown, f->sample);
+    }
+
+    return 1;
+}
+
+void * notrace
+omni_hook_enter(hook *h, void **ret_slot)
+{
+    int i, guard = 0;
+    unsigned int e;
+    unsigned long slot = (unsigned long)ret_slot;
+    struct omni_frame *f = &frames[frame_hash(slot)];
+    struct omni_filter *flt;
+
+    #if defined(OMNIHOOK_STATS)
+    omni_stats_hit(&h->stats);
     #endif
 
-    /* inform the hook struct */
-    h->trampoline = tramp;
-    /* inform the caller */
-    *trampoline = (void *)tramp;
+    /* freed by omnihook_set_filter() only after synchronize_rcu() */
+    if(rcu_access_pointer(h->filter)) {
+        preempt_disable_notrace();
+        flt = rcu_dereference_sched(h->filter);
+        if(flt && !filter_pass(flt, h, ret_slot)) {
+            preempt_enable_notrace();
+            return h->orig;
+        }
+        guard = flt && flt->f.no_recursion;
+        preempt_enable_notrace();
+    }
 
-    /* 3) write the JMP over the source (actually hooking) */
-    *(uint32_t *)(jmpcode + 1) = dst - (src+5);
-    disable_write_protect();
-    memcpy(src, jmpcode, 5); 
-    enable_write_protect();
+    for(i = 0; i < FRAME_PROBE; ++i, ++f) {
+        if(!READ_ONCE(f->slot) && !cmpxchg(&f->slot, 0, slot)) {
+            break;
+        }
+    }
 
-    /* debugging */
-    printk("omnihook!\n");
-    printk("src: 0x%p\n", h->src);
-    printk("dst: 0x%p\n", h->dst);
-    printk("trampoline: 0x%p\n", h->trampoline);
-  
-    /* add the omnihook bookkeeping structure */
-    list_add(/* address of list member within new element */ &(h->list),
-        /* the list_head to add it to */ &hook_list);
+    /* a removal couldn't see this call, so it mustn't reach a detour: the
+        original runs as if unhooked */
+    if(i == FRAME_PROBE) {
+        #if defined(OMNIHOOK_STATS)
+        omni_stats_missed(&h->stats);
+        #endif
+        return h->orig;
+    }
 
-    rc = 0;
+    /* a removal flips the epoch and then waits out preemption disabled
+        sections, after which every call in the old epoch is counted */
+    preempt_disable_notrace();
+    e = READ_ONCE(h->epoch) & 1;
+    this_cpu_inc(h->inflight->calls[e]);
+    f->guard_cpu = -1;
+    if(guard) {
+        f->guard_cpu = smp_processor_id();
+        atomic_inc(this_cpu_ptr(&h->inflight->guard));
+    }
+    preempt_enable_notrace();
 
-    cleanup:
-    if(0 != rc) {
-        if(h) {
-            if(h->trampoline) {
-                vfree(h->trampoline);
-                h->trampoline = NULL;
-            }
+    f->h = h;
+    f->epoch = e;
+    #if defined(OMNIHOOK_STATS)
+    f->tsc = rdtsc();
+    #endif
 
-            kfree(h);
-            h = NULL;
+    /* the detour (or the original) jumped into another hooked function
+        instead of calling it, one return ends both calls (after any return
+        hook of the first has seen it) */
+    if(*ret_slot == omni_exit_common || *ret_slot == omni_ret_exit_common) {
+        f->ret = NULL;
+    }
+    else {
+        f->ret = *ret_slot;
+        *ret_slot = omni_exit_common;
+    }
+
+    return h->chain.dispatch;
+}
+
+void * notrace
+omni_hook_exit(void **ret_slot)
+{
+    int i;
+    void *ret = NULL;
+    hook *h;
+    unsigned long slot = (unsigned long)ret_slot;
+    struct omni_frame *f = &frames[frame_hash(slot)];
+    #if defined(OMNIHOOK_STATS)
+    u64 now = rdtsc();
+    #endif
+
+    for(i = 0; i < FRAME_PROBE; ++i, ++f) {
+        if(READ_ONCE(f->slot) != slot) {
+            continue;
+        }
+
+        h = f->h;
+        if(f->ret) {
+            ret = f->ret;
+        }
+
+        #if defined(OMNIHOOK_STATS)
+        omni_stats_latency(&h->stats, now - f->tsc);
+        #endif
+
+        /* the call may have moved to another CPU since */
+        if(f->guard_cpu >= 0) {
+            atomic_dec(&per_cpu_ptr(h->inflight, f->guard_cpu)->guard);
         }
+
+        /* last touch of h, a removal may free it right after */
+        this_cpu_dec(h->inflight->calls[f->epoch]);
+
+        smp_store_release(&f->slot, 0);
     }
 
-    return rc;
+    /* we only get here through a return address omni_hook_enter() swapped,
+        so the frame exists */
+    BUG_ON(!ret);
+
+    return ret;
 }
 
-/* when address is given (non-NULL), it remove single hook from this address
-    when address is not given (ie value NULL), it removes all hooks in the list */
-int 
-omnihook_remove_general(void *src)
+/* calls in flight in the given epochs (bit mask), exact once no new calls
+    can be counted in them: each CPU's count only goes down from then on,
+    so a sum of zero can't be a torn read */
+static long
+hook_inflight(hook *h, unsigned int epochs)
+{
+    int cpu;
+    long sum = 0;
+
+    for_each_possible_cpu(cpu) {
+        struct omni_inflight *c = per_cpu_ptr(h->inflight, cpu);
+
+        if(epochs & 1) sum += READ_ONCE(c->calls[0]);
+        if(epochs & 2) sum += READ_ONCE(c->calls[1]);
+    }
+
+    return sum;
+}
+
+#if defined(OMNIHOOK_STATS)
+static void
+hook_show(struct seq_file *m, void *priv)
+{
+    hook *h = priv;
+    struct omni_detour *d;
+
+    seq_printf(m, "src: %pS\n", h->src);
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(d, &h->chain.detours, list) {
+        seq_printf(m, "dst: %pS (priority %d)\n", d->dst, d->priority);
+    }
+    rcu_read_unlock();
+
+    seq_printf(m, "in flight: %ld\n", hook_inflight(h, 3));
+    omni_stats_show(m, &h->stats);
+}
+
+int
+omnihook_get_stats(void *src, /* out */ struct omnihook_stats *stats)
 {
     int rc = -1;
+    hook *h;
 
-    int remove, do_break;
-    hook *cursor, *temp;
+    rcu_read_lock();
+    h = omnihook_find(src);
+    if(h) {
+        omni_stats_sum(&h->stats, stats);
+        stats->inflight = hook_inflight(h, 3);
+        rc = 0;
+    }
+    rcu_read_unlock();
+
+    return rc;
+}
+#endif
 
-    /* scan thru list of hook_list, finding info to properly deallocate */
-    list_for_each_entry_safe(/* cursor (it uses this type) */ cursor, 
-        /* temporary storage (for the safety feature) */ temp, /* list head */ &hook_list, 
-        /* member within, hehe TWSS */ list) {
+/* builds the stub and the counters, the site will jump to the stub */
+static int
+hook_build_entry(hook *h)
+{
+    uint8_t *stub;
 
-        remove = 0;
-        do_break = 0;
+    h->inflight = alloc_percpu(struct omni_inflight);
+    if(!h->inflight) {
+        return -1;
+    }
 
-        if(src) {
-            printk("src specified, looking for one hook...\n");
-            /* if source specified, only remove this one */
-            if(cursor->src == src) {
-                printk("FOUND!\n");
-                remove = 1;
-                do_break = 1;
-            }
+    #if defined(OMNIHOOK_STATS)
+    if(0 != omni_stats_create(&h->stats, h->src, hook_show, h)) {
+        return -1;
+    }
+    #endif
+
+    stub = (uint8_t *) omni_arena_alloc(STUB_SIZE, h->src);
+    if(!stub) {
+        return -1;
+    }
+    h->stub = stub;
+
+    stub[0] = 0x49; /* movabs $h, %r11 */
+    stub[1] = 0xbb;
+    memcpy(stub + 2, &h, 8);
+    omni_x86_jmp(stub + 10, (uintptr_t)stub + 10,
+        (uintptr_t)omni_entry_common, 1);
+
+    h->entry = stub;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// RETURN HOOKS (amd64)
+//-----------------------------------------------------------------------------
+
+/* a return hook is a detour whose dst is a stub of its own:
+
+    stub:
+        f3 0f 1e fa           ; endbr64, reached by a link's jmp *
+        49 bb <8-byte ret>    ; movabs $r, %r11
+        e9 <rel32>            ; jmp omni_ret_entry_common (or jmp *0(%rip))
+
+   omni_ret_entry_common saves the argument registers (in argument order,
+   for the entry handler) and calls omni_ret_enter(), which records the
+   return address and swaps it for omni_ret_exit_common, then continues down
+   the chain; when the function returns omni_ret_exit_common hands its
+   return value to the exit handler and continues at the recorded address
+
+   the detour is only reached through the tracked entry, so the call is
+   counted in flight until the exit handler is done with r */
+#define RET_STUB_SIZE (X86_ENDBR + STUB_SIZE)
+
+void *
+omni_ret_enter(struct omnihook_ret *r, unsigned long *args);
+
+void *
+omni_ret_exit(void **ret_slot);
+
+extern char omni_ret_entry_common[];
+
+asm(
+    ".pushsection .text\n"
+    "omni_ret_entry_common:\n"
+    "    push %rax\n" /* vector register count of varargs calls */
+    "    push %r9\n"
+    "    push %r8\n"
+    "    push %rcx\n"
+    "    push %rdx\n"
+    "    push %rsi\n"
+    "    push %rdi\n"
+    "    mov %r11, %rdi\n"
+    "    mov %rsp, %rsi\n"
+    "    call omni_ret_enter\n"
+    "    mov %rax, %r11\n"
+    "    pop %rdi\n"
+    "    pop %rsi\n"
+    "    pop %rdx\n"
+    "    pop %rcx\n"
+    "    pop %r8\n"
+    "    pop %r9\n"
+    "    pop %rax\n"
+    "    jmp *%r11\n"
+    "omni_ret_exit_common:\n"
+    "    push %rax\n" /* return value */
+    "    push %rdx\n"
+    "    lea 8(%rsp), %rdi\n" /* where the return address was */
+    "    call omni_ret_exit\n"
+    "    mov %rax, %r11\n"
+    "    pop %rdx\n"
+    "    pop %rax\n"
+    OMNI_EXIT_JMP
+    ".popsection\n"
+);
+
+/* a return pending, keyed like struct omni_frame; the tracked entry's own
+    frame for the same slot is in frames[] */
+struct omni_ret_frame {
+    unsigned long slot; // 0: free
+    void *ret; // what to return to (NULL: another return hook has it)
+    struct omnihook_ret *r;
+    unsigned long cookie;
+    u64 tsc; // at entry
+};
+
+static struct omni_ret_frame ret_frames[(1 << FRAME_BITS) + FRAME_PROBE];
+
+void * notrace
+omni_ret_enter(struct omnihook_ret *r, unsigned long *args)
+{
+    int i;
+    void **ret_slot = (void **)(args + 7);
+    unsigned long slot = (unsigned long)ret_slot, cookie = 0;
+    struct omni_ret_frame *f = &ret_frames[frame_hash(slot)];
+
+    if(r->entry && 0 != r->entry(r, args, &cookie)) {
+        return r->next;
+    }
+
+    for(i = 0; i < FRAME_PROBE; ++i, ++f) {
+        if(!READ_ONCE(f->slot) && !cmpxchg(&f->slot, 0, slot)) {
+            break;
         }
-        /* otherwise, remove them all */
-        else {
-            remove = 1;
+    }
+
+    if(i == FRAME_PROBE) {
+        atomic_long_inc(&r->missed);
+        return r->next;
+    }
+
+    f->r = r;
+    f->cookie = cookie;
+
+    /* another return hook on the way (same src, or a src that jumped here)
+        already took the return, its exit comes back through us */
+    if(*ret_slot == omni_ret_exit_common) {
+        f->ret = NULL;
+    }
+    else {
+        f->ret = *ret_slot;
+        *ret_slot = omni_ret_exit_common;
+    }
+
+    f->tsc = rdtsc();
+
+    return r->next;
+}
+
+void * notrace
+omni_ret_exit(void **ret_slot)
+{
+    int i;
+    void *ret = NULL;
+    unsigned long slot = (unsigned long)ret_slot;
+    unsigned long retval = *(unsigned long *)ret_slot; /* saved rax */
+    struct omni_ret_frame *f = &ret_frames[frame_hash(slot)];
+    u64 now = rdtsc();
+
+    for(i = 0; i < FRAME_PROBE; ++i, ++f) {
+        if(READ_ONCE(f->slot) != slot) {
+            continue;
         }
 
-        if(remove) {
-            printk("removing hook at address 0x%p\n", cursor->src);
+        if(f->ret) {
+            ret = f->ret;
+        }
 
-            /* restore original bytes (unhook) */
-            //printk("restoring STOLEN bytes:");
-            disable_write_protect();
-            memcpy(cursor->src, cursor->stolen, sizeof(cursor->stolen));
-            enable_write_protect();
+        f->r->exit(f->r, retval, now - f->tsc, f->cookie);
 
-            /* free the trampoline */
-            //printk("free'ing the trampoline...\n");
-            if(cursor->trampoline) {
-                vfree(cursor->trampoline);
-                cursor->trampoline = NULL;
-            }
+        smp_store_release(&f->slot, 0);
+    }
+
+    BUG_ON(!ret);
 
-            /* delete from list */
-            //printk("deleting from list...\n");
-            list_del(&(cursor->list));
+    return ret;
+}
+
+/* the frames of a call in flight are its own until it returns, so they're
+    read without further care */
+void * notrace
+omnihook_caller(void **ret_slot)
+{
+    int i, hops;
+    void *ret = *ret_slot;
+    unsigned long slot = (unsigned long)ret_slot;
 
-            /* delete from mem */
-            //printk("deleting entry itself...\n");
-            kfree(cursor);
-            cursor = NULL;
+    /* the tracked entry took the return first, a return hook may have
+        taken it from the tracked entry since */
+    for(hops = 0; hops < 2; ++hops) {
+        if(ret == omni_ret_exit_common) {
+            struct omni_ret_frame *f = &ret_frames[frame_hash(slot)];
 
-            /* success? */
-            rc = 0;
+            for(i = 0; i < FRAME_PROBE; ++i, ++f) {
+                if(READ_ONCE(f->slot) == slot && f->ret) {
+                    ret = f->ret;
+                    break;
+                }
+            }
         }
+        else if(ret == omni_exit_common) {
+            struct omni_frame *f = &frames[frame_hash(slot)];
 
-        if(do_break) {
-            /* done */
-            break;
+            for(i = 0; i < FRAME_PROBE; ++i, ++f) {
+                if(READ_ONCE(f->slot) == slot && f->ret) {
+                    ret = f->ret;
+                    break;
+                }
+            }
         }
     }
 
-    printk("done...\n");
+    return ret;
+}
 
-    return rc;
+static void *
+ret_build_stub(struct omnihook_ret *r, void *src)
+{
+    uint8_t *stub;
+
+    stub = (uint8_t *) omni_arena_alloc(RET_STUB_SIZE, src);
+    if(!stub) {
+        return NULL;
+    }
+
+    memcpy(stub, endbr64, X86_ENDBR);
+    stub[X86_ENDBR] = 0x49; /* movabs $r, %r11 */
+    stub[X86_ENDBR + 1] = 0xbb;
+    memcpy(stub + X86_ENDBR + 2, &r, 8);
+    omni_x86_jmp(stub + X86_ENDBR + 10, (uintptr_t)stub + X86_ENDBR + 10,
+        (uintptr_t)omni_ret_entry_common, 1);
+
+    return stub;
 }
 
-int 
-omnihook_remove(void *src)
+static void
+filter_free(struct omni_filter *flt)
 {
-    return omnihook_remove_general(src);
+    if(flt) {
+        free_percpu(flt->countdown);
+        kfree(flt);
+    }
 }
 
-int
-omnihook_remove_all(void)
+static struct omni_filter *
+filter_new(const struct omnihook_filter *f)
 {
-    return omnihook_remove_general(NULL);
+    int cpu;
+    struct omni_filter *flt;
+
+    flt = kzalloc(sizeof(*flt), GFP_KERNEL);
+    if(!flt) {
+        return NULL;
+    }
+
+    flt->countdown = alloc_percpu(int);
+    if(!flt->countdown) {
+        kfree(flt);
+        return NULL;
+    }
+
+    flt->f = *f;
+    if(f->cpus) {
+        cpumask_copy(&flt->cpus, f->cpus);
+    }
+
+    /* the first eligible call on each CPU is sampled */
+    for_each_possible_cpu(cpu) {
+        *per_cpu_ptr(flt->countdown, cpu) = 1;
+    }
+
+    return flt;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// RECLAMATION
+//-----------------------------------------------------------------------------
+
+/* a removed hook: its site is restored, so after the grace period only
+    calls already inside can still be in flight */
+static int
+hook_busy(struct omni_reclaim *r)
+{
+    #if defined(__amd64__)
+    return hook_inflight(container_of(r, hook, reclaim), 3) != 0;
+    #else
+    return 0;
+    #endif
+}
+
+static void
+hook_destroy(hook *h);
+
+static void
+hook_reclaim_free(struct omni_reclaim *r)
+{
+    hook_destroy(container_of(r, hook, reclaim));
+}
+
+#if defined(__amd64__)
+/* a removed detour: its site stays live, so new calls keep coming; they're
+    moved to the other epoch (once per batch, however many of the site's
+    detours are in it) and only the old epoch has to drain */
+static void
+detour_retire(struct omni_reclaim *r, unsigned long gen)
+{
+    struct omni_detour *d = container_of(r, struct omni_detour, reclaim);
+    hook *h = d->site;
+
+    if(h->retire_gen != gen) {
+        h->retire_gen = gen;
+        WRITE_ONCE(h->epoch, h->epoch ^ 1);
+    }
+
+    d->epoch = h->epoch ^ 1;
+}
+
+static int
+detour_busy(struct omni_reclaim *r)
+{
+    struct omni_detour *d = container_of(r, struct omni_detour, reclaim);
+
+    return hook_inflight(d->site, 1 << d->epoch) != 0;
+}
+#endif
+
+static void
+detour_reclaim_free(struct omni_reclaim *r)
+{
+    omni_detour_free(container_of(r, struct omni_detour, reclaim));
+}
+
+//-----------------------------------------------------------------------------
+// HOOK CONSTRUCTION
+//-----------------------------------------------------------------------------
+
+static void
+hook_destroy(hook *h)
+{
+    /* return the trampoline slot to the arena */
+    if(h->trampoline) {
+        omni_arena_free(h->trampoline);
+        h->trampoline = NULL;
+    }
+
+    #if defined(__amd64__)
+    omni_arena_free(h->stub);
+    free_percpu(h->inflight);
+    filter_free(rcu_dereference_protected(h->filter, 1));
+    #endif
+
+    #if defined(OMNIHOOK_STATS)
+    omni_stats_destroy(&h->stats);
+    #endif
+
+    omni_chain_destroy(&h->chain);
+
+    kfree(h->group);
+    kfree(h);
+}
+
+/* jump back to the site, worst case (a trampoline that ended up out of
+    rel32 reach despite the arena's efforts) */
+#define TRAMP_RET_SIZE (X86_IS64 ? X86_JMP_ABS : X86_JMP_REL)
+
+#if defined(__amd64__)
+/* the 5 byte NOP -mfentry kernels start every function with (for ftrace),
+    behind endbr64 on IBT kernels */
+static const uint8_t fentry_nop[X86_JMP_REL] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+#endif
+
+/* nonzero if the site is an fentry NOP the JMP fits exactly: nothing needs
+    stealing, the original resumes right behind it */
+static int
+hook_is_fentry(hook *h)
+{
+    #if defined(__amd64__)
+    return h->jmp_len == X86_JMP_REL &&
+        0 == memcmp(h->stolen, fentry_nop, X86_JMP_REL);
+    #else
+    return 0;
+    #endif
 }
 
+static int
+hook_build_trampoline(hook *h)
+{
+    int n;
+    unsigned int size, pad;
+    uint8_t *tramp = NULL;
+
+    /* links and the tracked entry reach the trampoline with an indirect
+        jmp, under IBT it needs an endbr64 of its own (amd64) whether src's
+        stayed in place or objtool sealed src without one */
+    pad = 0;
+    #if defined(__amd64__)
+    pad = X86_ENDBR;
+    #endif
+
+    /* allocate, build the trampoline:
+        [00: endbr64]           ; amd64
+        XX: <whole instructions covering the JMP, relocated>
+        YY: <jump back to site + stolen_len>
+
+       relocation can grow the stolen code (rel8 branches become rel32, ...)
+       so start at the smallest slot and retry larger ones; slots near src
+       keep both the relocations and the jump back rel32 */
+    for(size = ARENA_SLOT_SIZE; ; size <<= 1) {
+        tramp = (uint8_t *) omni_arena_alloc(size, h->src);
+        if(!tramp) {
+            return -1;
+        }
+
+        #if defined(__amd64__)
+        memcpy(tramp, endbr64, X86_ENDBR);
+        #endif
+
+        /* an fentry NOP needn't run, the trampoline is a landing pad */
+        if(hook_is_fentry(h)) {
+            h->stolen_len = X86_JMP_REL;
+            n = 0;
+            break;
+        }
+
+        n = omni_x86_steal(h->stolen, (uintptr_t)h->site, h->jmp_len,
+            tramp + pad, (uintptr_t)tramp + pad, size - pad - TRAMP_RET_SIZE,
+            &h->stolen_len, X86_IS64);
+
+        if(n != X86_STEAL_NOSPACE || size == ARENA_SLOT_MAX) {
+            break;
+        }
+
+        omni_arena_free(tramp);
+    }
+
+    /* inform the hook struct */
+    h->trampoline = tramp;
+
+    if(n < 0) {
+        omni_log_fail(h->src, NULL, OMNI_FAIL_RELOCATE);
+        return -1;
+    }
+
+    /* TRAMPOLINE TAIL: a plain jump, unlike push/ret it leaves the return
+        stack buffer in sync with the real stack
+        00: e9 <rel32>            ; jmp site + stolen_len
+        or
+        00: ff 25 00 00 00 00     ; jmp *0(%rip)
+        06: <8-byte absolute address>
+    */
+    n += pad;
+    omni_x86_jmp(tramp + n, (uintptr_t)tramp + n,
+        (uintptr_t)h->site + h->stolen_len, X86_IS64);
+
+    h->orig = tramp;
+
+    return 0;
+}
+
+/* allocates the bookkeeping structure and builds the trampoline (if one is
+    needed), src is only read (the stolen bytes), never written; detours are
+    added by the caller */
+static hook *
+hook_build(void *src)
+{
+    int rc = -1;
+    hook *h = NULL;
+
+    /* bookkeeping entry */
+    h = kzalloc(sizeof(hook), GFP_KERNEL);
+    if(!h) {
+        goto cleanup;
+    }
+    
+    /* 1) save info about the source; the instructions are decoded from
+        this snapshot, which is also what gets compared against the site when
+        it is patched. under IBT an indirect call must land on src's
+        endbr64, so it stays and the site starts behind it */
+    h->src = src;
+    h->site = src;
+    #if defined(__amd64__)
+    if(0 == memcmp(src, endbr64, X86_ENDBR)) {
+        h->site = (uint8_t *)src + X86_ENDBR;
+    }
+    #endif
+    memcpy(h->stolen, h->site, sizeof(h->stolen));
+
+    /* the site jumps to the dispatch link directly, or through the
+        instrumented entry; the link leads to the trampoline once it's built */
+    if(0 != omni_chain_init(&h->chain, src, NULL)) {
+        goto cleanup;
+    }
+    h->entry = h->chain.dispatch;
+    #if defined(__amd64__)
+    if(0 != hook_build_entry(h)) {
+        goto cleanup;
+    }
+    #endif
+
+    /* beyond rel32 reach only if the arena had nothing near src */
+    h->jmp_len = omni_x86_jmp_len((uintptr_t)h->site, (uintptr_t)h->entry,
+        X86_IS64);
+
+    /* 2) the original behavior: straight past an fentry NOP (no trampoline
+        at all, calls to the original don't take an extra jump), or a
+        trampoline of stolen instructions; under IBT the NOP still needs
+        one, an indirect jmp can't land behind it */
+    if(hook_is_fentry(h) && !IS_ENABLED(CONFIG_X86_KERNEL_IBT)) {
+        h->stolen_len = X86_JMP_REL;
+        h->orig = (uint8_t *)src + X86_JMP_REL;
+    }
+    else if(0 != hook_build_trampoline(h)) {
+        goto cleanup;
+    }
+
+    omni_chain_set_tail(&h->chain, h->orig);
+
+    /* 3) claim the range, a concurrent add on an overlapping site fails here
+        instead of stealing our JMP */
+    set_bit(HOOK_BUSY, &h->state);
+    INIT_HLIST_NODE(&h->reg.node);
+    h->reg.src = src;
+    h->reg.len = ((uint8_t *)h->site - (uint8_t *)src) + h->stolen_len;
+    if(0 != omni_reg_insert(&h->reg)) {
+        omni_log_fail(src, NULL, OMNI_FAIL_OVERLAP);
+        goto cleanup;
+    }
+
+    rc = 0;
+
+    cleanup:
+    if(0 != rc) {
+        if(h) {
+            /* never visible to omnihook_find() callers without a grace period
+                passing first */
+            omni_reg_remove(&h->reg);
+            synchronize_rcu();
+            hook_destroy(h);
+            h = NULL;
+        }
+    }
+
+    return h;
+}
+
+/* takes hooks out of the registry and hands them to the reclaimer, which
+    frees the whole set after one grace period and once their calls in
+    flight have returned */
+static void
+hooks_release(hook **hooks, int count)
+{
+    int i;
+
+    for(i = 0; i < count; ++i) {
+        if(hooks[i]) {
+            omni_reg_remove(&(hooks[i]->reg));
+
+            hooks[i]->reclaim.busy = hook_busy;
+            hooks[i]->reclaim.free = hook_reclaim_free;
+            omni_reclaim_queue(&(hooks[i]->reclaim));
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// PATCHING
+//-----------------------------------------------------------------------------
+
+/* two ways to write a batch of sites (omnihook_set_patch_mode()), both all
+    or nothing: if any site changed since its bytes were stolen, none is
+    written */
+static int patch_mode = OMNIHOOK_PATCH_BP;
+
+/* the bytes a site ends up with: the JMP to the entry, the tail of the last
+    stolen instruction (never executed again) made to trap; or the stolen
+    bytes when restoring */
+static void
+patch_code(hook *h, int restore, /* out */ uint8_t *code)
+{
+    if(restore) {
+        memcpy(code, h->stolen, h->stolen_len);
+        return;
+    }
+
+    omni_x86_jmp(code, (uintptr_t)h->site, (uintptr_t)h->entry, X86_IS64);
+    memset(code + h->jmp_len, 0xcc, h->stolen_len - h->jmp_len);
+}
+
+/* a batch of sites is written (or restored) inside one stop_machine() pass:
+    one CPU patches with write protect off once, every other CPU spins with
+    interrupts disabled until it is done and then serializes */
+struct patch_batch {
+    hook **hooks;
+    int count;
+    int restore; // nonzero: write stolen bytes back instead of the JMP
+    int patched; // sites written by the patching CPU
+    atomic_t cpus; // elects the patching CPU
+    int done;
+};
+
+static int
+patch_batch_stop(void *data)
+{
+    int i;
+    struct patch_batch *pb = data;
+
+    if(atomic_inc_return(&pb->cpus) != 1) {
+        /* don't run on bytes prefetched before the write */
+        while(!READ_ONCE(pb->done)) {
+            cpu_relax();
+        }
+        sync_core();
+        return 0;
+    }
+
+    disable_write_protect();
+
+    for(i = 0; i < pb->count; ++i) {
+        hook *h = pb->hooks[i];
+
+        /* site changed since its bytes were stolen (possibly by an earlier
+            entry of this very batch), hooking it would lose that change */
+        if(!pb->restore && memcmp(h->site, h->stolen, h->stolen_len)) {
+            omni_log_fail(h->src, NULL, OMNI_FAIL_CHANGED);
+            break;
+        }
+
+        patch_code(h, pb->restore, h->site);
+    }
+
+    pb->patched = i;
+
+    /* all or nothing: roll back whatever this pass already wrote */
+    if(i != pb->count) {
+        while(i--) {
+            memcpy(pb->hooks[i]->site, pb->hooks[i]->stolen,
+                pb->hooks[i]->stolen_len);
+        }
+    }
+
+    enable_write_protect();
+
+    sync_core();
+    smp_wmb();
+    WRITE_ONCE(pb->done, 1);
+
+    return 0;
+}
+
+static int
+patch_batch_machine(hook **hooks, int count, int restore)
+{
+    struct patch_batch pb = {
+        .hooks = hooks,
+        .count = count,
+        .restore = restore,
+        .patched = 0,
+        .done = 0
+    };
+
+    atomic_set(&pb.cpus, 0);
+
+    stop_machine(patch_batch_stop, &pb, cpu_online_mask);
+
+    return (pb.patched == count) ? 0 : -1;
+}
+
+/* a batch of sites is rewritten the way the kernel's text_poke_bp() does it,
+    without stopping any CPU:
+
+    1) int3 over the first byte of every site, sync every core
+    2) (installing) wait out RCU-tasks, so nobody is left running or
+       preempted past a site's first byte, inside what gets overwritten
+    3) every byte but the first, sync every core
+    4) the first byte, sync every core
+
+    a CPU reaching a site meanwhile traps and is sent on to the hook's entry
+    by bp_notify(), so it sees the old instructions or the JMP, never a mix;
+    bytes go in through text_poke() (a temporary writable alias) when it can
+    be found, write protect stays on */
+struct bp_batch {
+    int count;
+    hook *hooks[]; // by site, for bp_notify()
+};
+
+static struct bp_batch __rcu *bp_active;
+static int bp_registered;
+
+static void *(*bp_text_poke)(void *addr, const void *opcode, size_t len);
+static struct mutex *bp_text_mutex;
+
+static int
+bp_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)(*(hook **)a)->site;
+    uintptr_t y = (uintptr_t)(*(hook **)b)->site;
+
+    return (x > y) - (x < y);
+}
+
+static int
+bp_key_cmp(const void *key, const void *elt)
+{
+    uintptr_t x = (uintptr_t)key;
+    uintptr_t y = (uintptr_t)(*(hook **)elt)->site;
+
+    return (x > y) - (x < y);
+}
+
+/* called with interrupts off, under rcu_read_lock() (atomic notifier) */
+static int
+bp_notify(struct notifier_block *nb, unsigned long val, void *data)
+{
+    struct die_args *args = data;
+    struct bp_batch *bp;
+    hook **h;
+
+    if(val != DIE_INT3 || user_mode(args->regs)) {
+        return NOTIFY_DONE;
+    }
+
+    bp = rcu_dereference(bp_active);
+    if(!bp) {
+        return NOTIFY_DONE;
+    }
+
+    /* ip is past the int3 */
+    h = bsearch((void *)(args->regs->ip - 1), bp->hooks, bp->count,
+        sizeof(hook *), bp_key_cmp);
+    if(!h) {
+        return NOTIFY_DONE;
+    }
+
+    /* emulate the JMP: the entry is live before the first int3 goes in and
+        stays so until after the last one is gone */
+    args->regs->ip = (unsigned long)(*h)->entry;
+
+    return NOTIFY_STOP;
+}
+
+static struct notifier_block bp_nb = {
+    .notifier_call = bp_notify,
+    .priority = INT_MAX,
+};
+
+static void
+bp_sync_core(void *unused)
+{
+    sync_core();
+}
+
+/* every CPU serializes, none runs on bytes fetched before the last write;
+    a CPU inside bp_notify() (interrupts off) finishes it first */
+static void
+bp_sync(void)
+{
+    on_each_cpu(bp_sync_core, NULL, 1);
+}
+
+static void
+bp_write(void *addr, const void *bytes, size_t len)
+{
+    unsigned long flags;
+
+    if(bp_text_poke) {
+        bp_text_poke(addr, bytes, len);
+        return;
+    }
+
+    /* no text_poke(): write protect goes off on this CPU only, for these
+        bytes, and nothing else runs on it meanwhile */
+    local_irq_save(flags);
+    disable_write_protect();
+    memcpy(addr, bytes, len);
+    enable_write_protect();
+    local_irq_restore(flags);
+}
+
+static void
+bp_lock(void)
+{
+    if(bp_text_mutex) {
+        mutex_lock(bp_text_mutex);
+    }
+}
+
+static void
+bp_unlock(void)
+{
+    if(bp_text_mutex) {
+        mutex_unlock(bp_text_mutex);
+    }
+}
+
+static int
+patch_batch_bp(hook **hooks, int count, int restore)
+{
+    int rc = -1, i;
+    uint8_t int3 = 0xcc;
+    uint8_t (*code)[HOOK_MAX_STOLEN] = NULL;
+    struct bp_batch *bp = NULL;
+
+    /* short of memory, stop_machine() needs none: unhooking must not fail
+        for lack of it */
+    code = kmalloc_array(count, sizeof(*code), GFP_KERNEL);
+    bp = kmalloc(sizeof(*bp) + count * sizeof(hook *), GFP_KERNEL);
+    if(!code || !bp) {
+        rc = patch_batch_machine(hooks, count, restore);
+        goto cleanup;
+    }
+
+    /* checked up front, nothing is written unless every site still holds
+        its stolen bytes (overlapping sites never make it into a batch, the
+        registry refuses them) */
+    for(i = 0; i < count; ++i) {
+        hook *h = hooks[i];
+
+        if(!restore && memcmp(h->site, h->stolen, h->stolen_len)) {
+            omni_log_fail(h->src, NULL, OMNI_FAIL_CHANGED);
+            goto cleanup;
+        }
+
+        patch_code(h, restore, code[i]);
+        bp->hooks[i] = h;
+    }
+
+    bp->count = count;
+    sort(bp->hooks, count, sizeof(hook *), bp_cmp, NULL);
+    rcu_assign_pointer(bp_active, bp);
+
+    bp_lock();
+    for(i = 0; i < count; ++i) {
+        bp_write(hooks[i]->site, &int3, 1);
+    }
+    bp_unlock();
+    bp_sync();
+
+    /* a restored site only ever ran its JMP, nobody is inside its tail */
+    if(!restore) {
+        synchronize_rcu_tasks();
+    }
+
+    bp_lock();
+    for(i = 0; i < count; ++i) {
+        if(hooks[i]->stolen_len > 1) {
+            bp_write((uint8_t *)hooks[i]->site + 1, code[i] + 1,
+                hooks[i]->stolen_len - 1);
+        }
+    }
+    bp_unlock();
+    bp_sync();
+
+    bp_lock();
+    for(i = 0; i < count; ++i) {
+        bp_write(hooks[i]->site, code[i], 1);
+    }
+    bp_unlock();
+    bp_sync();
+
+    /* no int3 of ours is left, wait out any bp_notify() still looking */
+    RCU_INIT_POINTER(bp_active, NULL);
+    synchronize_rcu();
+
+    rc = 0;
+
+    cleanup:
+    kfree(bp);
+    kfree(code);
+
+    return rc;
+}
+
+static int
+patch_batch(hook **hooks, int count, int restore)
+{
+    int rc, i;
+
+    /* int3 needs bp_notify() registered, by omnihook_init() */
+    if(patch_mode == OMNIHOOK_PATCH_BP && bp_registered) {
+        rc = patch_batch_bp(hooks, count, restore);
+    }
+    else {
+        rc = patch_batch_machine(hooks, count, restore);
+    }
+
+    for(i = 0; 0 == rc && i < count; ++i) {
+        if(restore) {
+            omni_log_restore(hooks[i]->src, hooks[i]->stolen,
+                hooks[i]->stolen_len);
+        }
+        else {
+            omni_log_patch(hooks[i]->src, hooks[i]->site, hooks[i]->stolen_len);
+        }
+    }
+
+    return rc;
+}
+
+//-----------------------------------------------------------------------------
+// HOOKLIB MAIN API
+//-----------------------------------------------------------------------------
+
+int
+omnihook_init(void)
+{
+    struct omni_sym syms[] = { { "text_poke" }, { "text_mutex" } };
+
+    /* both unexported; without text_poke() bytes are written with write
+        protect briefly off, without text_mutex ftrace and kprobes can't be
+        kept out while we write */
+    omni_syms_resolve(syms, ARRAY_SIZE(syms));
+    bp_text_poke = syms[0].addr;
+    bp_text_mutex = syms[1].addr;
+    if(!bp_text_mutex) {
+        bp_text_poke = NULL;
+    }
+
+    /* no int3 handler, sites are written under stop_machine() instead */
+    if(0 == register_die_notifier(&bp_nb)) {
+        bp_registered = 1;
+    }
+    else {
+        printk("WARNING: omnihook can't patch with int3, using stop_machine()\n");
+    }
+
+    /* neither is a reason to fail, hooks work without their event log and
+        omnihook_get_stats() without debugfs */
+    if(0 != omni_events_init()) {
+        printk("WARNING: omnihook events unavailable\n");
+    }
+
+    #if defined(OMNIHOOK_STATS)
+    if(0 != omni_stats_init(omni_debugfs_dir())) {
+        printk("WARNING: omnihook stats unavailable in debugfs\n");
+    }
+    #endif
+
+    return 0;
+}
+
+void
+omnihook_exit(void)
+{
+    /* removed hooks (and detours) are freed in the background, this waits
+        for all of them, after which no call is inside a detour */
+    omni_reclaim_flush();
+
+    #if defined(OMNIHOOK_STATS)
+    omni_stats_exit();
+    #endif
+
+    omni_events_exit();
+
+    if(bp_registered) {
+        unregister_die_notifier(&bp_nb);
+        bp_registered = 0;
+    }
+}
+
+int
+omnihook_set_patch_mode(int mode)
+{
+    if(mode != OMNIHOOK_PATCH_BP && mode != OMNIHOOK_PATCH_MACHINE) {
+        return -1;
+    }
+
+    mutex_lock(&hooks_lock);
+    patch_mode = mode;
+    mutex_unlock(&hooks_lock);
+
+    return 0;
+}
+
+/* builds every new site's trampoline first, then patches all of them in a
+    single pass, then links the detours in; if anything fails
+    nothing changes (no new site stays hooked, no chain is touched)
+
+    stubs (optional) are handed to the detours, freed along with them once
+    added, left to the caller otherwise */
+static int
+add_batch(omnihook_desc *descs, int count, void **stubs)
+{
+    int rc = -1, i, j, nsites = 0;
+    hook **sites = NULL; // built by this batch
+    hook **owners = NULL; // site of each desc
+    struct omni_detour **detours = NULL;
+
+    if(count <= 0) {
+        return -1;
+    }
+
+    sites = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    owners = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    detours = kcalloc(count, sizeof(struct omni_detour *), GFP_KERNEL);
+    if(!sites || !owners || !detours) {
+        goto cleanup;
+    }
+
+    mutex_lock(&hooks_lock);
+
+    for(i = 0; i < count; ++i) {
+        /* a site hooked earlier (or earlier in this batch) gets another
+            detour, hooks can't go away while hooks_lock is held */
+        rcu_read_lock();
+        owners[i] = omnihook_find(descs[i].src);
+        rcu_read_unlock();
+
+        if(!owners[i]) {
+            owners[i] = hook_build(descs[i].src);
+            if(!owners[i]) {
+                goto unlock;
+            }
+            sites[nsites++] = owners[i];
+        }
+
+        for(j = 0; j < i; ++j) {
+            if(owners[j] == owners[i] && descs[j].dst == descs[i].dst) {
+                break;
+            }
+        }
+        if(j != i || omni_chain_find(&owners[i]->chain, descs[i].dst)) {
+            omni_log_fail(descs[i].src, descs[i].dst, OMNI_FAIL_DUPLICATE);
+            goto unlock;
+        }
+
+        detours[i] = omni_detour_new(&owners[i]->chain, descs[i].dst,
+            descs[i].priority);
+        if(!detours[i]) {
+            omni_log_fail(descs[i].src, descs[i].dst, OMNI_FAIL_NOMEM);
+            goto unlock;
+        }
+
+        /* inform the caller now, the detour can run the moment it's
+            linked in */
+        *(descs[i].trampoline) = detours[i]->link;
+    }
+
+    if(nsites && 0 != patch_batch(sites, nsites, 0)) {
+        goto unlock;
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(stubs) {
+            detours[i]->stub = stubs[i];
+        }
+        omni_chain_insert(&owners[i]->chain, detours[i]);
+        detours[i] = NULL;
+
+        omni_log_install(descs[i].src, descs[i].dst, *(descs[i].trampoline));
+    }
+
+    /* sites are live, removers may claim them now */
+    for(i = 0; i < nsites; ++i) {
+        clear_bit(HOOK_BUSY, &(sites[i]->state));
+    }
+
+    rc = 0;
+
+    unlock:
+    if(0 != rc) {
+        for(i = 0; i < count; ++i) {
+            if(detours[i]) {
+                *(descs[i].trampoline) = NULL;
+                omni_detour_free(detours[i]);
+            }
+        }
+
+        hooks_release(sites, nsites);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    cleanup:
+    kfree(detours);
+    kfree(owners);
+    kfree(sites);
+
+    return rc;
+}
+
+int
+omnihook_add_batch(omnihook_desc *descs, int count)
+{
+    return add_batch(descs, count, NULL);
+}
+
+int
+omnihook_add_prio(void *src, void *dst, int priority, /* out */ void **trampoline)
+{
+    omnihook_desc desc = { src, dst, trampoline, priority };
+
+    return omnihook_add_batch(&desc, 1);
+}
+
+int
+omnihook_add(void *src, void *dst, /* out */ void **trampoline)
+{
+    return omnihook_add_prio(src, dst, 0, trampoline);
+}
+
+#if defined(__amd64__)
+int
+omnihook_add_ret(void *src, struct omnihook_ret *r)
+{
+    void *stub;
+    omnihook_desc desc;
+
+    if(!r->exit) {
+        return -1;
+    }
+
+    stub = ret_build_stub(r, src);
+    if(!stub) {
+        omni_log_fail(src, NULL, OMNI_FAIL_NOMEM);
+        return -1;
+    }
+
+    r->stub = stub;
+    desc.src = src;
+    desc.dst = stub;
+    desc.trampoline = &r->next;
+    desc.priority = r->priority;
+
+    if(0 != add_batch(&desc, 1, &stub)) {
+        omni_arena_free(stub);
+        r->stub = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+omnihook_remove_ret(void *src, struct omnihook_ret *r)
+{
+    /* the stub goes with the detour */
+    return r->stub ? omnihook_remove_detour(src, r->stub) : -1;
+}
+
+int
+omnihook_set_filter(void *src, const struct omnihook_filter *filter)
+{
+    int rc = -1;
+    hook *h;
+    struct omni_filter *flt = NULL;
+
+    if(filter) {
+        flt = filter_new(filter);
+        if(!flt) {
+            return -1;
+        }
+    }
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(!h) {
+        omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+        goto unlock;
+    }
+
+    flt = rcu_replace_pointer(h->filter, flt, lockdep_is_held(&hooks_lock));
+
+    rc = 0;
+
+    unlock:
+    mutex_unlock(&hooks_lock);
+
+    /* omni_hook_enter() reads the filter with preemption disabled */
+    if(0 == rc) {
+        synchronize_rcu();
+    }
+
+    filter_free(flt);
+
+    return rc;
+}
+#endif
+
+hook *
+omnihook_find(void *src)
+{
+    struct omni_reg_node *n = omni_reg_find(src);
+
+    return n ? container_of(n, hook, reg) : NULL;
+}
+
+/* marks a live hook as being torn down, fails if it's already claimed (by a
+    concurrent remove) or isn't live yet (still being added) */
+static int
+hook_claim(hook *h)
+{
+    return test_and_set_bit(HOOK_BUSY, &h->state) ? -1 : 0;
+}
+
+/* unpatches the given (claimed) hooks in one pass, then frees them */
+static int
+remove_hooks(hook **hooks, int count)
+{
+    int i, n = 0;
+
+    /* disabled sites are restored already, they go last */
+    for(i = 0; i < count; ++i) {
+        if(!test_bit(HOOK_DISABLED, &(hooks[i]->state))) {
+            swap(hooks[n], hooks[i]);
+            n++;
+        }
+    }
+
+    /* nothing was restored, every hook stays live: hand the claims back or
+        none of them could ever be removed again */
+    if(n && 0 != patch_batch(hooks, n, 1)) {
+        for(i = 0; i < count; ++i) {
+            clear_bit(HOOK_BUSY, &(hooks[i]->state));
+        }
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        omni_log_remove(hooks[i]->src, NULL);
+    }
+
+    hooks_release(hooks, count);
+
+    return 0;
+}
+
+/* all or nothing: fails without unhooking anything if any src isn't hooked */
+int
+omnihook_remove_batch(omnihook_desc *descs, int count)
+{
+    int rc = -1, i;
+    hook **hooks = NULL;
+
+    if(count <= 0) {
+        goto cleanup;
+    }
+
+    hooks = kcalloc(count, sizeof(hook *), GFP_KERNEL);
+    if(!hooks) {
+        goto cleanup;
+    }
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    for(i = 0; i < count; ++i) {
+        hook *h = omnihook_find(descs[i].src);
+
+        if(!h || 0 != hook_claim(h)) {
+            omni_log_fail(descs[i].src, NULL,
+                h ? OMNI_FAIL_BUSY : OMNI_FAIL_NOT_HOOKED);
+            break;
+        }
+
+        hooks[i] = h;
+    }
+    rcu_read_unlock();
+
+    if(i != count) {
+
+        /* hand back what was claimed */
+        while(i--) {
+            clear_bit(HOOK_BUSY, &(hooks[i]->state));
+        }
+    }
+    else {
+        rc = remove_hooks(hooks, count);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    cleanup:
+    kfree(hooks);
+
+    return rc;
+}
+
+struct remove_ctx {
+    hook **hooks;
+    int count;
+    int max;
+};
+
+static int
+remove_collect(struct omni_reg_node *n, void *data)
+{
+    struct remove_ctx *ctx = data;
+    hook *h = container_of(n, hook, reg);
+
+    if(ctx->count == ctx->max) {
+        return 1;
+    }
+
+    if(0 == hook_claim(h)) {
+        ctx->hooks[ctx->count++] = h;
+    }
+
+    return 0;
+}
+
+/* when address is given (non-NULL), it remove single hook from this address
+    when address is not given (ie value NULL), it removes all hooks in the registry */
+int 
+omnihook_remove_general(void *src)
+{
+    int rc = -1;
+    hook *h;
+    struct remove_ctx ctx = { NULL, 0, 0 };
+
+    mutex_lock(&hooks_lock);
+
+    /* if source specified, only remove this one */
+    if(src) {
+        rcu_read_lock();
+        h = omnihook_find(src);
+        rcu_read_unlock();
+
+        if(!h) {
+            omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+        }
+        else if(0 != hook_claim(h)) {
+            omni_log_fail(src, NULL, OMNI_FAIL_BUSY);
+        }
+        else {
+            rc = remove_hooks(&h, 1);
+        }
+
+        goto cleanup;
+    }
+
+    /* otherwise, remove them all */
+    ctx.max = omni_reg_count();
+    if(!ctx.max) {
+        goto cleanup;
+    }
+
+    ctx.hooks = kcalloc(ctx.max, sizeof(hook *), GFP_KERNEL);
+    if(!ctx.hooks) {
+        goto cleanup;
+    }
+
+    omni_reg_for_each(remove_collect, &ctx);
+
+    if(ctx.count) {
+        rc = remove_hooks(ctx.hooks, ctx.count);
+    }
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+    kfree(ctx.hooks);
+
+    return rc;
+}
+
+int 
+omnihook_remove(void *src)
+{
+    return omnihook_remove_general(src);
+}
+
+int
+omnihook_remove_detour(void *src, void *dst)
+{
+    int rc = -1;
+    hook *h;
+    struct omni_detour *d = NULL;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h) {
+        d = omni_chain_find(&h->chain, dst);
+    }
+
+    if(!d) {
+        omni_log_fail(src, dst, OMNI_FAIL_NOT_HOOKED);
+        goto cleanup;
+    }
+
+    /* the last detour takes the site with it */
+    if(h->chain.count == 1) {
+        if(0 == hook_claim(h)) {
+            rc = remove_hooks(&h, 1);
+        }
+        else {
+            omni_log_fail(src, dst, OMNI_FAIL_BUSY);
+        }
+
+        goto cleanup;
+    }
+
+    /* the site keeps jumping to the dispatch link, which no longer leads
+        through d; whoever was already on the way is waited out before d is
+        freed */
+    omni_chain_unlink(&h->chain, d);
+
+    d->site = h;
+    #if defined(__amd64__)
+    d->reclaim.retire = detour_retire;
+    d->reclaim.busy = detour_busy;
+    #endif
+    d->reclaim.free = detour_reclaim_free;
+    omni_reclaim_queue(&d->reclaim);
+
+    omni_log_remove(src, dst);
+
+    rc = 0;
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+/* new_dst takes old_dst's place on src, NULL: the only detour there */
+static int
+replace_general(void *src, void *old_dst, void *new_dst,
+    /* out */ void **trampoline)
+{
+    int rc = -1;
+    hook *h;
+    struct omni_detour *old = NULL, *d;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h && old_dst) {
+        old = omni_chain_find(&h->chain, old_dst);
+    }
+    else if(h && h->chain.count == 1) {
+        old = list_first_entry(&h->chain.detours, struct omni_detour, list);
+    }
+    else if(h) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_AMBIGUOUS);
+        goto cleanup;
+    }
+
+    /* a return hook's stub is only replaced along with the return hook */
+    if(!old || old->stub) {
+        omni_log_fail(src, old_dst, OMNI_FAIL_NOT_HOOKED);
+        goto cleanup;
+    }
+
+    if(omni_chain_find(&h->chain, new_dst)) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_DUPLICATE);
+        goto cleanup;
+    }
+
+    d = omni_detour_new(&h->chain, new_dst, old->priority);
+    if(!d) {
+        omni_log_fail(src, new_dst, OMNI_FAIL_NOMEM);
+        goto cleanup;
+    }
+
+    /* inform the caller now, new_dst can run the moment it's linked in */
+    *trampoline = d->link;
+
+    omni_log_remove(src, old->dst);
+
+    /* the site and the trampoline stay as they are, only the link leading
+        to old changes; calls already in old_dst finish through old's own
+        link, which is waited out before it's freed */
+    omni_chain_replace(&h->chain, old, d);
+
+    old->site = h;
+    #if defined(__amd64__)
+    old->reclaim.retire = detour_retire;
+    old->reclaim.busy = detour_busy;
+    #endif
+    old->reclaim.free = detour_reclaim_free;
+    omni_reclaim_queue(&old->reclaim);
+
+    omni_log_install(src, new_dst, d->link);
+
+    rc = 0;
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+int
+omnihook_replace(void *src, void *new_dst, /* out */ void **trampoline)
+{
+    return replace_general(src, NULL, new_dst, trampoline);
+}
+
+int
+omnihook_replace_detour(void *src, void *old_dst, void *new_dst,
+    /* out */ void **trampoline)
+{
+    return replace_general(src, old_dst, new_dst, trampoline);
+}
+
+int
+omnihook_remove_all(void)
+{
+    return omnihook_remove_general(NULL);
+}
+
+//-----------------------------------------------------------------------------
+// ENABLE/DISABLE
+//-----------------------------------------------------------------------------
+
+/* writes the JMP back over (enable) or restores (disable) every hook given
+    that isn't in that state yet, in one pass; called under hooks_lock, so
+    every hook found is live and none is being claimed meanwhile */
+static int
+toggle_hooks(hook **hooks, int count, int enable)
+{
+    int i, n = 0;
+
+    for(i = 0; i < count; ++i) {
+        if(enable == test_bit(HOOK_DISABLED, &(hooks[i]->state))) {
+            hooks[n++] = hooks[i];
+        }
+    }
+
+    if(!n) {
+        return 0;
+    }
+
+    if(0 != patch_batch(hooks, n, !enable)) {
+        return -1;
+    }
+
+    for(i = 0; i < n; ++i) {
+        if(enable) {
+            clear_bit(HOOK_DISABLED, &(hooks[i]->state));
+            omni_log_enable(hooks[i]->src);
+        }
+        else {
+            set_bit(HOOK_DISABLED, &(hooks[i]->state));
+            omni_log_disable(hooks[i]->src);
+        }
+    }
+
+    return n;
+}
+
+static int
+toggle_one(void *src, int enable)
+{
+    int rc = -1;
+    hook *h;
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(!h) {
+        omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+    }
+    else if(toggle_hooks(&h, 1, enable) >= 0) {
+        rc = 0;
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+int
+omnihook_disable(void *src)
+{
+    return toggle_one(src, 0);
+}
+
+int
+omnihook_enable(void *src)
+{
+    return toggle_one(src, 1);
+}
+
+int
+omnihook_set_group(void *src, const char *group)
+{
+    int rc = -1;
+    hook *h;
+    char *copy = NULL;
+
+    if(group) {
+        copy = kstrdup(group, GFP_KERNEL);
+        if(!copy) {
+            return -1;
+        }
+    }
+
+    mutex_lock(&hooks_lock);
+
+    rcu_read_lock();
+    h = omnihook_find(src);
+    rcu_read_unlock();
+
+    if(h) {
+        swap(h->group, copy);
+        rc = 0;
+    }
+    else {
+        omni_log_fail(src, NULL, OMNI_FAIL_NOT_HOOKED);
+    }
+
+    mutex_unlock(&hooks_lock);
+
+    kfree(copy);
+
+    return rc;
+}
+
+struct group_ctx {
+    const char *group;
+    hook **hooks;
+    int count;
+    int max;
+};
+
+static int
+group_collect(struct omni_reg_node *n, void *data)
+{
+    struct group_ctx *ctx = data;
+    hook *h = container_of(n, hook, reg);
+
+    if(ctx->count == ctx->max) {
+        return 1;
+    }
+
+    if(h->group && 0 == strcmp(h->group, ctx->group)) {
+        ctx->hooks[ctx->count++] = h;
+    }
+
+    return 0;
+}
+
+static int
+toggle_group(const char *group, int enable)
+{
+    int rc = -1;
+    struct group_ctx ctx = { group, NULL, 0, 0 };
+
+    mutex_lock(&hooks_lock);
+
+    ctx.max = omni_reg_count();
+    if(!ctx.max) {
+        rc = 0;
+        goto cleanup;
+    }
+
+    ctx.hooks = kcalloc(ctx.max, sizeof(hook *), GFP_KERNEL);
+    if(!ctx.hooks) {
+        goto cleanup;
+    }
+
+    omni_reg_for_each(group_collect, &ctx);
+
+    rc = toggle_hooks(ctx.hooks, ctx.count, enable);
+
+    cleanup:
+    mutex_unlock(&hooks_lock);
+    kfree(ctx.hooks);
+
+    return rc;
+}
+
+int
+omnihook_disable_group(const char *group)
+{
+    return toggle_group(group, 0);
+}
+
+int
+omnihook_enable_group(const char *group)
+{
+    return toggle_group(group, 1);
+}
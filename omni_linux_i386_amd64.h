@@ -1,16 +1,237 @@
+#include <linux/cpumask.h> /* struct cpumask */
+#include <linux/percpu.h> /* __percpu */
+#include <linux/rcupdate.h> /* __rcu */
+
+#include "omni_linux_arena.h"
+#include "omni_linux_registry.h"
+#include "omni_linux_reclaim.h"
+#include "omni_linux_chain.h"
+#include "omni_x86_lde.h"
+#include "omni_linux_stats.h"
+#include "omni_linux_events.h"
+#include "omni_linux_syms.h"
+
+#if defined(OMNIHOOK_STATS) && !defined(__amd64__)
+#error OMNIHOOK_STATS is only implemented for amd64
+#endif
+
+/* jmp rel32 written over src, or jmp *0(%rip) when the entry is out of
+    reach */
+#define HOOK_JMP_SIZE X86_JMP_REL
+#define HOOK_JMP_MAX X86_JMP_ABS
+/* whole instructions covering the JMP, at worst the last one starts at its
+    last byte */
+#define HOOK_MAX_STOLEN (HOOK_JMP_MAX + X86_MAX_INSN - 1)
+
+/* calls in flight per CPU, by epoch (amd64) */
+struct omni_inflight {
+    long calls[2];
+    atomic_t guard; // calls in the detours holding this CPU's recursion guard
+};
+
+#if defined(__amd64__)
+/* which calls reach a site's detours (amd64), checked in the tracked entry
+    before anything else; the others go straight to the trampoline, neither
+    counted in flight nor timed, as if the site wasn't hooked
+
+    every condition set must hold, sampling counts only the calls that pass
+    the others */
+struct omnihook_filter {
+    pid_t pid; // only this task (0: any)
+    pid_t tgid; // only this process (0: any)
+    const struct cpumask *cpus; // only on these CPUs (NULL: any), copied
+    int match_arg0; // only when the first argument is arg0
+    unsigned long arg0;
+    unsigned int sample; // 1 in sample calls, counted down per CPU (0, 1: all)
+    /* no call on a CPU where one is already inside the detours, so a
+        detour can call (even indirectly) what it hooks; a detour that
+        sleeps makes other tasks' calls on that CPU skip it meanwhile */
+    int no_recursion;
+};
+
+struct omni_filter {
+    struct omnihook_filter f;
+    struct cpumask cpus;
+    int __percpu *countdown; // calls left until the next sampled one
+};
+#endif
+
+/* hook state bits */
+#define HOOK_BUSY 0 /* being built or torn down, can't be claimed */
+#define HOOK_DISABLED 1 /* site restored, the rest kept for omnihook_enable() */
+
 typedef struct hook_ {
-    struct list_head list;
-    void *src; // address where JMP is written
-    void *dst; // address where JMP lands
-    void *trampoline; // address where clean trampoline allocated
-    unsigned char stolen[5]; // bytes stolen at JMP write location
+    struct omni_reg_node reg; // registry entry, covers src up to the last stolen byte
+    unsigned long state;
+    void *src; // function hooked, the registry key
+    void *site; // address where JMP is written: src, or past its endbr64 (amd64)
+    char *group; // omnihook_set_group(), NULL: none
+    struct omni_chain chain; // the detours, the JMP lands in chain.dispatch
+    void *trampoline; // address where clean trampoline allocated, NULL: none needed
+    void *orig; // original behavior: the trampoline, or site + 5 past an fentry NOP
+    unsigned char stolen[HOOK_MAX_STOLEN]; // bytes stolen at JMP write location
+    unsigned int stolen_len; // whole instructions covering the JMP
+    unsigned int jmp_len; // HOOK_JMP_SIZE, or HOOK_JMP_MAX for a far entry
+    void *entry; // what the JMP targets: stub (amd64), chain.dispatch (i386)
+    struct omni_reclaim reclaim; // deferred free, once removed
+    #if defined(__amd64__)
+    void *stub; // arena slot: loads hook, jumps to the tracked entry
+    struct omni_inflight __percpu *inflight;
+    unsigned int epoch; // selects the inflight counter new calls use
+    unsigned long retire_gen; // reclaim batch that last flipped epoch
+    struct omni_filter __rcu *filter; // NULL: every call reaches the detours
+    #endif
+    #if defined(OMNIHOOK_STATS)
+    struct omni_stats stats;
+    #endif
 } hook;
 
+/* one entry of a batch, trampoline is an out parameter */
+typedef struct omnihook_desc_ {
+    void *src;
+    void *dst;
+    void **trampoline;
+    int priority; // among detours on the same src, higher is called first
+} omnihook_desc;
+
+#if defined(__amd64__)
+/* a return hook (amd64): instead of a detour written per signature, entry
+    runs before the function and exit once it returns, with its return value
+    and the cycles it took; it sits in src's detour chain like any detour
+    (priority orders it among them), the function itself is called for it
+
+    the real return address is kept in a preallocated table, not allocated
+    per call, and nothing is locked; a call the table has no room for runs
+    without its exit (counted in missed) */
+struct omnihook_ret {
+    /* optional, gets the register arguments (rdi, rsi, rdx, rcx, r8, r9, in
+        order, changes go to the function) and a cookie for exit; nonzero
+        skips exit for this call */
+    int (*entry)(struct omnihook_ret *r, unsigned long *args,
+        /* out */ unsigned long *cookie);
+    /* several return hooks on one src exit in no particular order */
+    void (*exit)(struct omnihook_ret *r, unsigned long retval, u64 cycles,
+        unsigned long cookie);
+    void *data; // the caller's
+    int priority;
+    atomic_long_t missed;
+    // private
+    void *stub; // the detour: loads this, enters the return hook code
+    void *next; // what follows it in the chain
+};
+#endif
+
+/* module init/exit: sets up/tears down the int3 handler sites are patched
+    through, the event log and debugfs:omnihook-<module>; remove every hook
+    before omnihook_exit(), which waits until the removed hooks are freed
+    and no call is left inside a detour */
+int
+omnihook_init(void);
+
+void
+omnihook_exit(void);
+
+/* how sites are written and restored */
+#define OMNIHOOK_PATCH_BP 0 /* int3 first, no CPU stops (default) */
+#define OMNIHOOK_PATCH_MACHINE 1 /* stop_machine(), every CPU spins meanwhile */
+
+/* int3 patching falls back to stop_machine() if omnihook_init() wasn't
+    called (or couldn't install its handler), and for a batch it has no
+    memory for */
+int
+omnihook_set_patch_mode(int mode);
+
+/* adding to a src that is already hooked puts another detour on it (the
+    site isn't touched again), each detour's trampoline leads to the next
+    detour, the last one's to the original */
 int
 omnihook_add(void *src, void *dst, /* out */ void **thunk);
 
+int
+omnihook_add_prio(void *src, void *dst, int priority, /* out */ void **thunk);
+
+int
+omnihook_add_batch(omnihook_desc *descs, int count);
+
+int
+omnihook_remove_batch(omnihook_desc *descs, int count);
+
+/* removes every detour on src, unhooking it */
 int 
 omnihook_remove(void *src);
 
+/* removes one detour, the last one on src unhooks it */
+int
+omnihook_remove_detour(void *src, void *dst);
+
+/* swaps the only detour on src (replace) or old_dst (replace_detour) for
+    new_dst, at its priority, without unpatching src or rebuilding its
+    trampoline: one link store switches calls over, none runs unhooked.
+    trampoline gets new_dst's own; calls already inside the old detour
+    finish there and are waited out like a removed detour's
+
+    same module only: every module built with omnihook has its own
+    registry, a src hooked by another module isn't found here (fails as not
+    hooked), its detour can only be swapped by that module */
+int
+omnihook_replace(void *src, void *new_dst, /* out */ void **trampoline);
+
+int
+omnihook_replace_detour(void *src, void *old_dst, void *new_dst,
+    /* out */ void **trampoline);
+
+/* constant time lookup, call under rcu_read_lock() if hooks may be removed
+    concurrently */
+hook *
+omnihook_find(void *src);
+
 int
 omnihook_remove_all(void);
+
+/* disable puts src's original bytes back but keeps its trampoline, detours
+    and bookkeeping, enable writes its JMP again; nothing is allocated or
+    rebuilt either way (detours added meanwhile are kept, the site stays
+    disabled until enabled) */
+int
+omnihook_disable(void *src);
+
+int
+omnihook_enable(void *src);
+
+/* puts src in a named group (the name is copied), NULL takes it out */
+int
+omnihook_set_group(void *src, const char *group);
+
+/* every site of the group in one patching pass; return how many sites
+    changed state, -1 if none could (the group stays as it was) */
+int
+omnihook_disable_group(const char *group);
+
+int
+omnihook_enable_group(const char *group);
+
+#if defined(__amd64__)
+/* r must stay valid until omnihook_exit(), a call may still return through
+    it after it's removed */
+int
+omnihook_add_ret(void *src, struct omnihook_ret *r);
+
+int
+omnihook_remove_ret(void *src, struct omnihook_ret *r);
+
+/* replaces src's filter, NULL removes it */
+int
+omnihook_set_filter(void *src, const struct omnihook_filter *filter);
+
+/* where the hooked function returns to, from inside a detour: the tracked
+    entry swaps the return address at ret_slot (the detour's own) for its
+    exit, this gives the real one; see OMNIHOOK_CALLER() */
+void *
+omnihook_caller(void **ret_slot);
+#endif
+
+#if defined(OMNIHOOK_STATS)
+/* totals for the hook at src, fails (-1) if there's none */
+int
+omnihook_get_stats(void *src, /* out */ struct omnihook_stats *stats);
+#endif
@@ -0,0 +1,102 @@
+#include <linux/types.h>
+#include <linux/list.h> /* list_head, etc. */
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h> /* synchronize_rcu(), synchronize_rcu_tasks() */
+#include <linux/workqueue.h>
+#include <linux/delay.h> /* for msleep() */
+#include <linux/jiffies.h>
+
+#include "omni_linux_reclaim.h"
+
+/* after this long waiting on one entry, say so (once per entry) */
+#define RECLAIM_WARN_MS 10000
+
+static LIST_HEAD(reclaim_pending);
+static DEFINE_SPINLOCK(reclaim_lock);
+static unsigned long reclaim_gen;
+
+static void
+reclaim_work_fn(struct work_struct *work);
+
+static DECLARE_WORK(reclaim_work, reclaim_work_fn);
+
+static void
+reclaim_work_fn(struct work_struct *work)
+{
+    int warned;
+    unsigned long flags, start;
+    struct omni_reclaim *r, *tmp;
+    LIST_HEAD(batch);
+
+    spin_lock_irqsave(&reclaim_lock, flags);
+    list_splice_init(&reclaim_pending, &batch);
+    spin_unlock_irqrestore(&reclaim_lock, flags);
+
+    if(list_empty(&batch)) {
+        return;
+    }
+
+    reclaim_gen++;
+    list_for_each_entry(r, &batch, list) {
+        if(r->retire) {
+            r->retire(r, reclaim_gen);
+        }
+    }
+
+    /* one of each for the whole batch: RCU for lockless lookups and code
+        run with preemption off, RCU-tasks for tasks preempted in a stub */
+    synchronize_rcu();
+    synchronize_rcu_tasks();
+
+    list_for_each_entry_safe(r, tmp, &batch, list) {
+        start = jiffies;
+        warned = 0;
+
+        while(r->busy && r->busy(r)) {
+            if(!warned && time_after(jiffies, start + msecs_to_jiffies(RECLAIM_WARN_MS))) {
+                printk("WARNING: omnihook still waiting for calls in flight to return\n");
+                warned = 1;
+            }
+            msleep(1);
+        }
+
+        list_del(&r->list);
+        r->free(r);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// RECLAIM API
+//-----------------------------------------------------------------------------
+
+void
+omni_reclaim_queue(struct omni_reclaim *r)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&reclaim_lock, flags);
+    list_add_tail(&r->list, &reclaim_pending);
+    spin_unlock_irqrestore(&reclaim_lock, flags);
+
+    schedule_work(&reclaim_work);
+}
+
+void
+omni_reclaim_flush(void)
+{
+    int empty;
+    unsigned long flags;
+
+    do {
+        flush_work(&reclaim_work);
+
+        /* queued while the last batch was being waited on */
+        spin_lock_irqsave(&reclaim_lock, flags);
+        empty = list_empty(&reclaim_pending);
+        spin_unlock_irqrestore(&reclaim_lock, flags);
+
+        if(!empty) {
+            schedule_work(&reclaim_work);
+        }
+    } while(!empty);
+}
@@ -0,0 +1,29 @@
+#ifndef OMNI_LINUX_RECLAIM_H
+#define OMNI_LINUX_RECLAIM_H
+
+/* deferred reclamation: whatever a removal takes out of reach (hooks,
+    detours, their arena stubs) is queued here instead of freed on the spot
+
+    a worker takes everything queued so far as one batch, waits out one RCU
+    and one RCU-tasks grace period for the whole batch (nobody is left
+    running or preempted inside a trampoline or stub), then waits for each
+    entry's calls in flight to drain and frees it */
+struct omni_reclaim {
+    struct list_head list;
+    /* optional, called once per batch before the grace period, gen is
+        unique to the batch */
+    void (*retire)(struct omni_reclaim *r, unsigned long gen);
+    /* optional, nonzero while calls through the entry are still in flight */
+    int (*busy)(struct omni_reclaim *r);
+    void (*free)(struct omni_reclaim *r);
+};
+
+/* never sleeps */
+void
+omni_reclaim_queue(struct omni_reclaim *r);
+
+/* waits until everything queued so far is freed */
+void
+omni_reclaim_flush(void);
+
+#endif
@@ -0,0 +1,158 @@
+#include <linux/types.h>
+#include <linux/list.h> /* hlist_head, etc. */
+#include <linux/rculist.h> /* hlist_add_head_rcu(), etc. */
+#include <linux/spinlock.h>
+#include <linux/hash.h> /* hash_long() */
+#include <linux/atomic.h>
+
+#include "omni_linux_registry.h"
+
+/* readers walk buckets under RCU, writers take the lock stripe(s) covering
+    the buckets they touch */
+static struct hlist_head reg_buckets[1 << REG_HASH_BITS];
+static spinlock_t reg_locks[1 << REG_LOCK_BITS] = {
+    [0 ... (1 << REG_LOCK_BITS) - 1] = __SPIN_LOCK_UNLOCKED(reg_locks)
+};
+static atomic_t reg_count = ATOMIC_INIT(0);
+
+static inline unsigned long
+reg_granule(void *addr)
+{
+    return (uintptr_t)addr >> REG_GRANULE_SHIFT;
+}
+
+static inline unsigned int
+reg_bucket(unsigned long granule)
+{
+    return hash_long(granule, REG_HASH_BITS);
+}
+
+static inline unsigned int
+reg_stripe(unsigned int bucket)
+{
+    return bucket & ((1 << REG_LOCK_BITS) - 1);
+}
+
+//-----------------------------------------------------------------------------
+// REGISTRY API
+//-----------------------------------------------------------------------------
+
+int
+omni_reg_insert(struct omni_reg_node *n)
+{
+    int rc = -1;
+    int i, j, nstripes = 0;
+    unsigned int stripes[3], tmp;
+    unsigned long g, first, last;
+    uintptr_t start = (uintptr_t)n->src, end = start + n->len;
+    struct omni_reg_node *cursor;
+
+    if(!n->len || n->len > REG_MAX_RANGE) {
+        return -1;
+    }
+
+    /* ranges that might overlap start in granule first..last */
+    first = reg_granule(n->src) - 1;
+    last = reg_granule((void *)(end - 1));
+
+    /* lock the stripes covering those buckets, in ascending order */
+    for(g = first; g <= last; ++g) {
+        tmp = reg_stripe(reg_bucket(g));
+
+        for(i = 0; i < nstripes && stripes[i] != tmp; ++i)
+            ;
+        if(i == nstripes) {
+            stripes[nstripes++] = tmp;
+        }
+    }
+
+    for(i = 1; i < nstripes; ++i) {
+        for(j = i; j > 0 && stripes[j - 1] > stripes[j]; --j) {
+            tmp = stripes[j];
+            stripes[j] = stripes[j - 1];
+            stripes[j - 1] = tmp;
+        }
+    }
+
+    for(i = 0; i < nstripes; ++i) {
+        spin_lock_nested(&reg_locks[stripes[i]], i);
+    }
+
+    for(g = first; g <= last; ++g) {
+        hlist_for_each_entry(cursor, &reg_buckets[reg_bucket(g)], node) {
+            uintptr_t cstart = (uintptr_t)cursor->src;
+
+            if(start < cstart + cursor->len && cstart < end) {
+                goto cleanup;
+            }
+        }
+    }
+
+    hlist_add_head_rcu(&n->node, &reg_buckets[reg_bucket(reg_granule(n->src))]);
+    atomic_inc(&reg_count);
+
+    rc = 0;
+
+    cleanup:
+    for(i = nstripes - 1; i >= 0; --i) {
+        spin_unlock(&reg_locks[stripes[i]]);
+    }
+
+    return rc;
+}
+
+void
+omni_reg_remove(struct omni_reg_node *n)
+{
+    unsigned int bucket = reg_bucket(reg_granule(n->src));
+    spinlock_t *lock = &reg_locks[reg_stripe(bucket)];
+
+    spin_lock(lock);
+    if(!hlist_unhashed(&n->node)) {
+        hlist_del_init_rcu(&n->node);
+        atomic_dec(&reg_count);
+    }
+    spin_unlock(lock);
+}
+
+struct omni_reg_node *
+omni_reg_find(void *src)
+{
+    struct omni_reg_node *cursor;
+
+    hlist_for_each_entry_rcu(cursor,
+        &reg_buckets[reg_bucket(reg_granule(src))], node) {
+
+        if(cursor->src == src) {
+            return cursor;
+        }
+    }
+
+    return NULL;
+}
+
+void
+omni_reg_for_each(int (*fn)(struct omni_reg_node *n, void *ctx), void *ctx)
+{
+    int i;
+    struct omni_reg_node *cursor;
+
+    rcu_read_lock();
+
+    for(i = 0; i < (1 << REG_HASH_BITS); ++i) {
+        hlist_for_each_entry_rcu(cursor, &reg_buckets[i], node) {
+            if(fn(cursor, ctx)) {
+                goto done;
+            }
+        }
+    }
+
+    done:
+    rcu_read_unlock();
+}
+
+int
+omni_reg_count(void)
+{
+    return atomic_read(&reg_count);
+}
@@ -0,0 +1,40 @@
+#ifndef OMNI_LINUX_REGISTRY_H
+#define OMNI_LINUX_REGISTRY_H
+
+/* hook registry: a hash of patch ranges keyed by src
+
+    text is split into 32 byte granules and a range is filed under the
+    granule its src falls in; since no range is longer than a granule, any
+    range that could overlap a new one is filed under one of at most three
+    neighbouring granules, so rejecting overlaps stays constant time */
+#define REG_GRANULE_SHIFT 5
+#define REG_MAX_RANGE (1 << REG_GRANULE_SHIFT)
+#define REG_HASH_BITS 12 /* buckets */
+#define REG_LOCK_BITS 8 /* bucket lock stripes */
+
+struct omni_reg_node {
+    struct hlist_node node;
+    void *src; // first byte of the range
+    unsigned int len; // bytes of text owned by the hook starting at src
+};
+
+/* fails (-1) if the range overlaps one already registered */
+int
+omni_reg_insert(struct omni_reg_node *n);
+
+/* harmless on a node that was never inserted (or already removed) */
+void
+omni_reg_remove(struct omni_reg_node *n);
+
+/* exact match on src, call under rcu_read_lock() */
+struct omni_reg_node *
+omni_reg_find(void *src);
+
+/* calls fn on every node under rcu_read_lock() until fn returns nonzero */
+void
+omni_reg_for_each(int (*fn)(struct omni_reg_node *n, void *ctx), void *ctx);
+
+int
+omni_reg_count(void);
+
+#endif
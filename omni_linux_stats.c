@@ -0,0 +1,160 @@
+#include <linux/types.h>
+#include <linux/percpu.h> /* alloc_percpu(), per_cpu_ptr() */
+#include <linux/cpumask.h> /* for_each_possible_cpu() */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kernel.h> /* min_t(), snprintf() */
+#include <linux/bitops.h> /* fls64() */
+
+#include "omni_linux_stats.h"
+
+static struct dentry *stats_hooks;
+
+//-----------------------------------------------------------------------------
+// DEBUGFS
+//-----------------------------------------------------------------------------
+
+static int
+stats_file_show(struct seq_file *m, void *unused)
+{
+    struct omni_stats *s = m->private;
+
+    s->show(m, s->priv);
+
+    return 0;
+}
+
+static int
+stats_file_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stats_file_show, inode->i_private);
+}
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_file_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int
+omni_stats_init(struct dentry *parent)
+{
+    if(!parent) {
+        return -1;
+    }
+
+    stats_hooks = debugfs_create_dir("hooks", parent);
+    if(IS_ERR_OR_NULL(stats_hooks)) {
+        stats_hooks = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+omni_stats_exit(void)
+{
+    /* every hook is gone by now, so is every file */
+    debugfs_remove_recursive(stats_hooks);
+    stats_hooks = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// COUNTERS
+//-----------------------------------------------------------------------------
+
+int
+omni_stats_create(struct omni_stats *s, void *src,
+    void (*show)(struct seq_file *m, void *priv), void *priv)
+{
+    char name[2 * sizeof(void *) + 1];
+
+    s->show = show;
+    s->priv = priv;
+    s->file = NULL;
+
+    s->cpu = alloc_percpu(struct omni_cpu_stats);
+    if(!s->cpu) {
+        return -1;
+    }
+
+    /* named by address, a symbol can be hooked at more than one offset;
+        without debugfs (omnihook_init() not called) the counters still
+        count */
+    if(stats_hooks) {
+        snprintf(name, sizeof(name), "%lx", (unsigned long)src);
+        s->file = debugfs_create_file(name, 0400, stats_hooks, s, &stats_fops);
+        if(IS_ERR(s->file)) {
+            s->file = NULL;
+        }
+    }
+
+    return 0;
+}
+
+void
+omni_stats_destroy(struct omni_stats *s)
+{
+    debugfs_remove(s->file);
+    s->file = NULL;
+
+    free_percpu(s->cpu);
+    s->cpu = NULL;
+}
+
+void
+omni_stats_sum(struct omni_stats *s, /* out */ struct omnihook_stats *total)
+{
+    int cpu, b;
+
+    memset(total, 0, sizeof(*total));
+
+    for_each_possible_cpu(cpu) {
+        struct omni_cpu_stats *c = per_cpu_ptr(s->cpu, cpu);
+
+        total->hits += READ_ONCE(c->hits);
+        total->missed += READ_ONCE(c->missed);
+        for(b = 0; b < OMNI_HIST_BUCKETS; ++b) {
+            total->hist[b] += READ_ONCE(c->hist[b]);
+        }
+    }
+}
+
+void
+omni_stats_show(struct seq_file *m, struct omni_stats *s)
+{
+    int cpu, b;
+    struct omnihook_stats total;
+
+    omni_stats_sum(s, &total);
+
+    seq_printf(m, "hits: %llu\n", total.hits);
+    seq_printf(m, "missed: %llu\n", total.missed);
+    for_each_possible_cpu(cpu) {
+        u64 hits = READ_ONCE(per_cpu_ptr(s->cpu, cpu)->hits);
+
+        if(hits) {
+            seq_printf(m, "  cpu%d: %llu\n", cpu, hits);
+        }
+    }
+
+    /* calls still in flight (and calls whose return couldn't be tracked)
+        aren't in the histogram */
+    seq_printf(m, "cycles in detour:\n");
+    for(b = 0; b < OMNI_HIST_BUCKETS; ++b) {
+        if(!total.hist[b]) {
+            continue;
+        }
+
+        if(b == OMNI_HIST_BUCKETS - 1) {
+            seq_printf(m, "  [%llu, inf): %llu\n", 1ULL << (b - 1), total.hist[b]);
+        }
+        else {
+            seq_printf(m, "  [%llu, %llu): %llu\n", b ? 1ULL << (b - 1) : 0,
+                1ULL << b, total.hist[b]);
+        }
+    }
+}
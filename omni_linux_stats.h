@@ -0,0 +1,77 @@
+#ifndef OMNI_LINUX_STATS_H
+#define OMNI_LINUX_STATS_H
+
+/* per hook instrumentation (build with OMNIHOOK_STATS): hits and a log2
+    histogram of cycles spent in the detour, counted per CPU so the entry path
+    never writes a line another core reads or writes
+
+    readable as debugfs:omnihook-<module>/hooks/<src> */
+#define OMNI_HIST_BUCKETS 32 /* bucket b: [2^(b-1), 2^b) cycles, last one open */
+
+struct omni_cpu_stats {
+    u64 hits;
+    u64 missed; // calls that bypassed the detours, untrackable
+    u64 hist[OMNI_HIST_BUCKETS];
+} ____cacheline_aligned;
+
+struct omni_stats {
+    struct omni_cpu_stats __percpu *cpu;
+    struct dentry *file;
+    void (*show)(struct seq_file *m, void *priv); // prints the file
+    void *priv;
+};
+
+/* totals over all CPUs */
+struct omnihook_stats {
+    u64 hits;
+    u64 missed;
+    long inflight; // calls in the detours right now
+    u64 hist[OMNI_HIST_BUCKETS];
+};
+
+/* creates/removes the hooks directory under parent
+    (debugfs:omnihook-<module>) */
+int
+omni_stats_init(struct dentry *parent);
+
+void
+omni_stats_exit(void);
+
+/* allocates the counters and publishes them under src, priv is handed to
+    show() along with the seq_file when the file is read */
+int
+omni_stats_create(struct omni_stats *s, void *src,
+    void (*show)(struct seq_file *m, void *priv), void *priv);
+
+/* waits out readers of the debugfs file */
+void
+omni_stats_destroy(struct omni_stats *s);
+
+void
+omni_stats_sum(struct omni_stats *s, /* out */ struct omnihook_stats *total);
+
+/* prints hits per CPU and the latency histogram */
+void
+omni_stats_show(struct seq_file *m, struct omni_stats *s);
+
+static inline void notrace
+omni_stats_hit(struct omni_stats *s)
+{
+    this_cpu_inc(s->cpu->hits);
+}
+
+static inline void notrace
+omni_stats_missed(struct omni_stats *s)
+{
+    this_cpu_inc(s->cpu->missed);
+}
+
+static inline void notrace
+omni_stats_latency(struct omni_stats *s, u64 cycles)
+{
+    unsigned int b = fls64(cycles);
+
+    this_cpu_inc(s->cpu->hist[min_t(unsigned int, b, OMNI_HIST_BUCKETS - 1)]);
+}
+
+#endif
@@ -0,0 +1,205 @@
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/version.h> /* LINUX_VERSION_CODE */
+#include <linux/list.h> /* list_head, etc. */
+#include <linux/slab.h> /* kmalloc(), kfree(), etc. */
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/kallsyms.h> /* kallsyms_on_each_symbol() */
+
+#include "omnihook.h"
+
+/* the wanted names, open addressing; a slot holds the index of the first
+    entry with that name + 1 (0: free) */
+struct sym_table {
+    struct omni_sym *syms;
+    int *slots;
+    unsigned int mask;
+    int left; // names not found yet
+};
+
+/* FNV-1a */
+static unsigned int
+sym_hash(const char *name)
+{
+    unsigned int h = 2166136261U;
+
+    while(*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    }
+
+    return h;
+}
+
+/* the slot name is in, or the free slot it would go in */
+static int *
+sym_slot(struct sym_table *t, const char *name)
+{
+    unsigned int i = sym_hash(name) & t->mask;
+
+    while(t->slots[i] && 0 != strcmp(t->syms[t->slots[i] - 1].name, name)) {
+        i = (i + 1) & t->mask;
+    }
+
+    return &t->slots[i];
+}
+
+/* kallsyms walk callback, stops the walk once every name is found */
+static int
+sym_visit(struct sym_table *t, const char *name, unsigned long addr)
+{
+    int *slot = sym_slot(t, name);
+    struct omni_sym *s;
+
+    if(!*slot) {
+        return 0;
+    }
+
+    s = &t->syms[*slot - 1];
+    if(!s->addr) {
+        s->addr = (void *)addr;
+        t->left--;
+    }
+
+    return t->left == 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static int
+sym_visit_cb(void *data, const char *name, unsigned long addr)
+{
+    return sym_visit(data, name, addr);
+}
+#else
+static int
+sym_visit_cb(void *data, const char *name, struct module *mod,
+    unsigned long addr)
+{
+    return sym_visit(data, name, addr);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// SYMS API
+//-----------------------------------------------------------------------------
+
+int
+omni_syms_resolve(struct omni_sym *syms, int count)
+{
+    int i, *slot, missing = 0;
+    unsigned int size;
+    struct sym_table t;
+
+    if(count <= 0) {
+        return 0;
+    }
+
+    /* at most half full */
+    for(size = 16; size < 2 * (unsigned int)count; size <<= 1);
+
+    t.syms = syms;
+    t.mask = size - 1;
+    t.left = 0;
+    t.slots = vzalloc(size * sizeof(int));
+    if(!t.slots) {
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        syms[i].addr = NULL;
+
+        slot = sym_slot(&t, syms[i].name);
+        if(!*slot) {
+            *slot = i + 1;
+            t.left++;
+        }
+    }
+
+    kallsyms_on_each_symbol(sym_visit_cb, &t);
+
+    for(i = 0; i < count; ++i) {
+        struct omni_sym *first = &syms[*sym_slot(&t, syms[i].name) - 1];
+
+        /* not in the walk, maybe a module's */
+        if(first == &syms[i] && !first->addr) {
+            first->addr = (void *)kallsyms_lookup_name(first->name);
+        }
+
+        syms[i].addr = first->addr;
+        if(!syms[i].addr) {
+            missing++;
+        }
+    }
+
+    vfree(t.slots);
+
+    return missing;
+}
+
+int
+omnihook_add_syms(struct omnihook_sym *syms, int count)
+{
+    int rc = -1, i, n = 0, failed = 0;
+    struct omni_sym *names = NULL;
+    omnihook_desc *descs = NULL;
+    int *which = NULL; // entry of each desc
+
+    if(count <= 0) {
+        return 0;
+    }
+
+    names = vmalloc(count * sizeof(*names));
+    descs = vmalloc(count * sizeof(*descs));
+    which = vmalloc(count * sizeof(*which));
+    if(!names || !descs || !which) {
+        goto cleanup;
+    }
+
+    for(i = 0; i < count; ++i) {
+        names[i].name = syms[i].name;
+    }
+
+    if(omni_syms_resolve(names, count) < 0) {
+        goto cleanup;
+    }
+
+    for(i = 0; i < count; ++i) {
+        syms[i].src = names[i].addr;
+
+        if(!syms[i].src) {
+            syms[i].error = OMNIHOOK_SYM_NOT_FOUND;
+            failed++;
+            continue;
+        }
+
+        syms[i].error = OMNIHOOK_SYM_OK;
+        descs[n].src = syms[i].src;
+        descs[n].dst = syms[i].dst;
+        descs[n].trampoline = syms[i].trampoline;
+        descs[n].priority = syms[i].priority;
+        which[n++] = i;
+    }
+
+    /* one patching pass for the lot, unless one of them is refused */
+    if(n && 0 != omnihook_add_batch(descs, n)) {
+        for(i = 0; i < n; ++i) {
+            if(0 != omnihook_add_batch(&descs[i], 1)) {
+                syms[which[i]].error = OMNIHOOK_SYM_HOOK_FAILED;
+                failed++;
+            }
+        }
+    }
+
+    rc = failed;
+
+    cleanup:
+    vfree(which);
+    vfree(descs);
+    vfree(names);
+
+    return rc;
+}
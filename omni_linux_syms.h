@@ -0,0 +1,46 @@
+#ifndef OMNI_LINUX_SYMS_H
+#define OMNI_LINUX_SYMS_H
+
+/* bulk symbol resolution: kallsyms_lookup_name() scans the symbol table
+    once per name, so hundreds of names (a few hundred sites hooked at module
+    init) cost hundreds of scans; here the wanted names go into a hash and
+    the table is walked once for all of them
+
+    names the walk doesn't see (symbols of modules, on kernels where the walk
+    is vmlinux only) are looked up one by one afterwards */
+
+struct omni_sym {
+    const char *name;
+    void *addr; // out, NULL if not found
+};
+
+/* returns how many names weren't found (0: all of them were), -1 if out of
+    memory; a name that is in several times resolves to the same address,
+    the first symbol of that name, like kallsyms_lookup_name() */
+int
+omni_syms_resolve(struct omni_sym *syms, int count);
+
+/* one entry of omnihook_add_syms() */
+struct omnihook_sym {
+    const char *name;
+    void *dst;
+    void **trampoline; // out
+    int priority;
+    void *src; // out, the address hooked
+    int error; // out, OMNIHOOK_SYM_*
+};
+
+#define OMNIHOOK_SYM_OK 0
+#define OMNIHOOK_SYM_NOT_FOUND 1 /* no such symbol */
+#define OMNIHOOK_SYM_HOOK_FAILED 2 /* found, omnihook_add() refused it (see the event log) */
+
+/* resolves every name in one pass and hooks all that were found in one
+    batch; if the batch fails they're added one at a time instead, so every
+    entry gets its own error and all the others still get hooked
+
+    returns how many entries weren't hooked, -1 if out of memory (nothing
+    hooked) */
+int
+omnihook_add_syms(struct omnihook_sym *syms, int count);
+
+#endif
@@ -0,0 +1,1043 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "omni_linux_user_amd64.h"
+
+/* serializes everything that changes hooks */
+static pthread_mutex_t hooks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//-----------------------------------------------------------------------------
+// TRAMPOLINE POOL
+//-----------------------------------------------------------------------------
+
+/* trampolines are fixed size slots carved from RWX chunks mapped near the
+    text they serve, so relocated RIP-relative operands and jumps back stay
+    rel32; a free slot links through its first word, a chunk's first slot
+    holds its header and chunks are aligned to their size, so a slot finds
+    its chunk by masking */
+#define POOL_CHUNK_SIZE (64 * 1024)
+#define POOL_SLOT_SIZE 64
+#define POOL_REACH ((1UL << 31) - POOL_CHUNK_SIZE)
+/* where new chunks are tried, on either side of the text */
+#define POOL_HINT_STEP (16UL << 20)
+#define POOL_HINT_TRIES 128
+
+struct pool_chunk {
+    struct pool_chunk *next;
+    void *freelist;
+    uint8_t *bump; // next never used slot
+    unsigned int used;
+};
+
+static struct pool_chunk *pool_chunks;
+static unsigned long pool_nchunks;
+static unsigned long pool_used;
+
+static int
+pool_in_reach(void *chunk, void *near)
+{
+    uintptr_t a = (uintptr_t)chunk, b = (uintptr_t)near;
+
+    return !near || (a > b ? a - b : b - a) < POOL_REACH;
+}
+
+/* one chunk, aligned to its size, at (or at least near) hint */
+static struct pool_chunk *
+pool_map(uintptr_t hint)
+{
+    uint8_t *raw, *chunk;
+
+    raw = mmap((void *)hint, 2 * POOL_CHUNK_SIZE,
+        PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    chunk = (uint8_t *)(((uintptr_t)raw + POOL_CHUNK_SIZE - 1) &
+        ~(uintptr_t)(POOL_CHUNK_SIZE - 1));
+    if(chunk != raw) {
+        munmap(raw, chunk - raw);
+    }
+    munmap(chunk + POOL_CHUNK_SIZE, raw + POOL_CHUNK_SIZE - chunk);
+
+    return (struct pool_chunk *)chunk;
+}
+
+static struct pool_chunk *
+pool_grow(void *near)
+{
+    int i;
+    uintptr_t base = (uintptr_t)near & ~(uintptr_t)(POOL_CHUNK_SIZE - 1);
+    struct pool_chunk *chunk = NULL;
+
+    /* below the text first (where nothing else tends to be mapped), then
+        above it; anywhere at all if nothing near is free */
+    for(i = 1; near && i <= 2 * POOL_HINT_TRIES; ++i) {
+        uintptr_t step = (uintptr_t)((i + 1) / 2) * POOL_HINT_STEP;
+
+        if(i & 1) {
+            if(base < step) continue;
+            chunk = pool_map(base - step);
+        }
+        else {
+            chunk = pool_map(base + step);
+        }
+
+        if(chunk && pool_in_reach(chunk, near)) {
+            break;
+        }
+
+        if(chunk) {
+            munmap(chunk, POOL_CHUNK_SIZE);
+            chunk = NULL;
+        }
+    }
+
+    if(!chunk) {
+        chunk = pool_map(0);
+        if(!chunk) {
+            return NULL;
+        }
+    }
+
+    chunk->next = pool_chunks;
+    chunk->freelist = NULL;
+    chunk->bump = (uint8_t *)chunk + POOL_SLOT_SIZE;
+    chunk->used = 0;
+    pool_chunks = chunk;
+    pool_nchunks++;
+
+    return chunk;
+}
+
+/* near (optional) is the text the slot will jump to/from; a slot out of its
+    reach is still handed out if no near chunk can be mapped */
+static void *
+pool_alloc(void *near)
+{
+    void *slot;
+    struct pool_chunk *chunk;
+
+    for(chunk = pool_chunks; chunk; chunk = chunk->next) {
+        if((chunk->freelist || chunk->bump != (uint8_t *)chunk + POOL_CHUNK_SIZE)
+          && pool_in_reach(chunk, near)) {
+            break;
+        }
+    }
+
+    if(!chunk) {
+        chunk = pool_grow(near);
+        if(!chunk) {
+            return NULL;
+        }
+    }
+
+    if(chunk->freelist) {
+        slot = chunk->freelist;
+        chunk->freelist = *(void **)slot;
+    }
+    else if(chunk->bump != (uint8_t *)chunk + POOL_CHUNK_SIZE) {
+        slot = chunk->bump;
+        chunk->bump += POOL_SLOT_SIZE;
+    }
+    else {
+        /* the fallback chunk from pool_grow() was full too */
+        return NULL;
+    }
+
+    chunk->used++;
+    pool_used++;
+
+    return slot;
+}
+
+static void
+pool_release(void *slot)
+{
+    struct pool_chunk *chunk = (struct pool_chunk *)((uintptr_t)slot &
+        ~(uintptr_t)(POOL_CHUNK_SIZE - 1));
+
+    *(void **)slot = chunk->freelist;
+    chunk->freelist = slot;
+    chunk->used--;
+    pool_used--;
+}
+
+static void
+pool_destroy(void)
+{
+    struct pool_chunk *chunk, *next;
+
+    for(chunk = pool_chunks; chunk; chunk = next) {
+        next = chunk->next;
+        munmap(chunk, POOL_CHUNK_SIZE);
+    }
+
+    pool_chunks = NULL;
+    pool_nchunks = pool_used = 0;
+}
+
+//-----------------------------------------------------------------------------
+// HOOK TABLE
+//-----------------------------------------------------------------------------
+
+/* hooks hashed by src, the table doubles when it averages one per bucket */
+#define TABLE_MIN_BUCKETS 1024
+
+static hook **table;
+static unsigned long table_size;
+static unsigned long table_count;
+
+static unsigned long
+table_hash(void *src, unsigned long size)
+{
+    return (((uintptr_t)src) * 0x9e3779b97f4a7c15ULL >> 20) & (size - 1);
+}
+
+static int
+table_grow(void)
+{
+    unsigned long i, size = table_size ? table_size * 2 : TABLE_MIN_BUCKETS;
+    hook **buckets, *h, *next;
+
+    buckets = calloc(size, sizeof(hook *));
+    if(!buckets) {
+        return -1;
+    }
+
+    for(i = 0; i < table_size; ++i) {
+        for(h = table[i]; h; h = next) {
+            next = h->next;
+            h->next = buckets[table_hash(h->src, size)];
+            buckets[table_hash(h->src, size)] = h;
+        }
+    }
+
+    free(table);
+    table = buckets;
+    table_size = size;
+
+    return 0;
+}
+
+static hook *
+table_find(void *src)
+{
+    hook *h;
+
+    if(!table_size) {
+        return NULL;
+    }
+
+    for(h = table[table_hash(src, table_size)]; h; h = h->next) {
+        if(h->src == src) {
+            return h;
+        }
+    }
+
+    return NULL;
+}
+
+/* src + stolen bytes may not overlap another hook's; hooks are never longer
+    than HOOK_MAX_STOLEN, so only that far back needs looking at */
+static hook *
+table_overlap(void *src, unsigned int len)
+{
+    int i;
+    hook *h;
+
+    for(i = -(HOOK_MAX_STOLEN - 1); i < (int)len; ++i) {
+        h = table_find((uint8_t *)src + i);
+        if(h && i + (int)h->stolen_len > 0) {
+            return h;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+table_insert(hook *h)
+{
+    unsigned long b;
+
+    if(table_count >= table_size && 0 != table_grow()) {
+        return -1;
+    }
+
+    b = table_hash(h->src, table_size);
+    h->next = table[b];
+    table[b] = h;
+    table_count++;
+
+    return 0;
+}
+
+static void
+table_remove(hook *h)
+{
+    hook **link = &table[table_hash(h->src, table_size)];
+
+    while(*link != h) {
+        link = &(*link)->next;
+    }
+
+    *link = h->next;
+    table_count--;
+}
+
+//-----------------------------------------------------------------------------
+// TEXT WRITES
+//-----------------------------------------------------------------------------
+
+/* text is made writable only for the write and given back its protection
+    from /proc/self/maps; everything here is raw syscalls, it runs while
+    other threads are parked, possibly holding the malloc or stdio locks */
+
+static unsigned long
+maps_hex(const char **p)
+{
+    unsigned long v = 0;
+
+    for(;; ++*p) {
+        char c = **p;
+
+        if(c >= '0' && c <= '9') v = v * 16 + (c - '0');
+        else if(c >= 'a' && c <= 'f') v = v * 16 + (c - 'a' + 10);
+        else break;
+    }
+
+    return v;
+}
+
+/* protection of the mapping holding addr, -1 if it isn't mapped */
+static int
+text_prot(uintptr_t addr)
+{
+    int fd, prot = -1;
+    ssize_t n;
+    size_t have = 0;
+    char buf[4096], *eol;
+
+    fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+
+    while(prot < 0) {
+        n = read(fd, buf + have, sizeof(buf) - have);
+        if(n <= 0) {
+            break;
+        }
+        have += n;
+
+        /* every whole line: <start>-<end> <rwxp> ... */
+        while(prot < 0 && (eol = memchr(buf, '\n', have))) {
+            const char *p = buf;
+            unsigned long start, end;
+
+            start = maps_hex(&p);
+            p++;
+            end = maps_hex(&p);
+            p++;
+
+            if(addr >= start && addr < end) {
+                prot = (p[0] == 'r' ? PROT_READ : 0) |
+                    (p[1] == 'w' ? PROT_WRITE : 0) |
+                    (p[2] == 'x' ? PROT_EXEC : 0);
+            }
+
+            have -= eol + 1 - buf;
+            memmove(buf, eol + 1, have);
+        }
+    }
+
+    close(fd);
+
+    return prot;
+}
+
+struct text_span {
+    uintptr_t page[2]; // first and last page touched
+    int prot[2];
+};
+
+static int
+text_span_init(struct text_span *span, void *addr, unsigned int len)
+{
+    int i;
+    uintptr_t mask = ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+
+    span->page[0] = (uintptr_t)addr & mask;
+    span->page[1] = ((uintptr_t)addr + len - 1) & mask;
+
+    for(i = 0; i < 2; ++i) {
+        span->prot[i] = (i && span->page[1] == span->page[0]) ?
+            span->prot[0] : text_prot(span->page[i]);
+        if(span->prot[i] < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+text_write(struct text_span *span, void *addr, const void *bytes,
+    unsigned int len)
+{
+    int i, rc = -1;
+    long page = sysconf(_SC_PAGESIZE);
+
+    for(i = 0; i < 2; ++i) {
+        if(!(span->prot[i] & PROT_WRITE) && 0 != mprotect((void *)span->page[i],
+          page, span->prot[i] | PROT_WRITE | PROT_EXEC)) {
+            goto cleanup;
+        }
+    }
+
+    memcpy(addr, bytes, len);
+
+    rc = 0;
+
+    cleanup:
+    for(i = 0; i < 2; ++i) {
+        if(!(span->prot[i] & PROT_WRITE)) {
+            mprotect((void *)span->page[i], page, span->prot[i]);
+        }
+    }
+
+    return rc;
+}
+
+//-----------------------------------------------------------------------------
+// THREAD PARKING
+//-----------------------------------------------------------------------------
+
+/* while a site is written every other thread of the process is parked in a
+    signal handler; one stopped inside the bytes being replaced is moved to
+    the matching instruction of the trampoline (or back, when unhooking)
+    before it resumes, so no thread ever runs half old, half new code
+
+    the signal must not be blocked by any thread that can run hooked code;
+    define OMNIHOOK_PARK_SIGNAL if the default is taken */
+#ifndef OMNIHOOK_PARK_SIGNAL
+#define OMNIHOOK_PARK_SIGNAL (SIGRTMIN + 7)
+#endif
+
+#define PARK_MAX_THREADS 4096
+#define PARK_TIMEOUT_MS 1000
+
+/* park slot states */
+#define PARK_SENT 1 /* signalled, not parked yet */
+#define PARK_PARKED 2 /* in the handler, waiting */
+#define PARK_DONE 3 /* released (or gone) */
+
+struct park_slot {
+    pid_t tid;
+    int state;
+    uintptr_t ip; // where it was stopped
+    uintptr_t new_ip; // where it resumes, 0: where it was
+};
+
+static struct park_slot park_slots[PARK_MAX_THREADS];
+static int park_count;
+static unsigned long park_gen; // odd while threads are being parked
+static pthread_once_t park_once = PTHREAD_ONCE_INIT;
+static int park_ready;
+
+static void
+park_handler(int sig, siginfo_t *info, void *context)
+{
+    int i, saved_errno = errno;
+    unsigned long gen = __atomic_load_n(&park_gen, __ATOMIC_ACQUIRE);
+    pid_t tid = syscall(SYS_gettid);
+    ucontext_t *uc = context;
+    struct park_slot *slot = NULL;
+    int expected = PARK_SENT;
+
+    (void)sig;
+    (void)info;
+
+    /* late signal from a round that gave up */
+    if(!(gen & 1)) {
+        return;
+    }
+
+    for(i = 0; i < __atomic_load_n(&park_count, __ATOMIC_ACQUIRE); ++i) {
+        if(park_slots[i].tid == tid) {
+            slot = &park_slots[i];
+            break;
+        }
+    }
+
+    if(!slot) {
+        return;
+    }
+
+    slot->ip = uc->uc_mcontext.gregs[REG_RIP];
+    if(!__atomic_compare_exchange_n(&slot->state, &expected, PARK_PARKED, 0,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    while(__atomic_load_n(&park_gen, __ATOMIC_ACQUIRE) == gen) {
+        sched_yield();
+    }
+
+    if(slot->new_ip) {
+        uc->uc_mcontext.gregs[REG_RIP] = slot->new_ip;
+    }
+
+    __atomic_store_n(&slot->state, PARK_DONE, __ATOMIC_RELEASE);
+
+    errno = saved_errno;
+}
+
+static void
+park_init(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = park_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigfillset(&sa.sa_mask);
+
+    park_ready = (0 == sigaction(OMNIHOOK_PARK_SIGNAL, &sa, NULL));
+}
+
+static double
+park_now_ms(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/* signals every thread of the process not signalled yet, returns how many
+    new ones it found (-1 on error) */
+static int
+park_scan(pid_t self)
+{
+    int fd, i, found = 0;
+    long n, off;
+    char buf[4096];
+    pid_t pid = getpid();
+
+    fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+
+    while((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for(off = 0; off < n; ) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            pid_t tid = (pid_t)atoi(d->d_name);
+
+            off += d->d_reclen;
+
+            if(tid <= 0 || tid == self) {
+                continue;
+            }
+
+            for(i = 0; i < park_count; ++i) {
+                if(park_slots[i].tid == tid) {
+                    break;
+                }
+            }
+            if(i != park_count) {
+                continue;
+            }
+
+            if(park_count == PARK_MAX_THREADS) {
+                close(fd);
+                return -1;
+            }
+
+            park_slots[i].tid = tid;
+            park_slots[i].ip = 0;
+            park_slots[i].new_ip = 0;
+            park_slots[i].state = PARK_SENT;
+            __atomic_store_n(&park_count, i + 1, __ATOMIC_RELEASE);
+
+            if(0 != syscall(SYS_tgkill, pid, tid, OMNIHOOK_PARK_SIGNAL)) {
+                park_slots[i].state = PARK_DONE; // exited meanwhile
+            }
+
+            found++;
+        }
+    }
+
+    close(fd);
+
+    return n < 0 ? -1 : found;
+}
+
+static void
+park_release(void)
+{
+    int i;
+
+    __atomic_add_fetch(&park_gen, 1, __ATOMIC_RELEASE);
+
+    /* the slots are reused by the next round, let everyone read theirs */
+    for(i = 0; i < park_count; ++i) {
+        while(__atomic_load_n(&park_slots[i].state, __ATOMIC_ACQUIRE) ==
+          PARK_PARKED) {
+            sched_yield();
+        }
+    }
+
+    __atomic_store_n(&park_count, 0, __ATOMIC_RELEASE);
+}
+
+/* parks every other thread, until no new thread shows up */
+static int
+park_all(void)
+{
+    int i, n, waiting;
+    double start;
+    pid_t self = syscall(SYS_gettid), pid = getpid();
+
+    pthread_once(&park_once, park_init);
+    if(!park_ready) {
+        return -1;
+    }
+
+    park_count = 0;
+    __atomic_add_fetch(&park_gen, 1, __ATOMIC_RELEASE);
+
+    start = park_now_ms();
+
+    do {
+        n = park_scan(self);
+        if(n < 0) {
+            goto fail;
+        }
+
+        do {
+            waiting = 0;
+            for(i = 0; i < park_count; ++i) {
+                struct park_slot *slot = &park_slots[i];
+
+                if(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != PARK_SENT) {
+                    continue;
+                }
+
+                /* exited before taking the signal */
+                if(0 != syscall(SYS_tgkill, pid, slot->tid, 0)) {
+                    int expected = PARK_SENT;
+
+                    __atomic_compare_exchange_n(&slot->state, &expected,
+                        PARK_DONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+                    continue;
+                }
+
+                waiting = 1;
+            }
+
+            /* a thread blocking the signal, or stuck in the kernel */
+            if(waiting && park_now_ms() - start > PARK_TIMEOUT_MS) {
+                goto fail;
+            }
+
+            if(waiting) {
+                sched_yield();
+            }
+        } while(waiting);
+    } while(n);
+
+    return 0;
+
+    fail:
+    park_release();
+    return -1;
+}
+
+/* points parked threads stopped inside [from, from + len) somewhere else,
+    map returns the new address (0 to leave the thread be) */
+static void
+park_redirect(uintptr_t from, unsigned int len,
+    uintptr_t (*map)(hook *h, uintptr_t ip), hook *h)
+{
+    int i;
+
+    for(i = 0; i < park_count; ++i) {
+        struct park_slot *slot = &park_slots[i];
+
+        if(slot->state == PARK_PARKED && slot->ip >= from &&
+          slot->ip < from + len) {
+            slot->new_ip = map(h, slot->ip);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// HOOK CONSTRUCTION
+//-----------------------------------------------------------------------------
+
+static void
+hook_destroy(hook *h)
+{
+    if(h->trampoline) {
+        pool_release(h->trampoline);
+    }
+
+    if(h->relay) {
+        pool_release(h->relay);
+    }
+
+    free(h);
+}
+
+/* where an instruction boundary off bytes into the stolen code ended up in
+    the trampoline: relocating just the instructions before it says */
+static uintptr_t
+hook_tramp_offset(hook *h, unsigned int off)
+{
+    int n;
+    unsigned int stolen;
+    uint8_t tmp[POOL_SLOT_SIZE];
+
+    if(!off) {
+        return 0;
+    }
+
+    n = omni_x86_steal(h->stolen, (uintptr_t)h->src, off, tmp,
+        (uintptr_t)h->trampoline, sizeof(tmp), &stolen, 1);
+
+    return (n < 0 || stolen != off) ? (uintptr_t)-1 : (uintptr_t)n;
+}
+
+/* a thread stopped past the first byte of a site that is being hooked
+    continues at the same instruction in the trampoline */
+static uintptr_t
+hook_map_to_tramp(hook *h, uintptr_t ip)
+{
+    uintptr_t n = hook_tramp_offset(h, ip - (uintptr_t)h->src);
+
+    return n == (uintptr_t)-1 ? 0 : (uintptr_t)h->trampoline + n;
+}
+
+/* a thread stopped in the trampoline of a hook that is being removed
+    continues at the same instruction of the restored site */
+static uintptr_t
+hook_map_to_src(hook *h, uintptr_t ip)
+{
+    int len;
+    unsigned int off = 0;
+    struct x86_insn insn;
+
+    while(1) {
+        if(hook_tramp_offset(h, off) == ip - (uintptr_t)h->trampoline) {
+            return (uintptr_t)h->src + off;
+        }
+
+        if(off == h->stolen_len) {
+            return 0;
+        }
+
+        len = omni_x86_decode(h->stolen + off, 1, &insn);
+        if(len <= 0) {
+            return 0;
+        }
+        off += len;
+    }
+}
+
+static hook *
+hook_build(void *src, void *dst)
+{
+    int n;
+    hook *h;
+    uint8_t *tramp;
+
+    h = calloc(1, sizeof(hook));
+    if(!h) {
+        return NULL;
+    }
+
+    /* 1) save info about the source */
+    h->src = src;
+    h->dst = dst;
+    memcpy(h->stolen, src, sizeof(h->stolen));
+
+    /* a dst beyond rel32 reach (another library) is reached through a
+        relay slot near src, so the site stays a 5 byte JMP */
+    h->entry = dst;
+    if(omni_x86_jmp_len((uintptr_t)src, (uintptr_t)dst, 1) != X86_JMP_REL) {
+        h->relay = pool_alloc(src);
+        if(h->relay && omni_x86_jmp_len((uintptr_t)src, (uintptr_t)h->relay,
+          1) == X86_JMP_REL) {
+            omni_x86_jmp(h->relay, (uintptr_t)h->relay, (uintptr_t)dst, 1);
+            h->entry = h->relay;
+        }
+    }
+    h->jmp_len = omni_x86_jmp_len((uintptr_t)src, (uintptr_t)h->entry, 1);
+
+    /* 2) allocate, build the trampoline:
+        00: <whole instructions covering the JMP, relocated>
+        XX: <jump back to src + stolen_len> */
+    tramp = pool_alloc(src);
+    if(!tramp) {
+        goto fail;
+    }
+    h->trampoline = tramp;
+
+    n = omni_x86_steal(h->stolen, (uintptr_t)src, h->jmp_len, tramp,
+        (uintptr_t)tramp, POOL_SLOT_SIZE - X86_JMP_ABS, &h->stolen_len, 1);
+    if(n < 0) {
+        fprintf(stderr, "ERROR: can't relocate the instructions at %p\n", src);
+        goto fail;
+    }
+
+    h->tramp_len = n + omni_x86_jmp(tramp + n, (uintptr_t)tramp + n,
+        (uintptr_t)src + h->stolen_len, 1);
+
+    return h;
+
+    fail:
+    hook_destroy(h);
+    return NULL;
+}
+
+/* writes the JMP over the site, the tail of the last stolen instruction is
+    never executed again, make it trap; other threads are parked */
+static int
+hook_patch(hook *h, struct text_span *span)
+{
+    uint8_t code[HOOK_MAX_STOLEN];
+
+    /* site changed since its bytes were stolen */
+    if(memcmp(h->src, h->stolen, h->stolen_len)) {
+        return -1;
+    }
+
+    omni_x86_jmp(code, (uintptr_t)h->src, (uintptr_t)h->entry, 1);
+    memset(code + h->jmp_len, 0xcc, h->stolen_len - h->jmp_len);
+
+    if(0 != text_write(span, h->src, code, h->stolen_len)) {
+        return -1;
+    }
+
+    park_redirect((uintptr_t)h->src + 1, h->stolen_len - 1, hook_map_to_tramp,
+        h);
+
+    return 0;
+}
+
+static int
+hook_unpatch(hook *h, struct text_span *span)
+{
+    if(0 != text_write(span, h->src, h->stolen, h->stolen_len)) {
+        return -1;
+    }
+
+    park_redirect((uintptr_t)h->trampoline, h->tramp_len, hook_map_to_src, h);
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// HOOKLIB MAIN API
+//-----------------------------------------------------------------------------
+
+void
+omnihook_exit(void)
+{
+    pthread_mutex_lock(&hooks_lock);
+
+    free(table);
+    table = NULL;
+    table_size = table_count = 0;
+
+    pool_destroy();
+
+    pthread_mutex_unlock(&hooks_lock);
+}
+
+int
+omnihook_add(void *src, void *dst, /* out */ void **trampoline)
+{
+    int rc = -1;
+    hook *h = NULL;
+    struct text_span span;
+
+    pthread_mutex_lock(&hooks_lock);
+
+    h = hook_build(src, dst);
+    if(!h) {
+        goto cleanup;
+    }
+
+    if(table_overlap(src, h->stolen_len)) {
+        fprintf(stderr, "ERROR: %p overlaps an existing hook\n", src);
+        goto cleanup;
+    }
+
+    if(0 != text_span_init(&span, src, h->stolen_len) ||
+      0 != table_insert(h)) {
+        goto cleanup;
+    }
+
+    /* inform the caller before the detour can run */
+    *trampoline = h->trampoline;
+
+    if(0 != park_all()) {
+        fprintf(stderr, "ERROR: can't stop the other threads\n");
+        table_remove(h);
+        goto cleanup;
+    }
+
+    if(0 != hook_patch(h, &span)) {
+        park_release();
+        fprintf(stderr, "ERROR: can't write the site at %p\n", src);
+        table_remove(h);
+        goto cleanup;
+    }
+
+    park_release();
+
+    rc = 0;
+
+    cleanup:
+    if(0 != rc && h) {
+        *trampoline = NULL;
+        hook_destroy(h);
+    }
+
+    pthread_mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+hook *
+omnihook_find(void *src)
+{
+    hook *h;
+
+    pthread_mutex_lock(&hooks_lock);
+    h = table_find(src);
+    pthread_mutex_unlock(&hooks_lock);
+
+    return h;
+}
+
+int
+omnihook_remove(void *src)
+{
+    int rc = -1;
+    hook *h;
+    struct text_span span;
+
+    pthread_mutex_lock(&hooks_lock);
+
+    h = table_find(src);
+    if(!h || 0 != text_span_init(&span, src, h->stolen_len)) {
+        goto cleanup;
+    }
+
+    if(0 != park_all()) {
+        goto cleanup;
+    }
+
+    if(0 != hook_unpatch(h, &span)) {
+        park_release();
+        goto cleanup;
+    }
+
+    park_release();
+
+    table_remove(h);
+    hook_destroy(h);
+
+    rc = 0;
+
+    cleanup:
+    pthread_mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+/* every site is restored while the other threads are parked once; a site
+    that can't be written stays hooked (and fails the call) */
+int
+omnihook_remove_all(void)
+{
+    int rc = -1;
+    unsigned long i;
+    hook *h, **link, *done = NULL;
+    struct text_span span;
+
+    pthread_mutex_lock(&hooks_lock);
+
+    if(!table_count) {
+        rc = 0;
+        goto cleanup;
+    }
+
+    if(0 != park_all()) {
+        goto cleanup;
+    }
+
+    for(i = 0; i < table_size; ++i) {
+        for(link = &table[i]; (h = *link); ) {
+            if(0 != text_span_init(&span, h->src, h->stolen_len) ||
+              0 != hook_unpatch(h, &span)) {
+                link = &h->next;
+                continue;
+            }
+
+            *link = h->next;
+            table_count--;
+            h->next = done;
+            done = h;
+        }
+    }
+
+    park_release();
+
+    /* free() only once nobody is parked, they may hold the malloc lock */
+    for(h = done; h; h = done) {
+        done = h->next;
+        hook_destroy(h);
+    }
+
+    rc = table_count ? -1 : 0;
+
+    cleanup:
+    pthread_mutex_unlock(&hooks_lock);
+
+    return rc;
+}
+
+void
+omnihook_mem(/* out */ struct omnihook_mem *mem)
+{
+    pthread_mutex_lock(&hooks_lock);
+
+    mem->hooks = table_count;
+    mem->pool_bytes = pool_nchunks * POOL_CHUNK_SIZE;
+    mem->pool_used = pool_used * POOL_SLOT_SIZE;
+    mem->table_bytes = table_size * sizeof(hook *);
+    mem->hook_bytes = table_count * sizeof(hook);
+
+    pthread_mutex_unlock(&hooks_lock);
+}
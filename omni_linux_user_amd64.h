@@ -0,0 +1,72 @@
+#ifndef OMNI_LINUX_USER_AMD64_H
+#define OMNI_LINUX_USER_AMD64_H
+
+/* userspace (x86-64 linux) backend: hooks functions of the running process
+    the way omni_linux_i386_amd64.c hooks the kernel, same stolen
+    instructions, trampolines and jumps
+
+    - trampolines are carved from RWX pages mapped within rel32 reach of the
+      text they serve
+    - a site is made writable with mprotect() just for the write, then gets
+      its protection back
+    - every other thread is parked in a signal handler meanwhile, one caught
+      inside the bytes being replaced resumes at the same instruction in the
+      trampoline (or back in the restored site, when unhooking)
+
+    like on i386 and arm in the kernel, calls aren't tracked: don't remove a
+    hook while a call may still be inside its detour */
+
+#include <stdint.h>
+
+#include "omni_x86_lde.h"
+
+/* jmp rel32 written over src, or jmp *0(%rip) when dst is out of reach */
+#define HOOK_JMP_SIZE X86_JMP_REL
+#define HOOK_JMP_MAX X86_JMP_ABS
+/* whole instructions covering the JMP, at worst the last one starts at its
+    last byte */
+#define HOOK_MAX_STOLEN (HOOK_JMP_MAX + X86_MAX_INSN - 1)
+
+typedef struct hook_ {
+    struct hook_ *next; // hash chain
+    void *src; // address where JMP is written
+    void *dst;
+    void *entry; // what the JMP targets: dst, or relay
+    void *relay; // pool slot jumping to a dst out of rel32 reach
+    void *trampoline; // pool slot: stolen instructions, jump back
+    unsigned int tramp_len;
+    unsigned char stolen[HOOK_MAX_STOLEN]; // bytes stolen at JMP write location
+    unsigned int stolen_len; // whole instructions covering the JMP
+    unsigned int jmp_len; // HOOK_JMP_SIZE, or HOOK_JMP_MAX without a relay
+} hook;
+
+/* what the engine holds, for sizing it */
+struct omnihook_mem {
+    unsigned long hooks;
+    unsigned long pool_bytes; // executable pages mapped for trampolines
+    unsigned long pool_used; // of which handed out as slots
+    unsigned long table_bytes; // hash buckets
+    unsigned long hook_bytes; // struct hook, one per hook
+};
+
+/* releases everything, call after omnihook_remove_all() */
+void
+omnihook_exit(void);
+
+int
+omnihook_add(void *src, void *dst, /* out */ void **trampoline);
+
+int
+omnihook_remove(void *src);
+
+/* -1 if a site couldn't be restored, it stays hooked */
+int
+omnihook_remove_all(void);
+
+hook *
+omnihook_find(void *src);
+
+void
+omnihook_mem(/* out */ struct omnihook_mem *mem);
+
+#endif
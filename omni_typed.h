@@ -0,0 +1,280 @@
+#ifndef OMNI_TYPED_H
+#define OMNI_TYPED_H
+
+/* typed hook declarations, on top of any backend's omnihook_add(): the
+    trampoline is a pointer of the hooked function's type and the detour is
+    checked against that same type, so a signature mismatch is a compile
+    error instead of a corrupted stack
+
+    a detour (runs instead of the function, calls the original if it wants,
+    may look at/change arguments before and the return value after):
+
+        OMNIHOOK_DEFINE(input_event, void,
+            (struct input_dev *, unsigned int, unsigned int, int));
+
+        static void
+        OMNIHOOK_DETOUR(input_event)(struct input_dev *dev, unsigned int type,
+            unsigned int code, int value)
+        {
+            ...
+            OMNIHOOK_ORIG(input_event)(dev, type, code, value);
+            ...
+        }
+
+    a pre handler (an observer: sees the arguments, then the original runs
+    as if nothing had happened):
+
+        OMNIHOOK_DEFINE_PRE(input_event, void,
+            (struct input_dev *, unsigned int, unsigned int, int));
+
+        static void
+        OMNIHOOK_PRE(input_event)(struct input_dev *dev, unsigned int type,
+            unsigned int code, int value)
+        {
+            ...
+        }
+
+    a small thunk saves the argument registers, calls the handler, restores
+    them and jumps (not calls) to the trampoline, so the original returns
+    straight to its caller: one call for the handler, no second frame, no
+    re-call of the original; only register arguments are visible to it (six
+    on amd64, four on arm, eight on arm64), the original still gets all of them
+
+    an argument capture (a pre handler written for you: time, CPU, pid and
+    the first nargs argument registers go to the capture rings, see
+    omni_linux_capture.h):
+
+        OMNIHOOK_DEFINE_CAPTURE(input_event, void,
+            (struct input_dev *, unsigned int, unsigned int, int), 4);
+
+    any way:
+
+        OMNIHOOK_ADD(input_event, addr); // addr from kallsyms, unchecked
+        OMNIHOOK_ADD_SYM(input_event, input_event); // checked against the symbol
+        OMNIHOOK_REMOVE(input_event, addr); // kernel backends with detour chains */
+
+#include "omnihook.h"
+#if defined(__linux__) && defined(__KERNEL__)
+#include "omni_linux_capture.h"
+#endif
+
+/* fails to compile unless sym's type is the one name was defined with */
+#define OMNIHOOK_CHECK(name, sym) \
+    ((void)sizeof(char[__builtin_types_compatible_p(__typeof__(&(sym)), \
+        omnihook_fn_##name) ? 1 : -1]))
+
+#define OMNIHOOK_ORIG(name) omnihook_orig_##name
+
+#define OMNIHOOK_DETOUR(name) omnihook_detour_##name
+
+#define OMNIHOOK_PRE(name) omnihook_pre_##name
+
+#define OMNIHOOK_ADD(name, src) omnihook_add_##name((void *)(src))
+
+#define OMNIHOOK_ADD_SYM(name, sym) \
+    (OMNIHOOK_CHECK(name, sym), omnihook_add_##name((void *)&(sym)))
+
+#define OMNIHOOK_REMOVE(name, src) \
+    omnihook_remove_detour((void *)(src), omnihook_dst_##name())
+
+#define OMNIHOOK_DEFINE(name, ret, params) \
+    typedef ret (*omnihook_fn_##name) params; \
+    static omnihook_fn_##name omnihook_orig_##name; \
+    static ret omnihook_detour_##name params; \
+    static inline void * \
+    omnihook_dst_##name(void) \
+    { \
+        return (void *)omnihook_detour_##name; \
+    } \
+    static inline int \
+    omnihook_add_##name(void *src) \
+    { \
+        return omnihook_add(src, omnihook_dst_##name(), \
+            (void **)&omnihook_orig_##name); \
+    }
+
+/* the thunk and the two pointers it goes through must be global, they're
+    referenced from assembly by name */
+#define OMNIHOOK_DEFINE_PRE(name, ret, params) \
+    typedef ret (*omnihook_fn_##name) params; \
+    omnihook_fn_##name omnihook_orig_##name; \
+    static void omnihook_pre_##name params; \
+    void (*omnihook_prefn_##name) params = omnihook_pre_##name; \
+    extern char omnihook_thunk_##name[]; \
+    OMNIHOOK_THUNK(name) \
+    static inline void * \
+    omnihook_dst_##name(void) \
+    { \
+        return omnihook_thunk_##name; \
+    } \
+    static inline int \
+    omnihook_add_##name(void *src) \
+    { \
+        return omnihook_add(src, omnihook_dst_##name(), \
+            (void **)&omnihook_orig_##name); \
+    }
+
+/* the handler takes the raw argument registers, whatever their types; src is
+    kept for the records */
+#define OMNIHOOK_DEFINE_CAPTURE(name, ret, params, nargs) \
+    typedef ret (*omnihook_fn_##name) params; \
+    omnihook_fn_##name omnihook_orig_##name; \
+    static void *omnihook_capsrc_##name; \
+    static void \
+    omnihook_capture_##name OMNIHOOK_THUNK_PARAMS \
+    { \
+        const unsigned long args[] = OMNIHOOK_THUNK_ARGS; \
+        _Static_assert((nargs) <= sizeof(args) / sizeof(args[0]), \
+            "more arguments than the thunk saves"); \
+        omni_capture_record(omnihook_capsrc_##name, args, (nargs)); \
+    } \
+    void (*omnihook_prefn_##name) OMNIHOOK_THUNK_PARAMS = \
+        omnihook_capture_##name; \
+    extern char omnihook_thunk_##name[]; \
+    OMNIHOOK_THUNK(name) \
+    static inline void * \
+    omnihook_dst_##name(void) \
+    { \
+        return omnihook_thunk_##name; \
+    } \
+    static inline int \
+    omnihook_add_##name(void *src) \
+    { \
+        omnihook_capsrc_##name = src; \
+        return omnihook_add(src, omnihook_dst_##name(), \
+            (void **)&omnihook_orig_##name); \
+    }
+
+//-----------------------------------------------------------------------------
+// PRE HANDLER THUNKS
+//-----------------------------------------------------------------------------
+
+#if defined(__amd64__)
+/* entered by a link's jmp * with the caller's stack untouched (endbr64
+    lands it under IBT); seven pushes keep the handler's call 16 byte aligned (plus the vector argument
+    registers outside the kernel, where the handler may use them) */
+#if defined(__KERNEL__)
+#define OMNIHOOK_THUNK_SAVE_VEC ""
+#define OMNIHOOK_THUNK_RESTORE_VEC ""
+#else
+#define OMNIHOOK_THUNK_SAVE_VEC \
+    "    sub $128, %rsp\n" \
+    "    movdqu %xmm0, 0(%rsp)\n" \
+    "    movdqu %xmm1, 16(%rsp)\n" \
+    "    movdqu %xmm2, 32(%rsp)\n" \
+    "    movdqu %xmm3, 48(%rsp)\n" \
+    "    movdqu %xmm4, 64(%rsp)\n" \
+    "    movdqu %xmm5, 80(%rsp)\n" \
+    "    movdqu %xmm6, 96(%rsp)\n" \
+    "    movdqu %xmm7, 112(%rsp)\n"
+#define OMNIHOOK_THUNK_RESTORE_VEC \
+    "    movdqu 0(%rsp), %xmm0\n" \
+    "    movdqu 16(%rsp), %xmm1\n" \
+    "    movdqu 32(%rsp), %xmm2\n" \
+    "    movdqu 48(%rsp), %xmm3\n" \
+    "    movdqu 64(%rsp), %xmm4\n" \
+    "    movdqu 80(%rsp), %xmm5\n" \
+    "    movdqu 96(%rsp), %xmm6\n" \
+    "    movdqu 112(%rsp), %xmm7\n" \
+    "    add $128, %rsp\n"
+#endif
+
+#define OMNIHOOK_THUNK_PARAMS \
+    (unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3, \
+    unsigned long a4, unsigned long a5)
+#define OMNIHOOK_THUNK_ARGS { a0, a1, a2, a3, a4, a5 }
+
+#define OMNIHOOK_THUNK(name) \
+    asm( \
+        ".pushsection .text\n" \
+        ".globl omnihook_thunk_" #name "\n" \
+        "omnihook_thunk_" #name ":\n" \
+        "    endbr64\n" \
+        "    push %rdi\n" \
+        "    push %rsi\n" \
+        "    push %rdx\n" \
+        "    push %rcx\n" \
+        "    push %r8\n" \
+        "    push %r9\n" \
+        "    push %rax\n" /* vector register count of varargs calls */ \
+        OMNIHOOK_THUNK_SAVE_VEC \
+        "    call *omnihook_prefn_" #name "(%rip)\n" \
+        OMNIHOOK_THUNK_RESTORE_VEC \
+        "    pop %rax\n" \
+        "    pop %r9\n" \
+        "    pop %r8\n" \
+        "    pop %rcx\n" \
+        "    pop %rdx\n" \
+        "    pop %rsi\n" \
+        "    pop %rdi\n" \
+        "    jmp *omnihook_orig_" #name "(%rip)\n" \
+        ".popsection\n" \
+    );
+#elif defined(__arm__)
+#define OMNIHOOK_THUNK_PARAMS \
+    (unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3)
+#define OMNIHOOK_THUNK_ARGS { a0, a1, a2, a3 }
+
+/* six registers keep the stack 8 byte aligned for the handler */
+#define OMNIHOOK_THUNK(name) \
+    asm( \
+        ".pushsection .text\n" \
+        ".arm\n" \
+        ".globl omnihook_thunk_" #name "\n" \
+        "omnihook_thunk_" #name ":\n" \
+        "    push {r0-r3, ip, lr}\n" \
+        "    ldr ip, =omnihook_prefn_" #name "\n" \
+        "    ldr ip, [ip]\n" \
+        "    blx ip\n" \
+        "    pop {r0-r3, ip, lr}\n" \
+        "    ldr ip, =omnihook_orig_" #name "\n" \
+        "    ldr pc, [ip]\n" \
+        ".ltorg\n" \
+        ".popsection\n" \
+    );
+#elif defined(__aarch64__)
+#define OMNIHOOK_THUNK_PARAMS \
+    (unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3, \
+    unsigned long a4, unsigned long a5, unsigned long a6, unsigned long a7)
+#define OMNIHOOK_THUNK_ARGS { a0, a1, a2, a3, a4, a5, a6, a7 }
+
+/* x0-x7 and x8 (indirect result) with the frame record, 16 byte aligned;
+    bti c lands both blr and the link's br x16 */
+#define OMNIHOOK_THUNK(name) \
+    asm( \
+        ".pushsection .text\n" \
+        ".globl omnihook_thunk_" #name "\n" \
+        ".balign 4\n" \
+        "omnihook_thunk_" #name ":\n" \
+        "    hint #34\n" /* bti c */ \
+        "    stp x29, x30, [sp, #-96]!\n" \
+        "    mov x29, sp\n" \
+        "    stp x0, x1, [sp, #16]\n" \
+        "    stp x2, x3, [sp, #32]\n" \
+        "    stp x4, x5, [sp, #48]\n" \
+        "    stp x6, x7, [sp, #64]\n" \
+        "    str x8, [sp, #80]\n" \
+        "    adrp x16, omnihook_prefn_" #name "\n" \
+        "    ldr x16, [x16, :lo12:omnihook_prefn_" #name "]\n" \
+        "    blr x16\n" \
+        "    ldr x8, [sp, #80]\n" \
+        "    ldp x6, x7, [sp, #64]\n" \
+        "    ldp x4, x5, [sp, #48]\n" \
+        "    ldp x2, x3, [sp, #32]\n" \
+        "    ldp x0, x1, [sp, #16]\n" \
+        "    ldp x29, x30, [sp], #96\n" \
+        "    adrp x16, omnihook_orig_" #name "\n" \
+        "    ldr x16, [x16, :lo12:omnihook_orig_" #name "]\n" \
+        "    br x16\n" \
+        ".popsection\n" \
+    );
+#else
+#define OMNIHOOK_THUNK_PARAMS (unsigned long a0)
+#define OMNIHOOK_THUNK_ARGS { a0 }
+
+#define OMNIHOOK_THUNK(name) \
+    _Static_assert(0, "pre handlers have no thunk for this architecture, " \
+        "use OMNIHOOK_DEFINE() and call the original from the detour");
+#endif
+
+#endif
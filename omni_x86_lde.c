@@ -0,0 +1,464 @@
+#if defined(__linux__) && defined(__KERNEL__)
+#include <linux/types.h>
+#include <linux/string.h> /* memcpy(), memset() */
+#elif defined(__FreeBSD__) && defined(_KERNEL)
+#include <sys/types.h>
+#include <sys/systm.h> /* memcpy(), memset() */
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#include "omni_x86_lde.h"
+
+/* opcode flags */
+#define M 0x01 /* has ModRM */
+#define I8 0x02 /* imm8 */
+#define I16 0x04 /* imm16 */
+#define IZ 0x08 /* imm16 or imm32 by operand size */
+#define R8 0x10 /* rel8 */
+#define RZ 0x20 /* rel16 or rel32 by operand size */
+#define S 0x40 /* special, decoded by hand */
+
+/* one byte opcodes */
+static const uint8_t x86_map0[256] = {
+    /* 0_ */ M, M, M, M, I8, IZ, 0, 0, M, M, M, M, I8, IZ, 0, S,
+    /* 1_ */ M, M, M, M, I8, IZ, 0, 0, M, M, M, M, I8, IZ, 0, 0,
+    /* 2_ */ M, M, M, M, I8, IZ, S, 0, M, M, M, M, I8, IZ, S, 0,
+    /* 3_ */ M, M, M, M, I8, IZ, S, 0, M, M, M, M, I8, IZ, S, 0,
+    /* 4_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 5_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 6_ */ 0, 0, M|S, M, S, S, S, S, IZ, M|IZ, I8, M|I8, 0, 0, 0, 0,
+    /* 7_ */ R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8,
+    /* 8_ */ M|I8, M|IZ, M|I8, M|I8, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 9_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, 0, 0, 0, 0,
+    /* A_ */ S, S, S, S, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+    /* B_ */ I8, I8, I8, I8, I8, I8, I8, I8, S, S, S, S, S, S, S, S,
+    /* C_ */ M|I8, M|I8, I16, 0, M|S, M|S, M|I8, M|IZ, S, 0, I16, 0, 0, I8, 0, 0,
+    /* D_ */ M, M, M, M, I8, I8, 0, 0, M, M, M, M, M, M, M, M,
+    /* E_ */ R8, R8, R8, R8, I8, I8, I8, I8, RZ, RZ, S, R8, 0, 0, 0, 0,
+    /* F_ */ S, 0, S, S, 0, 0, M|S, M|S, 0, 0, 0, 0, 0, 0, M, M
+};
+
+/* two byte opcodes (0f xx) */
+static const uint8_t x86_map1[256] = {
+    /* 0_ */ M, M, M, M, 0, 0, 0, 0, 0, 0, 0, 0, 0, M, 0, M|I8,
+    /* 1_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 2_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 3_ */ 0, 0, 0, 0, 0, 0, 0, 0, S, M, S, M, M, M, M, M,
+    /* 4_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 5_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 6_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 7_ */ M|I8, M|I8, M|I8, M|I8, M, M, M, 0, M, M, M, M, M, M, M, M,
+    /* 8_ */ RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ,
+    /* 9_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* A_ */ 0, 0, 0, M, M|I8, M, M, M, 0, 0, 0, M, M|I8, M, M, M,
+    /* B_ */ M, M, M, M, M, M, M, M, M, M, M|I8, M, M, M, M, M,
+    /* C_ */ M, M, M|I8, M, M|I8, M|I8, M|I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* E_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* F_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M
+};
+
+//-----------------------------------------------------------------------------
+// LENGTH DISASSEMBLER
+//-----------------------------------------------------------------------------
+
+static int
+x86_is_prefix(uint8_t b)
+{
+    switch(b) {
+        case 0x26: case 0x2e: case 0x36: case 0x3e: /* segment */
+        case 0x64: case 0x65:
+        case 0x66: case 0x67: /* operand, address size */
+        case 0xf0: case 0xf2: case 0xf3: /* lock, rep */
+            return 1;
+    }
+
+    return 0;
+}
+
+/* one byte opcodes that don't exist in long mode */
+static int
+x86_invalid64(uint8_t op)
+{
+    switch(op) {
+        case 0x06: case 0x07: case 0x0e: case 0x16: case 0x17: case 0x1e:
+        case 0x1f: case 0x27: case 0x2f: case 0x37: case 0x3f: case 0x60:
+        case 0x61: case 0x82: case 0x9a: case 0xce: case 0xd4: case 0xd5:
+        case 0xd6: case 0xea:
+            return 1;
+    }
+
+    return 0;
+}
+
+int
+omni_x86_decode(const uint8_t *code, int is64, /* out */ struct x86_insn *insn)
+{
+    const uint8_t *p = code;
+    uint8_t op, flags;
+    int opsize = 0, adsize = 0, rex_w = 0, imm = 0, rel = 0;
+
+    memset(insn, 0, sizeof(*insn));
+
+    /* 1) prefixes: legacy, then (long mode) REX */
+    while(x86_is_prefix(*p)) {
+        if(*p == 0x66) opsize = 1;
+        if(*p == 0x67) adsize = 1;
+        if(++p - code >= X86_MAX_INSN) return -1;
+    }
+
+    if(is64 && (*p & 0xf0) == 0x40) {
+        insn->rex = *p++;
+        rex_w = !!(insn->rex & 0x08);
+    }
+
+    insn->opsize = opsize;
+
+    /* 2) opcode, in one of the maps */
+    op = *p++;
+
+    if(op == 0x0f) {
+        op = *p++;
+        if(op == 0x38) {
+            insn->map = 2;
+            op = *p++;
+            flags = M;
+        }
+        else if(op == 0x3a) {
+            insn->map = 3;
+            op = *p++;
+            flags = M | I8;
+        }
+        else {
+            insn->map = 1;
+            flags = x86_map1[op];
+        }
+    }
+    /* VEX (c4, c5) and EVEX (62) are LES, LDS, BOUND outside long mode
+        unless what follows would be a register ModRM */
+    else if((op == 0xc4 || op == 0xc5 || op == 0x62) &&
+        (is64 || (*p & 0xc0) == 0xc0)) {
+
+        if(op == 0xc5) {
+            insn->map = 1;
+            p += 1;
+        }
+        else if(op == 0xc4) {
+            insn->map = p[0] & 0x1f;
+            rex_w = !!(p[1] & 0x80);
+            p += 2;
+        }
+        else {
+            insn->map = p[0] & 0x07;
+            rex_w = !!(p[1] & 0x80);
+            p += 3;
+        }
+
+        op = *p++;
+        flags = M;
+        if(insn->map == 3) flags |= I8;
+        if(insn->map == 1) flags = x86_map1[op] & (M | I8); /* vzeroupper */
+        if(insn->map < 1 || insn->map > 3) return -1;
+    }
+    else {
+        if(is64 && x86_invalid64(op)) return -1;
+
+        flags = x86_map0[op] & ~S;
+
+        switch(op) {
+            case 0x9a: case 0xea: /* far pointer */
+                imm = opsize ? 4 : 6;
+                break;
+            case 0xa0: case 0xa1: case 0xa2: case 0xa3: /* moffs */
+                imm = is64 ? (adsize ? 4 : 8) : (adsize ? 2 : 4);
+                break;
+            case 0xb8: case 0xb9: case 0xba: case 0xbb:
+            case 0xbc: case 0xbd: case 0xbe: case 0xbf: /* mov reg, imm */
+                imm = rex_w ? 8 : (opsize ? 2 : 4);
+                break;
+            case 0xc8: /* enter */
+                imm = 3;
+                break;
+            case 0xf6: /* test r/m8, imm8 */
+                if(((*p >> 3) & 7) < 2) flags |= I8;
+                break;
+            case 0xf7: /* test r/m, imm */
+                if(((*p >> 3) & 7) < 2) flags |= IZ;
+                break;
+        }
+    }
+
+    insn->opcode = op;
+
+    /* 3) ModRM, SIB, displacement */
+    if(flags & M) {
+        uint8_t mod, rm;
+        int disp = 0;
+
+        insn->has_modrm = 1;
+        insn->modrm = *p++;
+        mod = insn->modrm >> 6;
+        rm = insn->modrm & 7;
+
+        if(mod != 3) {
+            if(!is64 && adsize) {
+                /* 16 bit addressing, no SIB */
+                if(mod == 0 && rm == 6) disp = 2;
+                else if(mod == 1) disp = 1;
+                else if(mod == 2) disp = 2;
+            }
+            else {
+                if(rm == 4 && (*p++ & 7) == 5 && mod == 0) disp = 4;
+
+                if(mod == 0 && rm == 5) {
+                    disp = 4;
+                    insn->rip_rel = is64;
+                }
+                else if(mod == 1) disp = 1;
+                else if(mod == 2) disp = 4;
+            }
+        }
+
+        if(disp) {
+            insn->disp_off = p - code;
+            insn->disp_size = disp;
+            p += disp;
+        }
+    }
+
+    /* 4) immediate or branch displacement */
+    if(flags & I8) imm += 1;
+    if(flags & I16) imm += 2;
+    if(flags & IZ) imm += opsize ? 2 : 4;
+    if(flags & R8) rel = 1;
+    if(flags & RZ) rel = (opsize && !is64) ? 2 : 4;
+
+    if(rel) {
+        insn->rel_off = p - code;
+        insn->rel_size = rel;
+    }
+    insn->imm_size = imm;
+
+    p += imm + rel;
+    if(p - code > X86_MAX_INSN) return -1;
+
+    insn->len = p - code;
+
+    return insn->len;
+}
+
+//-----------------------------------------------------------------------------
+// INSTRUCTION STEALING
+//-----------------------------------------------------------------------------
+
+static int32_t
+x86_read_s32(const uint8_t *p, int size)
+{
+    int32_t v = 0;
+
+    switch(size) {
+        case 1: v = (int8_t)p[0]; break;
+        case 2: v = (int16_t)(p[0] | (p[1] << 8)); break;
+        case 4: memcpy(&v, p, 4); break;
+    }
+
+    return v;
+}
+
+/* whether a rel32 from next reaches target (always true outside long mode,
+    where the address space wraps) */
+static int
+x86_rel32(uintptr_t next, uintptr_t target, int is64, /* out */ int32_t *rel)
+{
+    intptr_t d = (intptr_t)(target - next);
+
+    *rel = (int32_t)d;
+
+    return !is64 || d == (intptr_t)*rel;
+}
+
+int
+omni_x86_jmp_len(uintptr_t at, uintptr_t target, int is64)
+{
+    int32_t rel;
+
+    return x86_rel32(at + X86_JMP_REL, target, is64, &rel) ? X86_JMP_REL : X86_JMP_ABS;
+}
+
+int
+omni_x86_jmp(uint8_t *out, uintptr_t at, uintptr_t target, int is64)
+{
+    int32_t rel;
+    uint64_t abs = target;
+
+    if(x86_rel32(at + X86_JMP_REL, target, is64, &rel)) {
+        out[0] = 0xe9;
+        memcpy(out + 1, &rel, 4);
+        return X86_JMP_REL;
+    }
+
+    memcpy(out, "\xff\x25\x00\x00\x00\x00", 6);
+    memcpy(out + 6, &abs, 8);
+
+    return X86_JMP_ABS;
+}
+
+/* control never falls through these */
+static int
+x86_is_exit(struct x86_insn *insn)
+{
+    if(insn->map == 0) {
+        switch(insn->opcode) {
+            case 0xc2: case 0xc3: case 0xca: case 0xcb: case 0xcf: /* ret, iret */
+            case 0xe9: case 0xeb: /* jmp */
+                return 1;
+            case 0xff: /* jmp r/m */
+                return ((insn->modrm >> 3) & 7) == 4 || ((insn->modrm >> 3) & 7) == 5;
+        }
+    }
+    else if(insn->map == 1 && insn->opcode == 0x0b) { /* ud2 */
+        return 1;
+    }
+
+    return 0;
+}
+
+/* re-emits a relative jmp, call or jcc so it still reaches target from its
+    new home; returns bytes written or -1 */
+static int
+x86_emit_branch(struct x86_insn *insn, uintptr_t target, uint8_t *out,
+    uintptr_t out_addr, unsigned int room, int is64)
+{
+    int32_t rel;
+    uint64_t abs = target;
+
+    /* jmp rel8, jmp rel32 */
+    if(insn->map == 0 && (insn->opcode == 0xeb || insn->opcode == 0xe9)) {
+        if(room < (unsigned int)omni_x86_jmp_len(out_addr, target, is64)) {
+            return X86_STEAL_NOSPACE;
+        }
+
+        return omni_x86_jmp(out, out_addr, target, is64);
+    }
+
+    /* call rel32 */
+    if(insn->map == 0 && insn->opcode == 0xe8) {
+        if(x86_rel32(out_addr + 5, target, is64, &rel)) {
+            if(room < 5) return X86_STEAL_NOSPACE;
+            out[0] = 0xe8;
+            memcpy(out + 1, &rel, 4);
+            return 5;
+        }
+
+        /* call *2(%rip); jmp +8; .quad target */
+        if(room < 16) return X86_STEAL_NOSPACE;
+        memcpy(out, "\xff\x15\x02\x00\x00\x00\xeb\x08", 8);
+        memcpy(out + 8, &abs, 8);
+        return 16;
+    }
+
+    /* jcc rel8, jcc rel32 */
+    if((insn->map == 0 && (insn->opcode & 0xf0) == 0x70) ||
+        (insn->map == 1 && (insn->opcode & 0xf0) == 0x80)) {
+
+        uint8_t cc = insn->opcode & 0x0f;
+
+        if(x86_rel32(out_addr + 6, target, is64, &rel)) {
+            if(room < 6) return X86_STEAL_NOSPACE;
+            out[0] = 0x0f;
+            out[1] = 0x80 | cc;
+            memcpy(out + 2, &rel, 4);
+            return 6;
+        }
+
+        /* j!cc +14; jmp *0(%rip); .quad target */
+        if(room < 16) return X86_STEAL_NOSPACE;
+        out[0] = 0x70 | (cc ^ 1);
+        out[1] = 14;
+        memcpy(out + 2, "\xff\x25\x00\x00\x00\x00", 6);
+        memcpy(out + 8, &abs, 8);
+        return 16;
+    }
+
+    /* loop, jcxz, xbegin... have no long form worth synthesizing */
+    return -1;
+}
+
+int
+omni_x86_steal(const uint8_t *src, uintptr_t src_addr, unsigned int min,
+    uint8_t *out, uintptr_t out_addr, unsigned int out_max,
+    /* out */ unsigned int *stolen, int is64)
+{
+    int n, i, ntargets = 0;
+    unsigned int in = 0, written = 0;
+    uintptr_t targets[X86_MAX_INSN];
+    struct x86_insn insn;
+
+    while(in < min) {
+        const uint8_t *ip = src + in;
+        uintptr_t next;
+
+        if(omni_x86_decode(ip, is64, &insn) < 0) {
+            return -1;
+        }
+        next = src_addr + in + insn.len;
+
+        /* a breakpoint here belongs to someone else (kprobes, a debugger) */
+        if(insn.map == 0 && (insn.opcode == 0xcc || insn.opcode == 0xcd)) {
+            return -1;
+        }
+
+        /* function ends before the patch would */
+        if(in + insn.len < min && x86_is_exit(&insn)) {
+            return -1;
+        }
+
+        if(insn.rel_off) {
+            uintptr_t target = next + x86_read_s32(ip + insn.rel_off, insn.rel_size);
+
+            targets[ntargets++] = target;
+
+            n = x86_emit_branch(&insn, target, out + written,
+                out_addr + written, out_max - written, is64);
+            if(n < 0) {
+                return n;
+            }
+        }
+        else {
+            n = insn.len;
+            if(out_max - written < (unsigned int)n) {
+                return X86_STEAL_NOSPACE;
+            }
+
+            memcpy(out + written, ip, n);
+
+            /* RIP-relative operand: same absolute address from the copy */
+            if(insn.rip_rel) {
+                int32_t disp;
+                uintptr_t abs = next + x86_read_s32(ip + insn.disp_off, 4);
+
+                if(!x86_rel32(out_addr + written + n, abs, is64, &disp)) {
+                    return -1;
+                }
+
+                memcpy(out + written + insn.disp_off, &disp, 4);
+            }
+        }
+
+        in += insn.len;
+        written += n;
+    }
+
+    /* a branch back into the stolen bytes would land on the patch */
+    for(i = 0; i < ntargets; ++i) {
+        if(targets[i] >= src_addr && targets[i] < src_addr + in) {
+            return -1;
+        }
+    }
+
+    *stolen = in;
+
+    return written;
+}
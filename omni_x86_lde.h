@@ -0,0 +1,54 @@
+#ifndef OMNI_X86_LDE_H
+#define OMNI_X86_LDE_H
+
+/* x86/x86-64 length disassembler and instruction stealer, shared by the
+    linux and freebsd x86 backends; no OS dependencies */
+
+#define X86_MAX_INSN 15
+#define X86_STEAL_NOSPACE -2 /* out_max too small, retry with more room */
+
+#define X86_JMP_REL 5 /* jmp rel32 */
+#define X86_JMP_ABS 14 /* jmp *0(%rip); <8-byte absolute address> */
+
+struct x86_insn {
+    uint8_t len;
+    uint8_t map; // 0: one byte, 1: 0f, 2: 0f 38, 3: 0f 3a
+    uint8_t opcode; // last opcode byte
+    uint8_t rex;
+    uint8_t opsize; // 66 prefix seen
+    uint8_t modrm; // valid if has_modrm
+    uint8_t has_modrm;
+    uint8_t disp_off; // offset of displacement (0: none)
+    uint8_t disp_size;
+    uint8_t rip_rel; // displacement is relative to the next instruction
+    uint8_t rel_off; // offset of branch displacement (0: none)
+    uint8_t rel_size;
+    uint8_t imm_size;
+};
+
+/* decodes one instruction at code, returns its length or -1 */
+int
+omni_x86_decode(const uint8_t *code, int is64, /* out */ struct x86_insn *insn);
+
+/* copies whole instructions from src (which lives at src_addr) until at
+    least min bytes are covered, to out (which will execute at out_addr);
+    RIP-relative operands and relative branches are rewritten for the new
+    location. returns bytes written to out (or -1) and the number of bytes
+    stolen from src through *stolen */
+int
+omni_x86_steal(const uint8_t *src, uintptr_t src_addr, unsigned int min,
+    uint8_t *out, uintptr_t out_addr, unsigned int out_max,
+    /* out */ unsigned int *stolen, int is64);
+
+/* length of the jump omni_x86_jmp() would write at at to reach target */
+int
+omni_x86_jmp_len(uintptr_t at, uintptr_t target, int is64);
+
+/* writes a jump at out (which executes at at) to target: jmp rel32 when it
+    reaches, jmp *0(%rip) with the target inline otherwise (long mode only);
+    neither disturbs the return stack buffer like push/ret does. returns the
+    bytes written */
+int
+omni_x86_jmp(uint8_t *out, uintptr_t at, uintptr_t target, int is64);
+
+#endif
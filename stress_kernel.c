@@ -0,0 +1,414 @@
+/* in-kernel stress of live patching, built as a module alongside example.c:
+    a thread pinned on every online CPU calls one function in a tight loop
+    while insmod's own thread hooks and unhooks it as fast as it can; the
+    detour calls the original, so a removal really has calls to wait out
+
+    insmod stress_kernel.ko [seconds=5] [spike=10000] [machine=0]
+    cat /sys/kernel/debug/omnihook-stress_kernel/stress
+
+    two phases of the same length, run before insmod returns: quiet, the
+    function left alone, then stress, hooked and unhooked back to back;
+    quiet is the baseline the stress numbers are read against (interrupts
+    aren't masked, they show up in both)
+
+    one line per phase and CPU, cycles (ns on arm):
+
+    phase cpu calls max spikes torn missed stray
+
+    every call is timed, spikes are calls over spike, max the worst one; a
+    call is torn when it returns the wrong value, missed when the hook was in
+    place for all of it and the detour didn't run, stray when the hook was
+    gone for all of it and the detour did; anything but zero for the last
+    three is a bug. then one line for the hook/unhook cycles:
+
+    cycles adds add_ns add_max_ns remove_ns remove_max_ns total_ms
+
+    machine=1 patches with stop_machine() instead of int3 (x86) */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/delay.h> /* msleep() */
+#include <linux/jiffies.h>
+#include <linux/math64.h> /* div64_u64() */
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h> /* local_clock() */
+
+#include <asm/timex.h> /* get_cycles() */
+
+#include "omni_typed.h"
+
+static unsigned int seconds = 5;
+module_param(seconds, uint, 0444);
+MODULE_PARM_DESC(seconds, "length of each phase");
+
+static unsigned long spike = 10000;
+module_param(spike, ulong, 0444);
+MODULE_PARM_DESC(spike, "calls slower than this count as spikes");
+
+#if defined(__i386__) || defined(__amd64__)
+static int machine;
+module_param(machine, int, 0444);
+MODULE_PARM_DESC(machine, "patch with stop_machine() instead of int3");
+#endif
+
+#if defined(__arm__)
+#define stress_now() local_clock()
+#define STRESS_UNIT "ns"
+#else
+#define stress_now() ((u64)get_cycles())
+#define STRESS_UNIT "cycles"
+#endif
+
+/* removed hooks piling up for a grace period hold arena slots, every so
+    many cycles the harness waits for them (outside the timed windows) */
+#define STRESS_FLUSH_EVERY 64
+
+static noinline long
+stress_target(long x)
+{
+    x = x * 3 + 1;
+    barrier();
+    return x ^ (x >> 7);
+}
+
+/* what stress_target() returns, computed apart from it */
+static long
+stress_expect(long x)
+{
+    x = x * 3 + 1;
+    return x ^ (x >> 7);
+}
+
+static DEFINE_PER_CPU(unsigned long, stress_hits);
+
+OMNIHOOK_DEFINE(stress_target, long, (long));
+
+static long
+OMNIHOOK_DETOUR(stress_target)(long x)
+{
+    this_cpu_inc(stress_hits);
+
+    return OMNIHOOK_ORIG(stress_target)(x);
+}
+
+//-----------------------------------------------------------------------------
+// WORKERS
+//-----------------------------------------------------------------------------
+
+#define STRESS_QUIET 0
+#define STRESS_STRESS 1
+#define STRESS_PHASES 2
+
+static const char *stress_phases[STRESS_PHASES] = { "quiet", "stress" };
+
+struct stress_result {
+    u64 calls;
+    u64 max;
+    u64 spikes;
+    u64 torn;
+    u64 missed;
+    u64 stray;
+};
+
+struct stress_cpu {
+    struct task_struct *task;
+    int ran; // has results
+    struct stress_result result[STRESS_PHASES];
+};
+
+static struct stress_cpu *stress_cpus; // by CPU id
+
+/* bumped before and after every add and remove, so modulo 4: 0 unhooked,
+    1 being hooked, 2 hooked, 3 being unhooked; a call that sees the same
+    value before and after ran entirely in that state */
+static atomic_long_t stress_gen;
+/* the phase being measured, -1: none */
+static int stress_phase = -1;
+
+static u64 stress_adds, stress_add_ns, stress_add_max, stress_rem_ns,
+    stress_rem_max;
+
+static int
+stress_worker(void *data)
+{
+    struct stress_cpu *c = data;
+    struct stress_result *r;
+    long (*volatile fn)(long) = stress_target;
+    unsigned long gen, hits, n = 0;
+    long x = 0, ret;
+    u64 t0, t1;
+    int phase;
+
+    while(!kthread_should_stop()) {
+        phase = READ_ONCE(stress_phase);
+        if(phase < 0) {
+            msleep(1);
+            continue;
+        }
+        r = &c->result[phase];
+
+        gen = atomic_long_read(&stress_gen);
+        smp_rmb();
+        hits = this_cpu_read(stress_hits);
+
+        t0 = stress_now();
+        ret = fn(x);
+        t1 = stress_now();
+
+        smp_rmb();
+        if(ret != stress_expect(x)) {
+            ++r->torn;
+        }
+        else if(gen == atomic_long_read(&stress_gen)) {
+            if(gen % 4 == 2 && this_cpu_read(stress_hits) == hits) {
+                ++r->missed;
+            }
+            else if(gen % 4 == 0 && this_cpu_read(stress_hits) != hits) {
+                ++r->stray;
+            }
+        }
+
+        if(t1 - t0 > r->max) {
+            r->max = t1 - t0;
+        }
+        if(t1 - t0 > spike) {
+            ++r->spikes;
+        }
+
+        ++r->calls;
+        x = ret;
+
+        if((++n & 255) == 0) {
+            cond_resched();
+        }
+    }
+
+    return 0;
+}
+
+/* lets the workers measure phase for the given time, hooking and unhooking
+    meanwhile if asked; -EIO if an add or remove failed */
+static int
+stress_run_phase(int phase, int patch)
+{
+    int rc = -EIO;
+    unsigned long end = jiffies + seconds * HZ;
+    u64 t0, t1, t2;
+
+    WRITE_ONCE(stress_phase, phase);
+
+    while(time_before(jiffies, end)) {
+        if(!patch) {
+            msleep(10);
+            continue;
+        }
+
+        t0 = local_clock();
+        atomic_long_inc(&stress_gen);
+        if(0 != OMNIHOOK_ADD_SYM(stress_target, stress_target)) {
+            printk("ERROR: hooking stress_target()\n");
+            goto cleanup;
+        }
+        atomic_long_inc(&stress_gen);
+        t1 = local_clock();
+
+        atomic_long_inc(&stress_gen);
+        if(0 != omnihook_remove(stress_target)) {
+            printk("ERROR: unhooking stress_target()\n");
+            goto cleanup;
+        }
+        atomic_long_inc(&stress_gen);
+        t2 = local_clock();
+
+        stress_add_ns += t1 - t0;
+        stress_rem_ns += t2 - t1;
+        stress_add_max = max(stress_add_max, t1 - t0);
+        stress_rem_max = max(stress_rem_max, t2 - t1);
+
+        if((++stress_adds % STRESS_FLUSH_EVERY) == 0) {
+            omni_reclaim_flush();
+        }
+
+        cond_resched();
+    }
+
+    rc = 0;
+
+    cleanup:
+    WRITE_ONCE(stress_phase, -1);
+    /* lets the last calls land in the counters */
+    msleep(10);
+
+    return rc;
+}
+
+static void
+stress_stop_workers(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        if(stress_cpus[cpu].task) {
+            kthread_stop(stress_cpus[cpu].task);
+            stress_cpus[cpu].task = NULL;
+        }
+    }
+}
+
+/* 0, or -errno: a worker couldn't be started, or the stress phase failed */
+static int
+stress_run(void)
+{
+    int rc, cpu;
+    struct task_struct *task;
+
+    for_each_online_cpu(cpu) {
+        task = kthread_create(stress_worker, &stress_cpus[cpu],
+            "omnihook_stress/%d", cpu);
+        if(IS_ERR(task)) {
+            printk("ERROR: stress thread for cpu%d\n", cpu);
+            rc = PTR_ERR(task);
+            goto cleanup;
+        }
+
+        kthread_bind(task, cpu);
+        stress_cpus[cpu].task = task;
+        stress_cpus[cpu].ran = 1;
+    }
+
+    for_each_possible_cpu(cpu) {
+        if(stress_cpus[cpu].task) {
+            wake_up_process(stress_cpus[cpu].task);
+        }
+    }
+
+    rc = stress_run_phase(STRESS_QUIET, 0);
+    if(0 == rc) {
+        rc = stress_run_phase(STRESS_STRESS, 1);
+    }
+
+    cleanup:
+    stress_stop_workers();
+
+    return rc;
+}
+
+//-----------------------------------------------------------------------------
+// DEBUGFS
+//-----------------------------------------------------------------------------
+
+static int
+stress_file_show(struct seq_file *m, void *unused)
+{
+    int cpu, i;
+
+    seq_printf(m, "# %s, %u seconds per phase, spikes over %lu\n",
+        STRESS_UNIT, seconds, spike);
+    seq_printf(m, "# phase cpu calls max spikes torn missed stray\n");
+
+    for(i = 0; i < STRESS_PHASES; ++i) {
+        for_each_possible_cpu(cpu) {
+            struct stress_result *r = &stress_cpus[cpu].result[i];
+
+            if(!stress_cpus[cpu].ran) {
+                continue;
+            }
+
+            seq_printf(m, "%s %d %llu %llu %llu %llu %llu %llu\n",
+                stress_phases[i], cpu, r->calls, r->max, r->spikes, r->torn,
+                r->missed, r->stray);
+        }
+    }
+
+    seq_printf(m, "# cycles adds add_ns add_max_ns remove_ns remove_max_ns "
+        "total_ms\n");
+    seq_printf(m, "cycles %llu %llu %llu %llu %llu %llu\n", stress_adds,
+        stress_adds ? div64_u64(stress_add_ns, stress_adds) : 0,
+        stress_add_max,
+        stress_adds ? div64_u64(stress_rem_ns, stress_adds) : 0,
+        stress_rem_max, div64_u64(stress_add_ns + stress_rem_ns, 1000000));
+
+    return 0;
+}
+
+static int
+stress_file_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stress_file_show, NULL);
+}
+
+static const struct file_operations stress_fops = {
+    .owner = THIS_MODULE,
+    .open = stress_file_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+//-----------------------------------------------------------------------------
+// MODULE
+//-----------------------------------------------------------------------------
+
+static int __init
+stress_init(void)
+{
+    int rc = -ENODEV;
+
+    if(!seconds) {
+        return -EINVAL;
+    }
+
+    stress_cpus = kcalloc(nr_cpu_ids, sizeof(*stress_cpus), GFP_KERNEL);
+    if(!stress_cpus) {
+        return -ENOMEM;
+    }
+
+    if(0 != omnihook_init()) {
+        goto cleanup;
+    }
+
+    #if defined(__i386__) || defined(__amd64__)
+    if(machine) {
+        omnihook_set_patch_mode(OMNIHOOK_PATCH_MACHINE);
+    }
+    #endif
+
+    rc = stress_run();
+    if(0 != rc) {
+        omnihook_remove_all();
+        omnihook_exit();
+        goto cleanup;
+    }
+
+    if(omni_debugfs_dir()) {
+        debugfs_create_file("stress", 0400, omni_debugfs_dir(), NULL,
+            &stress_fops);
+    }
+
+    cleanup:
+    if(0 != rc) {
+        kfree(stress_cpus);
+    }
+
+    return rc;
+}
+
+static void __exit
+stress_exit(void)
+{
+    /* removes debugfs:omnihook-stress_kernel/stress with the rest */
+    omnihook_exit();
+
+    kfree(stress_cpus);
+}
+
+module_init(stress_init);
+module_exit(stress_exit);
+
+MODULE_LICENSE("GPL");
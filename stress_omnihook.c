@@ -0,0 +1,312 @@
+/* userspace stress of live patching (omni_linux_user_amd64.c): a worker
+    pinned on every CPU calls one function in a tight loop while the main
+    thread hooks and unhooks it as fast as it can
+
+    gcc -O2 -o stress_omnihook stress_omnihook.c omni_linux_user_amd64.c \
+        omni_x86_lde.c -lpthread
+    ./stress_omnihook [seconds] [spike cycles]
+
+    x86-64 only; two phases of the same length (default 5 seconds): quiet,
+    the function left alone, then stress, hooked and unhooked back to back;
+    quiet is the baseline the stress numbers are read against
+
+    output is one JSON object per line, the first describes the run:
+
+    {"stress":"omnihook","schema":1,...}
+    {"phase":"quiet"|"stress","calls":...,"max_cycles":...,"spikes":...,
+        "torn":...,"missed":...,"stray":...}
+    {"test":"cycle","adds":N,"add_ns":...,"add_max_ns":...,
+        "remove_ns":...,"remove_max_ns":...,"total_ms":...}
+
+    every call is timed (rdtsc), spikes are calls over spike cycles (default
+    10000), max_cycles the worst one; a call is torn when it returns the
+    wrong value, missed when the hook was in place for all of it and the
+    detour didn't run, stray when the hook was gone for all of it and the
+    detour did; anything but zero for the last three is a bug
+
+    the detour doesn't call the trampoline, this backend doesn't track calls
+    and a removed hook's trampoline may be reused while a call is still in
+    it (see omni_linux_user_amd64.h); stress_kernel.c covers that path */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <x86intrin.h> /* __rdtsc() */
+
+#include "omni_linux_user_amd64.h"
+
+typedef long (*stress_fn)(long);
+
+/* the hooked function: rdi + 1 with enough whole instructions to steal up
+    to 15 bytes, then ret; in the program's own text so the detour is in
+    rel32 reach and no relay slot is involved */
+long stress_target(long x);
+
+asm(
+    ".pushsection .text\n"
+    ".globl stress_target\n"
+    ".balign 16\n"
+    "stress_target:\n"
+    "    mov %rdi, %rax\n"
+    "    add $0x1, %rax\n"
+    "    add $0x0, %rax\n"
+    "    add $0x0, %rax\n"
+    "    ret\n"
+    ".popsection\n"
+);
+
+struct stress_worker {
+    pthread_t thread;
+    int cpu;
+    uint64_t calls;
+    uint64_t max_cycles;
+    uint64_t spikes;
+    uint64_t torn;
+    uint64_t missed;
+    uint64_t stray;
+} __attribute__((aligned(64)));
+
+static struct stress_worker *workers;
+static long nworkers;
+static uint64_t spike_cycles = 10000;
+
+/* bumped before and after every add and remove, so modulo 4: 0 unhooked,
+    1 being hooked, 2 hooked, 3 being unhooked; a call that sees the same
+    value before and after ran entirely in that state */
+static unsigned long stress_gen;
+/* 1: measuring, 2: workers exit */
+static int stress_state;
+
+static __thread unsigned long stress_hits;
+
+static long
+stress_detour(long x)
+{
+    ++stress_hits;
+
+    return x + 1;
+}
+
+static double
+stress_now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+//-----------------------------------------------------------------------------
+// WORKERS
+//-----------------------------------------------------------------------------
+
+static void *
+stress_worker_run(void *arg)
+{
+    struct stress_worker *w = arg;
+    stress_fn volatile fn = stress_target;
+    unsigned long gen, hits;
+    uint64_t t0, t1;
+    cpu_set_t set;
+    long x = 0, r;
+    int state;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    while((state = __atomic_load_n(&stress_state, __ATOMIC_ACQUIRE)) != 2) {
+        if(!state) {
+            sched_yield();
+            continue;
+        }
+
+        gen = __atomic_load_n(&stress_gen, __ATOMIC_ACQUIRE);
+        hits = stress_hits;
+
+        t0 = __rdtsc();
+        r = fn(x);
+        t1 = __rdtsc();
+
+        if(r != x + 1) {
+            ++w->torn;
+        }
+        else if(gen == __atomic_load_n(&stress_gen, __ATOMIC_ACQUIRE)) {
+            if(gen % 4 == 2 && stress_hits == hits) {
+                ++w->missed;
+            }
+            else if(gen % 4 == 0 && stress_hits != hits) {
+                ++w->stray;
+            }
+        }
+
+        if(t1 - t0 > w->max_cycles) {
+            w->max_cycles = t1 - t0;
+        }
+        if(t1 - t0 > spike_cycles) {
+            ++w->spikes;
+        }
+
+        ++w->calls;
+        x = r;
+    }
+
+    return NULL;
+}
+
+/* starts the workers measuring from zero, stops them after ns (they keep
+    spinning, idle, until the next phase) and prints the phase; returns -1
+    if hooking or unhooking failed or a worker saw a torn, missed or stray
+    call */
+static int
+stress_phase(const char *name, double ns, int patch)
+{
+    int rc = 0;
+    long i;
+    void *tramp;
+    double start, t0, t1, t2, add = 0, add_max = 0, rem = 0, rem_max = 0;
+    unsigned long adds = 0;
+    struct stress_worker sum;
+
+    for(i = 0; i < nworkers; ++i) {
+        workers[i].calls = workers[i].max_cycles = workers[i].spikes = 0;
+        workers[i].torn = workers[i].missed = workers[i].stray = 0;
+    }
+
+    __atomic_store_n(&stress_state, 1, __ATOMIC_RELEASE);
+
+    start = stress_now();
+    while((t0 = stress_now()) - start < ns) {
+        if(!patch) {
+            usleep(10000);
+            continue;
+        }
+
+        __atomic_add_fetch(&stress_gen, 1, __ATOMIC_RELEASE);
+        if(0 != omnihook_add((void *)stress_target, (void *)stress_detour,
+            &tramp)) {
+            fprintf(stderr, "ERROR: hooking stress_target()\n");
+            rc = -1;
+            break;
+        }
+        __atomic_add_fetch(&stress_gen, 1, __ATOMIC_RELEASE);
+        t1 = stress_now();
+
+        __atomic_add_fetch(&stress_gen, 1, __ATOMIC_RELEASE);
+        if(0 != omnihook_remove((void *)stress_target)) {
+            fprintf(stderr, "ERROR: unhooking stress_target()\n");
+            rc = -1;
+            break;
+        }
+        __atomic_add_fetch(&stress_gen, 1, __ATOMIC_RELEASE);
+        t2 = stress_now();
+
+        add += t1 - t0;
+        rem += t2 - t1;
+        add_max = t1 - t0 > add_max ? t1 - t0 : add_max;
+        rem_max = t2 - t1 > rem_max ? t2 - t1 : rem_max;
+        ++adds;
+    }
+
+    __atomic_store_n(&stress_state, 0, __ATOMIC_RELEASE);
+    /* lets the last calls land in the counters */
+    usleep(10000);
+
+    memset(&sum, 0, sizeof(sum));
+    for(i = 0; i < nworkers; ++i) {
+        sum.calls += workers[i].calls;
+        sum.spikes += workers[i].spikes;
+        sum.torn += workers[i].torn;
+        sum.missed += workers[i].missed;
+        sum.stray += workers[i].stray;
+        if(workers[i].max_cycles > sum.max_cycles) {
+            sum.max_cycles = workers[i].max_cycles;
+        }
+    }
+
+    printf("{\"phase\":\"%s\",\"calls\":%llu,\"max_cycles\":%llu,"
+        "\"spikes\":%llu,\"torn\":%llu,\"missed\":%llu,\"stray\":%llu}\n",
+        name, (unsigned long long)sum.calls,
+        (unsigned long long)sum.max_cycles, (unsigned long long)sum.spikes,
+        (unsigned long long)sum.torn, (unsigned long long)sum.missed,
+        (unsigned long long)sum.stray);
+
+    if(adds) {
+        printf("{\"test\":\"cycle\",\"adds\":%lu,\"add_ns\":%.1f,"
+            "\"add_max_ns\":%.0f,\"remove_ns\":%.1f,\"remove_max_ns\":%.0f,"
+            "\"total_ms\":%.1f}\n", adds, add / adds, add_max, rem / adds,
+            rem_max, (add + rem) / 1e6);
+    }
+
+    fflush(stdout);
+
+    if(sum.torn || sum.missed || sum.stray) {
+        rc = -1;
+    }
+
+    return rc;
+}
+
+//-----------------------------------------------------------------------------
+// MAIN
+//-----------------------------------------------------------------------------
+
+int
+main(int ac, char **av)
+{
+    int rc = 0;
+    long i;
+    double seconds = 5;
+
+    if(ac > 1) seconds = atof(av[1]);
+    if(ac > 2) spike_cycles = strtoull(av[2], NULL, 0);
+
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nworkers < 1) {
+        nworkers = 1;
+    }
+
+    workers = calloc(nworkers, sizeof(*workers));
+    if(!workers) {
+        return -1;
+    }
+
+    printf("{\"stress\":\"omnihook\",\"schema\":1,\"workers\":%ld,"
+        "\"seconds\":%.1f,\"spike_cycles\":%llu}\n", nworkers, seconds,
+        (unsigned long long)spike_cycles);
+
+    for(i = 0; i < nworkers; ++i) {
+        workers[i].cpu = i;
+        if(0 != pthread_create(&workers[i].thread, NULL, stress_worker_run,
+            &workers[i])) {
+            fprintf(stderr, "ERROR: starting worker %ld\n", i);
+            return -1;
+        }
+    }
+
+    if(0 != stress_phase("quiet", seconds * 1e9, 0)) {
+        rc = -1;
+    }
+    if(0 != stress_phase("stress", seconds * 1e9, 1)) {
+        rc = -1;
+    }
+
+    __atomic_store_n(&stress_state, 2, __ATOMIC_RELEASE);
+    for(i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if(0 != omnihook_remove_all()) {
+        rc = -1;
+    }
+    omnihook_exit();
+
+    return rc;
+}
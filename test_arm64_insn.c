@@ -0,0 +1,195 @@
+/* userspace checks of omni_arm64_insn.c: the code it emits for each kind of
+    stolen instruction, what it refuses, and which landing pads it leaves in
+    place; nothing is executed, so any host will do
+
+    gcc -O2 -o test_arm64_insn test_arm64_insn.c omni_arm64_insn.c
+    ./test_arm64_insn
+
+    expected encodings were checked against llvm-mc/llvm-objdump; src runs at
+    TEST_SRC, the trampoline at TEST_NEAR (16KB away, even tbz reaches),
+    TEST_OUT (4MB away, only b reaches) or TEST_FAR (out of b's reach) */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "omni_arm64_insn.h"
+
+#define TEST_SRC 0x400000UL
+#define TEST_NEAR 0x404000UL
+#define TEST_OUT 0x800000UL
+#define TEST_FAR 0x4000400000UL
+
+#define TEST_MAX 8
+
+struct relocate_case {
+    const char *name;
+    uint32_t src[TEST_MAX];
+    unsigned int count;
+    uintptr_t out_addr;
+    unsigned int out_max;
+    int rc; // bytes written, -1 or A64_STEAL_NOSPACE
+    uint32_t expect[TEST_MAX];
+};
+
+static const struct relocate_case relocate_cases[] = {
+    { "mov", { 0xaa0103e0 }, 1, TEST_OUT, 64, 8,
+        { 0xaa0103e0, 0x17f00000 } }, /* mov x0, x1; b src + 4 */
+    { "mov, far back", { 0xaa0103e0 }, 1, TEST_FAR, 64, -1, { 0 } },
+    { "adr", { 0x10000200 }, 1, TEST_OUT, 64, 16,
+        { 0x58000040, 0x17f00000, 0x00400040, 0x00000000 } },
+    { "adrp", { 0xb0000001 }, 1, TEST_OUT, 64, 16,
+        { 0x58000041, 0x17f00000, 0x00401000, 0x00000000 } },
+    { "ldr x, literal", { 0x58000101 }, 1, TEST_OUT, 64, 24,
+        { 0x58000081, 0xf9400021, 0x17efffff, A64_NOP,
+            0x00400020, 0x00000000 } }, /* ldr x1, =lit; ldr x1, [x1] */
+    { "ldr q, literal", { 0x9c000102 }, 1, TEST_OUT, 64, 24,
+        { 0x58000090, 0x3dc00202, 0x17efffff, A64_NOP,
+            0x00400020, 0x00000000 } }, /* through x16 */
+    { "b", { 0x14000100 }, 1, TEST_OUT, 64, 8, { 0x17f00100, 0x17f00000 } },
+    { "bl", { 0x94000100 }, 1, TEST_OUT, 64, 8, { 0x97f00100, 0x17f00000 } },
+    { "b, far", { 0x14000100 }, 1, TEST_FAR, 64, -1, { 0 } },
+    { "b.ne", { 0x54000101 }, 1, TEST_NEAR, 64, 8,
+        { 0x54fe0101, 0x17fff000 } }, /* retargeted */
+    { "b.ne, out of reach", { 0x54000101 }, 1, TEST_OUT, 64, 12,
+        { 0x54000040, 0x17f00007, 0x17efffff } }, /* b.eq over a b */
+    { "b.al, out of reach", { 0x5400010e }, 1, TEST_OUT, 64, 8,
+        { 0x17f00008, 0x17f00000 } },
+    { "b.ne, far", { 0x54000101 }, 1, TEST_FAR, 64, -1, { 0 } },
+    { "cbz", { 0xb4000103 }, 1, TEST_NEAR, 64, 8, { 0xb4fe0103, 0x17fff000 } },
+    { "cbz, out of reach", { 0xb4000103 }, 1, TEST_OUT, 64, 12,
+        { 0xb5000043, 0x17f00007, 0x17efffff } },
+    { "tbnz", { 0x37180104 }, 1, TEST_NEAR, 64, 8, { 0x371e0104, 0x17fff000 } },
+    { "tbnz, out of reach", { 0x37180104 }, 1, TEST_OUT, 64, 12,
+        { 0x36180044, 0x17f00007, 0x17efffff } },
+    { "b, then more", { 0x14000100, A64_NOP }, 2, TEST_OUT, 64, -1, { 0 } },
+    { "b.ne into the site", { 0x54000021, A64_NOP }, 2, TEST_OUT, 64, -1,
+        { 0 } },
+    { "too many", { A64_NOP, A64_NOP, A64_NOP, A64_NOP, A64_NOP }, 5,
+        TEST_OUT, 64, -1, { 0 } },
+    { "no room", { 0x10000200 }, 1, TEST_OUT, 8, A64_STEAL_NOSPACE, { 0 } },
+};
+
+struct landing_case {
+    const char *name;
+    uint32_t src[2];
+    unsigned int landing;
+    uint32_t auth;
+};
+
+static const struct landing_case landing_cases[] = {
+    { "none", { 0xaa0103e0, A64_NOP }, 0, 0 },
+    { "bti c", { 0xd503245f, 0xaa0103e0 }, 1, 0 },
+    { "bti j", { 0xd503249f, 0xaa0103e0 }, 1, 0 },
+    { "bti jc", { A64_BTI_JC, 0xaa0103e0 }, 1, 0 },
+    { "paciasp", { A64_PACIASP, 0xaa0103e0 }, 1, A64_AUTIASP },
+    { "pacibsp", { A64_PACIBSP, 0xaa0103e0 }, 1, A64_AUTIBSP },
+    { "bti c; paciasp", { 0xd503245f, A64_PACIASP }, 2, A64_AUTIASP },
+    { "bti c; pacibsp", { 0xd503245f, A64_PACIBSP }, 2, A64_AUTIBSP },
+    { "autiasp", { A64_AUTIASP, 0xaa0103e0 }, 0, 0 }, /* not a landing pad */
+};
+
+static int
+test_relocate(const struct relocate_case *c)
+{
+    int rc;
+    uint32_t out[64];
+
+    memset(out, 0, sizeof(out));
+    rc = omni_a64_relocate(c->src, TEST_SRC, c->count, (uint8_t *)out,
+        c->out_addr, c->out_max);
+
+    if(rc != c->rc) {
+        printf("FAIL relocate %s: returned %d, expected %d\n", c->name, rc,
+            c->rc);
+        return -1;
+    }
+
+    if(rc > 0 && memcmp(out, c->expect, rc)) {
+        int i;
+
+        printf("FAIL relocate %s:", c->name);
+        for(i = 0; i < rc / A64_INSN; ++i) {
+            printf(" %08x", out[i]);
+        }
+        printf("\n");
+        return -1;
+    }
+
+    printf("ok   relocate %s\n", c->name);
+
+    return 0;
+}
+
+static int
+test_landing(const struct landing_case *c)
+{
+    uint32_t auth;
+    unsigned int landing = omni_a64_landing(c->src, &auth);
+
+    if(landing != c->landing || auth != c->auth) {
+        printf("FAIL landing %s: %u %08x, expected %u %08x\n", c->name,
+            landing, auth, c->landing, c->auth);
+        return -1;
+    }
+
+    printf("ok   landing %s\n", c->name);
+
+    return 0;
+}
+
+static int
+test_jumps(void)
+{
+    uint8_t out[A64_JMP_FAR];
+    uint32_t insn;
+    uint64_t address;
+
+    if(omni_a64_b(TEST_SRC, TEST_OUT) != 0x14100000 ||
+        omni_a64_b(TEST_OUT, TEST_SRC) != 0x17f00000 ||
+        omni_a64_b(TEST_SRC, TEST_FAR) != 0 ||
+        omni_a64_b(TEST_SRC, TEST_SRC + 2) != 0) {
+        printf("FAIL b\n");
+        return -1;
+    }
+
+    if(omni_a64_jmp(out, TEST_SRC, TEST_OUT, A64_JMP_NEAR) != A64_JMP_NEAR ||
+        omni_a64_jmp(out, TEST_SRC, TEST_FAR, A64_JMP_NEAR) != 0 ||
+        omni_a64_jmp(out, TEST_SRC, TEST_FAR, A64_JMP_FAR) != A64_JMP_FAR) {
+        printf("FAIL jmp\n");
+        return -1;
+    }
+
+    /* ldr x16, #8; br x16; target */
+    memcpy(&insn, out, A64_INSN);
+    memcpy(&address, out + 8, 8);
+    if(insn != 0x58000050 || address != TEST_FAR) {
+        printf("FAIL jmp far: %08x %llx\n", insn, (unsigned long long)address);
+        return -1;
+    }
+
+    printf("ok   jumps\n");
+
+    return 0;
+}
+
+int
+main(void)
+{
+    unsigned int i;
+    int failed = 0;
+
+    for(i = 0; i < sizeof(relocate_cases) / sizeof(relocate_cases[0]); ++i) {
+        failed += !!test_relocate(&relocate_cases[i]);
+    }
+
+    for(i = 0; i < sizeof(landing_cases) / sizeof(landing_cases[0]); ++i) {
+        failed += !!test_landing(&landing_cases[i]);
+    }
+
+    failed += !!test_jumps();
+
+    printf("%d failed\n", failed);
+
+    return failed ? 1 : 0;
+}